@@ -0,0 +1,94 @@
+"""
+Long-lived frames: a pipeline of generators and a set of asyncio tasks, each
+started once and then kept running (or suspended) for the whole benchmark.
+
+Their lines are all seen within the first few items, but the frames keep
+executing whatever code they started with, so code replaced during
+de-instrumentation doesn't reach them.
+"""
+
+import asyncio
+from collections import deque
+
+ITEMS = 200_000
+WORKERS = 4
+
+
+def numbers():
+    n = 0
+    while True:
+        yield n
+        n += 1
+
+
+def scaled(source, factor):
+    for x in source:
+        yield x * factor
+
+
+def filtered(source, modulus):
+    for x in source:
+        if x % modulus != 0:
+            yield x
+
+
+def window_sums(source, size):
+    window = deque()
+    total = 0
+    for x in source:
+        window.append(x)
+        total += x
+        if len(window) > size:
+            total -= window.popleft()
+        yield total
+
+
+def run_pipeline(items):
+    pipeline = window_sums(filtered(scaled(numbers(), 3), 7), 16)
+
+    checksum = 0
+    for _ in range(items):
+        checksum = (checksum + next(pipeline)) % 1_000_003
+
+    return checksum
+
+
+async def producer(queue, items):
+    for i in range(items):
+        await queue.put(i)
+
+    for _ in range(WORKERS):
+        await queue.put(None)
+
+
+async def worker(queue, results):
+    total = 0
+    while True:
+        item = await queue.get()
+        if item is None:
+            break
+
+        if item % 3 == 0:
+            total += item
+        else:
+            total -= item // 3
+
+    results.append(total)
+
+
+async def run_tasks(items):
+    queue = asyncio.Queue(maxsize=64)
+    results = []
+    await asyncio.gather(producer(queue, items),
+                         *(worker(queue, results) for _ in range(WORKERS)))
+    return sum(results)
+
+
+def bench_pipeline(loops):
+    for _ in range(loops):
+        run_pipeline(ITEMS)
+        asyncio.run(run_tasks(ITEMS // 4))
+
+
+if __name__ == "__main__":
+    bench_pipeline(3)
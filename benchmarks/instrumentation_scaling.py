@@ -0,0 +1,57 @@
+"""Measures how instrumentation time grows with code size.
+
+Instruments generated functions of increasing length, both with Slipcover's
+batched probe insertion and by inserting probes one at a time, printing the
+time per line for each.  Batched insertion should take about constant time per
+line; one at a time, time per line grows with the function's length.
+"""
+import dis
+import sys
+import time
+import types
+from pathlib import Path
+
+sys.path.insert(0, str(Path(__file__).parent.parent))
+from slipcover import slipcover as sc
+from slipcover import bytecode as bc
+
+
+def gen_function(n_lines: int) -> types.CodeType:
+    src = "def f(x):\n" + \
+          "".join(f"  if x == {i}:\n" +
+                  f"    x += 1\n" for i in range(n_lines//2)) + \
+          "  return x\n"
+
+    module = compile(src, "generated", "exec")
+    return next(c for c in module.co_consts if isinstance(c, types.CodeType))
+
+
+def one_at_a_time(co: types.CodeType) -> types.CodeType:
+    ed = bc.Editor(co)
+    func = ed.add_const(print)
+    delta = 0
+    for offset, lineno in dis.findlinestarts(co):
+        delta += ed.insert_function_call(offset+delta, func, (ed.add_const(lineno),))
+    return ed.finish()
+
+
+def best_time(f, co: types.CodeType, tries: int = 3) -> float:
+    best = None
+    for _ in range(tries):
+        begin = time.perf_counter()
+        f(co)
+        elapsed = time.perf_counter() - begin
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+if __name__ == "__main__":
+    print(f"{'lines':>8}  {'batched':>10}  {'us/line':>8}  {'1-at-a-time':>11}  {'us/line':>8}")
+    for n_lines in [1_000, 2_000, 4_000, 8_000, 16_000, 32_000]:
+        co = gen_function(n_lines)
+
+        batched = best_time(lambda co: sc.Slipcover().instrument(co), co)
+        sequential = best_time(one_at_a_time, co)
+
+        print(f"{n_lines:>8}  {batched:>10.4f}  {1e6*batched/n_lines:>8.2f}" +
+              f"  {sequential:>11.4f}  {1e6*sequential/n_lines:>8.2f}")
@@ -0,0 +1,1695 @@
+#define PY_SSIZE_T_CLEAN    // programmers love obscure statements
+#include <Python.h>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "pyptr.h"
+#include "bytecode.h"
+
+// The editor implements bytecode rewriting for the layouts used by Python 3.8 - 3.11;
+// the opcodes' numbers, argument encoding and inline caches are specialized at compile time.
+#if PY_VERSION_HEX < 0x030c0000
+
+#include <opcode.h>
+
+#define PYTHON_311_OR_LATER (PY_VERSION_HEX >= 0x030b0000)
+
+namespace {
+
+// Python 3.10a7 changed branch opcodes' argument to mean instruction
+// (word) offset, rather than bytecode offset.
+#if PY_VERSION_HEX >= 0x030a0000
+inline long offset2branch(long offset) { return offset/2; }
+inline long branch2offset(long arg) { return arg*2; }
+#else
+inline long offset2branch(long offset) { return offset; }
+inline long branch2offset(long arg) { return arg; }
+#endif
+
+
+inline bool is_extended_arg(int op) {
+#if PYTHON_311_OR_LATER
+    return op == EXTENDED_ARG || op == EXTENDED_ARG_QUICK;
+#else
+    return op == EXTENDED_ARG;
+#endif
+}
+
+
+/**
+ * Returns the number of inline cache entries following an opcode.
+ */
+inline int inline_cache_entries(int op) {
+#if PYTHON_311_OR_LATER
+    switch (op) {
+        case BINARY_SUBSCR: return 4;
+        case STORE_SUBSCR: return 1;
+        case UNPACK_SEQUENCE: return 1;
+        case STORE_ATTR: return 4;
+        case LOAD_ATTR: return 4;
+        case COMPARE_OP: return 2;
+        case LOAD_GLOBAL: return 5;
+        case BINARY_OP: return 1;
+        case LOAD_METHOD: return 10;
+        case PRECALL: return 1;
+        case CALL: return 4;
+    }
+#endif
+    return 0;
+}
+
+
+enum class BranchKind { NONE, ABSOLUTE, FORWARD, BACKWARD };
+
+/**
+ * Classifies an opcode as to whether (and how) it branches.
+ */
+inline BranchKind branch_kind(int op) {
+    switch (op) {
+#if PYTHON_311_OR_LATER
+        case FOR_ITER:
+        case JUMP_FORWARD:
+        case JUMP_IF_FALSE_OR_POP:
+        case JUMP_IF_TRUE_OR_POP:
+        case POP_JUMP_FORWARD_IF_FALSE:
+        case POP_JUMP_FORWARD_IF_TRUE:
+        case POP_JUMP_FORWARD_IF_NONE:
+        case POP_JUMP_FORWARD_IF_NOT_NONE:
+        case SEND:
+            return BranchKind::FORWARD;
+
+        case JUMP_BACKWARD:
+        case JUMP_BACKWARD_NO_INTERRUPT:
+        case POP_JUMP_BACKWARD_IF_FALSE:
+        case POP_JUMP_BACKWARD_IF_TRUE:
+        case POP_JUMP_BACKWARD_IF_NONE:
+        case POP_JUMP_BACKWARD_IF_NOT_NONE:
+            return BranchKind::BACKWARD;
+#else
+        case FOR_ITER:
+        case JUMP_FORWARD:
+        case SETUP_FINALLY:
+        case SETUP_WITH:
+        case SETUP_ASYNC_WITH:
+#if PY_VERSION_HEX < 0x03090000
+        case CALL_FINALLY:
+#endif
+            return BranchKind::FORWARD;
+
+        case JUMP_ABSOLUTE:
+        case JUMP_IF_FALSE_OR_POP:
+        case JUMP_IF_TRUE_OR_POP:
+        case POP_JUMP_IF_FALSE:
+        case POP_JUMP_IF_TRUE:
+#if PY_VERSION_HEX >= 0x03090000
+        case JUMP_IF_NOT_EXC_MATCH:
+#endif
+            return BranchKind::ABSOLUTE;
+#endif
+    }
+    return BranchKind::NONE;
+}
+
+
+/**
+ * Returns the number of EXTENDED_ARGs needed for an argument.
+ */
+inline int arg_ext_needed(unsigned long arg) {
+    return arg < 0x100 ? 0 : arg < 0x10000 ? 1 : arg < 0x1000000 ? 2 : 3;
+}
+
+
+/**
+ * Emits an opcode and its (variable length) argument.
+ */
+void opcode_arg(std::vector<uint8_t>& code, int opcode, unsigned long arg, int min_ext = 0) {
+    int ext = std::max(arg_ext_needed(arg), min_ext);
+    for (int i = 0; i < ext; ++i) {
+        code.push_back(EXTENDED_ARG);
+        code.push_back((arg >> (ext - i) * 8) & 0xFF);
+    }
+    code.push_back(opcode);
+    code.push_back(arg & 0xFF);
+    for (int i = inline_cache_entries(opcode); i > 0; --i) {
+#if PYTHON_311_OR_LATER
+        code.push_back(CACHE);
+        code.push_back(0);
+#endif
+    }
+}
+
+
+/**
+ * Describes an instruction, as unpacked from bytecode.
+ */
+struct Instruction {
+    size_t offset;  // including that of the first EXTENDED_ARG, if any
+    size_t length;  // offset + length is where the next opcode starts
+    int opcode;
+    unsigned long arg;  // decoded
+};
+
+
+/**
+ * Unpacks opcodes and their arguments, invoking f(Instruction) for each;
+ * stops early if f returns false.
+ */
+template <class F>
+void unpack_opargs(const uint8_t* code, size_t len, F f) {
+    unsigned long ext_arg = 0;
+    size_t next_off = 0;
+    for (size_t off = 0; off+1 < len; off += 2) {
+        int op = code[off];
+        if (is_extended_arg(op)) {
+            ext_arg = (ext_arg | code[off+1]) << 8;
+        }
+        else {
+            unsigned long arg = ext_arg | code[off+1];
+            off = std::min(off + 2*inline_cache_entries(op), len-2);
+            if (!f(Instruction{next_off, off+2-next_off, op, arg})) return;
+            ext_arg = 0;
+            next_off = off+2;
+        }
+    }
+}
+
+
+/**
+ * Calculates the maximum stack size for code to execute.
+ *
+ * Assumes linear execution (i.e., not things like a loop pushing to the stack).
+ */
+int calc_max_stack(const std::vector<uint8_t>& code) {
+    int max_stack = 0, stack = 0;
+    unpack_opargs(code.data(), code.size(), [&](const Instruction& ins) {
+        stack += PyCompile_OpcodeStackEffect(ins.opcode, ins.opcode >= HAVE_ARGUMENT ? ins.arg : 0);
+        max_stack = std::max(stack, max_stack);
+        return true;
+    });
+    return max_stack;
+}
+
+
+/**
+ * Describes a branch instruction.
+ */
+struct Branch {
+    size_t offset;  // if EXTENDED_ARGs are used, that of the first EXTENDED_ARG
+    size_t length;  // including that of any EXTENDED_ARGs
+    int opcode;
+    BranchKind kind;
+    size_t target;
+    size_t orig_offset; // offset in the code as given to the editor
+
+    Branch(const Instruction& ins, BranchKind kind) :
+        offset(ins.offset), length(ins.length), opcode(ins.opcode), kind(kind),
+        orig_offset(ins.offset) {
+        switch (kind) {
+            case BranchKind::ABSOLUTE: target = branch2offset(ins.arg); break;
+            case BranchKind::BACKWARD: target = offset + length - branch2offset(ins.arg); break;
+            default: target = offset + length + branch2offset(ins.arg); break;
+        }
+    }
+
+    /**
+     * Returns this branch's opcode argument.
+     */
+    unsigned long arg() const {
+        if (kind == BranchKind::ABSOLUTE) {
+            return offset2branch(target);
+        }
+
+        long end = offset + length;
+        return offset2branch(std::abs(static_cast<long>(target) - end));
+    }
+
+    /**
+     * Adjusts this branch after a code insertion.
+     */
+    void adjust(size_t insert_offset, long insert_length) {
+        if (offset >= insert_offset) offset += insert_length;
+        if (target > insert_offset) target += insert_length;
+    }
+
+    /**
+     * Returns the opcode length needed to express this branch's argument.
+     */
+    size_t length_needed() const {
+        return 2 + 2*arg_ext_needed(arg());
+    }
+
+    /**
+     * Emits this branch's code.
+     */
+    void code(std::vector<uint8_t>& code) const {
+        opcode_arg(code, opcode, arg(), (length-2)/2);
+    }
+};
+
+
+/**
+ * Represents an entry from Python 3.11+'s exception table.
+ */
+struct ExceptionTableEntry {
+    size_t start;
+    size_t end;
+    size_t target;
+    unsigned long other;
+
+    /**
+     * Adjusts this exception table entry, handling a code insertion.
+     */
+    void adjust(size_t insert_offset, long insert_length) {
+        if (insert_offset <= start) start += insert_length;
+        if (insert_offset < end) end += insert_length;
+        if (insert_offset < target) target += insert_length;
+    }
+};
+
+
+/**
+ * Describes a range of bytecode offsets belonging to a line of Python source code.
+ */
+struct LineEntry {
+    size_t start;
+    size_t end;
+    long number;    // negative if the code has no line
+
+    /**
+     * Adjusts this line after a code insertion.
+     */
+    void adjust(size_t insert_offset, long insert_length) {
+        if (start > insert_offset) start += insert_length; // note this may extend/shrink the line
+        if (end > insert_offset) end += insert_length;
+    }
+};
+
+
+/**
+ * Describes code to be inserted at a given offset.
+ *
+ * If fall_through is set, the code is only reached by falling into it from the preceding
+ * instruction: jumps to the offset, and any line starting there, move past it.  At a given
+ * offset, such insertions must precede any others.
+ */
+struct Insertion {
+    size_t offset;
+    std::vector<uint8_t> code;
+    bool fall_through = false;
+};
+
+
+/**
+ * Returns whether a branch opcode is conditional, so that it has both a target
+ * and a fall-through destination.
+ */
+inline bool is_conditional_branch(int op) {
+    switch (op) {
+        case FOR_ITER:
+        case JUMP_IF_FALSE_OR_POP:
+        case JUMP_IF_TRUE_OR_POP:
+#if PYTHON_311_OR_LATER
+        case POP_JUMP_FORWARD_IF_FALSE:
+        case POP_JUMP_FORWARD_IF_TRUE:
+        case POP_JUMP_FORWARD_IF_NONE:
+        case POP_JUMP_FORWARD_IF_NOT_NONE:
+        case POP_JUMP_BACKWARD_IF_FALSE:
+        case POP_JUMP_BACKWARD_IF_TRUE:
+        case POP_JUMP_BACKWARD_IF_NONE:
+        case POP_JUMP_BACKWARD_IF_NOT_NONE:
+#else
+        case POP_JUMP_IF_FALSE:
+        case POP_JUMP_IF_TRUE:
+#endif
+            return true;
+    }
+    return false;
+}
+
+
+/**
+ * Returns whether a branch opcode always jumps (and checks for interrupts, if it
+ * may jump backward).
+ */
+inline bool is_unconditional_jump(int op) {
+    switch (op) {
+        case JUMP_FORWARD:
+#if PYTHON_311_OR_LATER
+        case JUMP_BACKWARD:
+#else
+        case JUMP_ABSOLUTE:
+#endif
+            return true;
+    }
+    return false;
+}
+
+
+#if PYTHON_311_OR_LATER
+/**
+ * Returns the forward jumping equivalent of a (possibly backward) jump.
+ */
+inline int forward_branch_opcode(int op) {
+    switch (op) {
+        case JUMP_BACKWARD: return JUMP_FORWARD;
+        case POP_JUMP_BACKWARD_IF_FALSE: return POP_JUMP_FORWARD_IF_FALSE;
+        case POP_JUMP_BACKWARD_IF_TRUE: return POP_JUMP_FORWARD_IF_TRUE;
+        case POP_JUMP_BACKWARD_IF_NONE: return POP_JUMP_FORWARD_IF_NONE;
+        case POP_JUMP_BACKWARD_IF_NOT_NONE: return POP_JUMP_FORWARD_IF_NOT_NONE;
+    }
+    return op;
+}
+#endif
+
+
+#if PYTHON_311_OR_LATER
+/**
+ * Appends a (little endian) variable length unsigned integer.
+ */
+void append_varint(std::vector<uint8_t>& data, unsigned long n) {
+    while (n > 0x3f) {
+        data.push_back(0x40|(n&0x3f));
+        n >>= 6;
+    }
+    data.push_back(n);
+}
+
+
+/**
+ * Appends a (little endian) variable length signed integer.
+ */
+void append_svarint(std::vector<uint8_t>& data, long n) {
+    append_varint(data, n < 0 ? ((static_cast<unsigned long>(-n))<<1)|1
+                              : static_cast<unsigned long>(n)<<1);
+}
+
+
+/**
+ * Appends a (big endian) variable length unsigned integer.
+ */
+void append_varint_be(std::vector<uint8_t>& data, unsigned long n, uint8_t mark_first = 0) {
+    size_t first = data.size();
+    if (n) {
+        int top_bit = 0;
+        while (n >> (top_bit+1)) ++top_bit;
+        for (int shift = top_bit - top_bit%6; shift > 0; shift -= 6) {
+            data.push_back(0x40|((n >> shift)&0x3f));
+        }
+    }
+    data.push_back(n&0x3f);
+    data[first] |= mark_first;
+}
+
+
+/**
+ * Decodes a (big endian) variable length unsigned integer; returns false at the end of data.
+ */
+bool read_varint_be(const uint8_t*& it, const uint8_t* end, unsigned long& value) {
+    if (it == end) return false;
+
+    value = 0;
+    uint8_t b;
+    while ((b = *it++) & 0x40) {
+        value |= b & 0x3f;
+        value <<= 6;
+        if (it == end) return false;
+    }
+    value |= b & 0x3f;
+    return true;
+}
+#endif
+
+
+#if PY_VERSION_HEX < 0x030a0000
+/**
+ * Generates the line number table used by Python 3.9- to map offsets to line numbers.
+ */
+void make_lnotab(std::vector<uint8_t>& lnotab, long firstlineno, const std::vector<LineEntry>& lines) {
+    size_t prev_start = 0;
+    long prev_number = firstlineno;
+
+    for (auto& l : lines) {
+        if (l.number < 0) continue; // can't express "no line"; it goes with the previous line
+
+        long delta_start = l.start - prev_start;
+        long delta_number = l.number - prev_number;
+
+        while (delta_start > 255) {
+            lnotab.insert(lnotab.end(), {255, 0});
+            delta_start -= 255;
+        }
+
+        while (delta_number > 127) {
+            lnotab.insert(lnotab.end(), {uint8_t(delta_start), 127});
+            delta_start = 0;
+            delta_number -= 127;
+        }
+
+        while (delta_number < -128) {
+            lnotab.insert(lnotab.end(), {uint8_t(delta_start), uint8_t(-128 & 0xFF)});
+            delta_start = 0;
+            delta_number += 128;
+        }
+
+        if (delta_start || delta_number) {
+            lnotab.insert(lnotab.end(), {uint8_t(delta_start), uint8_t(delta_number & 0xFF)});
+        }
+
+        prev_start = l.start;
+        prev_number = l.number;
+    }
+}
+#endif
+
+
+#if PY_VERSION_HEX >= 0x030a0000 && !PYTHON_311_OR_LATER
+/**
+ * Generates the line number table used by Python 3.10 to map offsets to line numbers.
+ */
+void make_linetable_310(std::vector<uint8_t>& linetable, long firstlineno,
+                        const std::vector<LineEntry>& lines) {
+    size_t prev_end = 0;
+    long prev_number = firstlineno;
+
+    for (auto& l : lines) {
+        long gap = (l.number < 0 ? l.end : l.start) - prev_end;
+        if (gap) {
+            while (gap > 254) {
+                linetable.insert(linetable.end(), {254, uint8_t(-128 & 0xFF)});
+                gap -= 254;
+            }
+
+            linetable.insert(linetable.end(), {uint8_t(gap), uint8_t(-128 & 0xFF)});
+            prev_end += gap;
+        }
+        if (l.number < 0) continue;
+
+        long delta_end = l.end - prev_end;
+        long delta_number = l.number - prev_number;
+
+        while (delta_number > 127) {
+            linetable.insert(linetable.end(), {0, 127});
+            delta_number -= 127;
+        }
+
+        while (delta_number < -127) {
+            linetable.insert(linetable.end(), {0, uint8_t(-127 & 0xFF)});
+            delta_number += 127;
+        }
+
+        while (delta_end > 254) {
+            linetable.insert(linetable.end(), {254, uint8_t(delta_number & 0xFF)});
+            delta_number = 0;
+            delta_end -= 254;
+        }
+
+        linetable.insert(linetable.end(), {uint8_t(delta_end), uint8_t(delta_number & 0xFF)});
+        prev_number = l.number;
+        prev_end = l.end;
+    }
+}
+#endif
+
+
+#if PYTHON_311_OR_LATER
+/**
+ * Generates the positions table used by Python 3.11+ to map offsets to line numbers.
+ */
+void make_linetable_311(std::vector<uint8_t>& linetable, long firstlineno,
+                        const std::vector<LineEntry>& lines) {
+    size_t prev_end = 0;
+    long prev_number = firstlineno;
+
+    for (auto& l : lines) {
+        size_t no_location_end = l.number < 0 ? l.end : l.start;
+        if (prev_end < no_location_end) {
+            for (long bytecodes = (no_location_end - prev_end)/2; bytecodes > 0; bytecodes -= 8) {
+                linetable.push_back(0x80|(15<<3)|(std::min(bytecodes, 8L)-1));    // no location
+            }
+            prev_end = no_location_end;
+        }
+        if (l.number < 0) continue;
+
+        long line_delta = l.number - prev_number;
+        for (long bytecodes = (l.end - l.start)/2; bytecodes > 0; bytecodes -= 8) {
+            linetable.push_back(0x80|(13<<3)|(std::min(bytecodes, 8L)-1));  // no column
+            append_svarint(linetable, line_delta);
+            line_delta = 0;
+        }
+
+        prev_number = l.number;
+        prev_end = l.end;
+    }
+}
+#endif
+
+
+/**
+ * Finds the offsets in a code object that start lines in the source, like dis.findlinestarts.
+ */
+bool find_line_starts(PyObject* code, size_t code_len, std::vector<std::pair<size_t, long>>& starts) {
+#if PY_VERSION_HEX >= 0x030a0000
+    PyPtr<> lines = PyObject_CallMethod(code, "co_lines", NULL);
+    if (!lines) return false;
+
+    PyPtr<> it = PyObject_GetIter(lines);
+    if (!it) return false;
+
+    PyPtr<> lastline = PyPtr<>::borrowed(Py_None);
+    while (PyObject* item = PyIter_Next(it)) {
+        PyPtr<> t = item;
+        PyObject* line = PyTuple_GetItem(t, 2);  // borrowed
+        if (!line) return false;
+
+        if (line != Py_None) {
+            int eq = (lastline == Py_None) ? 0 : PyObject_RichCompareBool(line, lastline, Py_EQ);
+            if (eq < 0) return false;
+            if (!eq) {
+                lastline = PyPtr<>::borrowed(line);
+                starts.emplace_back(PyLong_AsSize_t(PyTuple_GetItem(t, 0)), PyLong_AsLong(line));
+            }
+        }
+    }
+    return !PyErr_Occurred();
+#else
+    PyPtr<> lnotab = PyObject_GetAttrString(code, "co_lnotab");
+    if (!lnotab) return false;
+    PyPtr<> firstlineno = PyObject_GetAttrString(code, "co_firstlineno");
+    if (!firstlineno) return false;
+
+    const uint8_t* table = reinterpret_cast<const uint8_t*>(PyBytes_AsString(lnotab));
+    if (!table) return false;
+    Py_ssize_t table_len = PyBytes_Size(lnotab);
+
+    bool have_last = false;
+    long lastlineno = 0;
+    long lineno = PyLong_AsLong(firstlineno);
+    size_t addr = 0;
+    for (Py_ssize_t i = 0; i+1 < table_len; i += 2) {
+        int byte_incr = table[i];
+        int line_incr = table[i+1];
+        if (byte_incr) {
+            if (!have_last || lineno != lastlineno) {
+                starts.emplace_back(addr, lineno);
+                lastlineno = lineno;
+                have_last = true;
+            }
+            addr += byte_incr;
+            if (addr >= code_len) {
+                // The rest of the lnotab byte offsets are past the end of
+                // the bytecode, so the lines were optimized away.
+                return true;
+            }
+        }
+        if (line_incr >= 0x80) {
+            line_incr -= 0x100; // line_increments is an array of 8-bit signed integers
+        }
+        lineno += line_incr;
+    }
+    if (!have_last || lineno != lastlineno) {
+        starts.emplace_back(addr, lineno);
+    }
+    return true;
+#endif
+}
+
+
+PyObject*
+bytes_from(const std::vector<uint8_t>& data) {
+    return PyBytes_FromStringAndSize(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+
+/**
+ * Implements a bytecode editor.
+ */
+class Editor {
+    PyPtr<> _orig_code;
+    std::vector<uint8_t> _orig_bytes;
+
+    PyPtr<> _consts;
+    bool _patched;
+    std::vector<uint8_t> _patch;
+
+    bool _have_tables;
+    std::vector<Branch> _branches;
+    std::vector<ExceptionTableEntry> _ex_table;
+    std::vector<LineEntry> _lines;
+
+    int _max_addtl_stack;
+    bool _finished;
+
+    bool ensure_consts() {
+        if (!_consts) {
+            PyPtr<> consts = PyObject_GetAttrString(_orig_code, "co_consts");
+            if (!consts) return false;
+            _consts = PySequence_List(consts);
+        }
+        return _consts != nullptr;
+    }
+
+    void ensure_patch() {
+        if (!_patched) {
+            _patch = _orig_bytes;
+            _patched = true;
+        }
+    }
+
+    bool ensure_tables() {
+        if (_have_tables) return true;
+
+        const uint8_t* code = _orig_bytes.data();
+        size_t len = _orig_bytes.size();
+
+        unpack_opargs(code, len, [&](const Instruction& ins) {
+            BranchKind kind = branch_kind(ins.opcode);
+            if (kind != BranchKind::NONE) {
+                _branches.emplace_back(ins, kind);
+            }
+            return true;
+        });
+
+#if PYTHON_311_OR_LATER
+        PyPtr<> ex_table = PyObject_GetAttrString(_orig_code, "co_exceptiontable");
+        if (!ex_table) return false;
+
+        const uint8_t* it = reinterpret_cast<const uint8_t*>(PyBytes_AsString(ex_table));
+        if (!it) return false;
+        const uint8_t* end = it + PyBytes_Size(ex_table);
+
+        unsigned long start, length, target, other;
+        while (read_varint_be(it, end, start) && read_varint_be(it, end, length) &&
+               read_varint_be(it, end, target) && read_varint_be(it, end, other)) {
+            _ex_table.push_back(ExceptionTableEntry{
+                static_cast<size_t>(branch2offset(start)),
+                static_cast<size_t>(branch2offset(start) + branch2offset(length)),
+                static_cast<size_t>(branch2offset(target)),
+                other
+            });
+        }
+#endif
+
+        std::vector<std::pair<size_t, long>> starts;
+        if (!find_line_starts(_orig_code, len, starts)) return false;
+
+        for (size_t i = 0; i < starts.size(); ++i) {
+            size_t end = (i+1 < starts.size()) ? starts[i+1].first : len;
+            _lines.push_back(LineEntry{starts[i].first, end, starts[i].second});
+        }
+
+        _have_tables = true;
+        return true;
+    }
+
+    void adjust_all(size_t insert_offset, long insert_length) {
+        for (auto& l : _lines) l.adjust(insert_offset, insert_length);
+        for (auto& b : _branches) b.adjust(insert_offset, insert_length);
+        for (auto& e : _ex_table) e.adjust(insert_offset, insert_length);
+    }
+
+    /**
+     * Applies a set of insertions, sorted by offset, in a single pass over the code.
+     * The result is the same as inserting them one at a time and calling adjust_all
+     * after each, but in time linear in the code size rather than proportional
+     * to the number of insertions times the code size.
+     *
+     * If branches_stay is set, a branch at an insertion's offset isn't moved past it;
+     * that's used to make room for a branch's own EXTENDED_ARGs.  Jumps to an offset
+     * (and lines starting at it) enter any insertions there, except fall-through ones.
+     */
+    void apply_insertions(const std::vector<Insertion>& insertions, bool branches_stay = false) {
+        if (insertions.empty()) return;
+
+        // before[x] is the number of bytes inserted at offsets < x;
+        // before[x+1] is thus the number inserted at offsets <= x.
+        const size_t len = _patch.size();
+        std::vector<size_t> before(len+2, 0);
+        {
+            size_t total = 0;
+            size_t x = 0;
+            for (const auto& ins : insertions) {
+                for (; x <= ins.offset; ++x) before[x] = total;
+                total += ins.code.size();
+            }
+            for (; x < before.size(); ++x) before[x] = total;
+        }
+
+        // entry[x] is before[x] plus any fall-through code inserted at x
+        std::vector<size_t> entry;
+        for (const auto& ins : insertions) {
+            if (ins.fall_through) {
+                if (entry.empty()) entry = before;
+                entry[ins.offset] += ins.code.size();
+            }
+        }
+        const std::vector<size_t>& into = entry.empty() ? before : entry;
+
+        std::vector<uint8_t> patch;
+        patch.reserve(len + before[len+1]);
+        size_t copied = 0;
+        for (const auto& ins : insertions) {
+            patch.insert(patch.end(), _patch.begin() + copied, _patch.begin() + ins.offset);
+            patch.insert(patch.end(), ins.code.begin(), ins.code.end());
+            copied = ins.offset;
+        }
+        patch.insert(patch.end(), _patch.begin() + copied, _patch.end());
+        _patch.swap(patch);
+
+        // The comparisons in each adjust() determine which of before[x] or before[x+1] applies
+        for (auto& l : _lines) {
+            l.start += into[l.start];
+            l.end += into[l.end];
+        }
+        for (auto& b : _branches) {
+            b.offset += before[branches_stay ? b.offset : b.offset+1];
+            b.target += into[b.target];
+        }
+        for (auto& e : _ex_table) {
+            e.start += before[e.start+1];
+            e.end += before[e.end];
+            e.target += into[e.target];
+        }
+    }
+
+    /**
+     * Emits the code for calling a function, whose const index is given, with
+     * arguments also given by const index.
+     */
+    bool function_call(std::vector<uint8_t>& insert, unsigned long function,
+                       const std::vector<unsigned long>& arg_indices) {
+        insert.push_back(NOP); // for disabling
+        insert.push_back(0);
+
+#if PYTHON_311_OR_LATER
+        opcode_arg(insert, PUSH_NULL, 0);
+        opcode_arg(insert, LOAD_CONST, function);
+        for (auto a : arg_indices) {
+            opcode_arg(insert, LOAD_CONST, a);
+        }
+        opcode_arg(insert, PRECALL, arg_indices.size());
+        opcode_arg(insert, CALL, arg_indices.size());
+#else
+        opcode_arg(insert, LOAD_CONST, function);
+        for (auto a : arg_indices) {
+            opcode_arg(insert, LOAD_CONST, a);
+        }
+        opcode_arg(insert, CALL_FUNCTION, arg_indices.size());
+#endif
+        opcode_arg(insert, POP_TOP, 0);    // ignore return
+
+        long skip = offset2branch(insert.size()-2);
+        if (skip > 255) {
+            PyErr_SetString(PyExc_ValueError, "inserted call too long");
+            return false;
+        }
+        insert[1] = skip;
+
+        _max_addtl_stack = std::max(_max_addtl_stack, calc_max_stack(insert));
+        return true;
+    }
+
+    /**
+     * Reads a sequence of const indices.
+     */
+    static bool const_indices(PyObject* seq, std::vector<unsigned long>& indices) {
+        PyPtr<> it = PyObject_GetIter(seq);
+        if (!it) return false;
+        while (PyObject* a = PyIter_Next(it)) {
+            indices.push_back(PyLong_AsUnsignedLong(a));
+            Py_DecRef(a);
+            if (PyErr_Occurred()) return false;
+        }
+        return !PyErr_Occurred();
+    }
+
+    /**
+     * Locates the opcode that loads an inserted function, returning false if
+     * an inserted function isn't recognized.
+     */
+    bool find_inserted_function(size_t offset, std::vector<Instruction>& loads) {
+        const std::vector<uint8_t>& code = _patched ? _patch : _orig_bytes;
+        if (offset >= code.size() || code[offset] != NOP) return false;
+
+        int state = 0;  // 0: at NOP; 1: after NOP; 2: loading consts
+        unpack_opargs(code.data() + offset, code.size() - offset, [&](const Instruction& ins) {
+            if (state == 0) {
+                state = 1;
+                return true;
+            }
+#if PYTHON_311_OR_LATER
+            if (state == 1 && ins.opcode == PUSH_NULL) {
+                return true;
+            }
+#endif
+            if (ins.opcode == LOAD_CONST) {
+                loads.push_back(ins);
+                state = 2;
+                return true;
+            }
+            return false;
+        });
+
+        for (auto& ins : loads) ins.offset += offset;
+        return !loads.empty();
+    }
+
+public:
+    Editor(PyObject* code) :
+        _orig_code(PyPtr<>::borrowed(code)), _consts(nullptr), _patched(false),
+        _have_tables(false), _max_addtl_stack(0), _finished(false) {}
+
+    bool init() {
+        PyPtr<> co_code = PyObject_GetAttrString(_orig_code, "co_code");
+        if (!co_code) return false;
+
+        char* bytes = PyBytes_AsString(co_code);
+        if (!bytes) return false;
+
+        _orig_bytes.assign(bytes, bytes + PyBytes_Size(co_code));
+        return true;
+    }
+
+    PyObject* set_const(PyObject* index, PyObject* value) {
+        if (!ensure_consts()) return NULL;
+
+        Py_ssize_t i = PyLong_AsSsize_t(index);
+        if (i == -1 && PyErr_Occurred()) return NULL;
+
+        Py_IncRef(value);
+        if (PyList_SetItem(_consts, i, value) < 0) return NULL;
+
+        Py_RETURN_NONE;
+    }
+
+    PyObject* add_const(PyObject* value) {
+        if (!ensure_consts()) return NULL;
+
+        if (PyList_Append(_consts, value) < 0) return NULL;
+        return PyLong_FromSsize_t(PyList_Size(_consts)-1);
+    }
+
+    PyObject* insert_function_call(PyObject* offset_obj, PyObject* function, PyObject* args) {
+        if (!PyLong_Check(function)) {
+            // we only support const references so far
+            PyErr_SetString(PyExc_TypeError, "function must be a const index");
+            return NULL;
+        }
+
+        size_t offset = PyLong_AsSize_t(offset_obj);
+        if (offset == (size_t)-1 && PyErr_Occurred()) return NULL;
+
+        ensure_patch();
+        if (!ensure_tables()) return NULL;
+
+        if (offset > _patch.size()) {
+            PyErr_SetString(PyExc_IndexError, "offset out of range");
+            return NULL;
+        }
+
+        std::vector<unsigned long> arg_indices;
+        if (!const_indices(args, arg_indices)) return NULL;
+
+        std::vector<uint8_t> insert;
+        if (!function_call(insert, PyLong_AsUnsignedLong(function), arg_indices)) return NULL;
+
+        size_t len_insert = insert.size();
+        _patch.insert(_patch.begin() + offset, insert.begin(), insert.end());
+        adjust_all(offset, len_insert);
+
+        return PyLong_FromSize_t(len_insert);
+    }
+
+    /**
+     * Inserts a batch of function calls, given as (offset, function, args) tuples
+     * in ascending offset order, with offsets relative to the code as it is before
+     * the call.  Calls given for the same offset are inserted in the order given.
+     */
+    PyObject* insert_function_calls(PyObject* calls) {
+        ensure_patch();
+        if (!ensure_tables()) return NULL;
+
+        PyPtr<> seq = PySequence_Fast(calls, "calls must be a sequence");
+        if (!seq) return NULL;
+
+        const Py_ssize_t n_calls = PySequence_Fast_GET_SIZE((PyObject*)seq);
+        std::vector<Insertion> insertions;
+        insertions.reserve(n_calls);
+
+        std::vector<unsigned long> arg_indices;
+        size_t total = 0;
+        for (Py_ssize_t i = 0; i < n_calls; ++i) {
+            PyObject* call = PySequence_Fast_GET_ITEM((PyObject*)seq, i);
+            PyObject *offset_obj, *function, *args;
+            if (!PyArg_ParseTuple(call, "OOO", &offset_obj, &function, &args)) return NULL;
+
+            if (!PyLong_Check(function)) {
+                // we only support const references so far
+                PyErr_SetString(PyExc_TypeError, "function must be a const index");
+                return NULL;
+            }
+
+            size_t offset = PyLong_AsSize_t(offset_obj);
+            if (offset == (size_t)-1 && PyErr_Occurred()) return NULL;
+
+            if (offset > _patch.size()) {
+                PyErr_SetString(PyExc_IndexError, "offset out of range");
+                return NULL;
+            }
+            if (!insertions.empty() && offset < insertions.back().offset) {
+                PyErr_SetString(PyExc_ValueError, "calls must be in ascending offset order");
+                return NULL;
+            }
+
+            arg_indices.clear();
+            if (!const_indices(args, arg_indices)) return NULL;
+
+            insertions.push_back(Insertion{offset, {}});
+            if (!function_call(insertions.back().code, PyLong_AsUnsignedLong(function),
+                               arg_indices)) {
+                return NULL;
+            }
+            total += insertions.back().code.size();
+        }
+
+        apply_insertions(insertions);
+        return PyLong_FromSize_t(total);
+    }
+
+    /**
+     * Inserts function calls on the outcomes of conditional branches, given as
+     * (offset, taken, function, args) tuples in ascending offset order, with offsets
+     * those of the branches in the code as given to the editor.  Calls on unconditional
+     * jumps may be inserted as well, as taken.
+     *
+     * A call for a branch not taken is inserted right after it, where it's only reached
+     * by falling through.  A call for a branch taken goes into a trampoline appended to
+     * the code, which then jumps to the branch's original target; the branch is
+     * redirected to the trampoline.
+     */
+    PyObject* insert_branch_calls(PyObject* calls) {
+        ensure_patch();
+        if (!ensure_tables()) return NULL;
+
+        PyPtr<> seq = PySequence_Fast(calls, "calls must be a sequence");
+        if (!seq) return NULL;
+
+        const Py_ssize_t n_calls = PySequence_Fast_GET_SIZE((PyObject*)seq);
+        std::vector<Insertion> fall_throughs;
+        std::vector<std::pair<size_t, std::vector<uint8_t>>> trampolines;  // branch index, call
+
+        std::vector<unsigned long> arg_indices;
+        size_t b_index = 0;
+        for (Py_ssize_t i = 0; i < n_calls; ++i) {
+            PyObject* call = PySequence_Fast_GET_ITEM((PyObject*)seq, i);
+            PyObject *offset_obj, *function, *args;
+            int taken;
+            if (!PyArg_ParseTuple(call, "OpOO", &offset_obj, &taken, &function, &args)) return NULL;
+
+            if (!PyLong_Check(function)) {
+                // we only support const references so far
+                PyErr_SetString(PyExc_TypeError, "function must be a const index");
+                return NULL;
+            }
+
+            size_t offset = PyLong_AsSize_t(offset_obj);
+            if (offset == (size_t)-1 && PyErr_Occurred()) return NULL;
+
+            if (b_index < _branches.size() && offset < _branches[b_index].orig_offset) {
+                PyErr_SetString(PyExc_ValueError, "calls must be in ascending offset order");
+                return NULL;
+            }
+            while (b_index < _branches.size() && _branches[b_index].orig_offset < offset) {
+                ++b_index;
+            }
+            if (b_index == _branches.size() || _branches[b_index].orig_offset != offset ||
+                !(is_conditional_branch(_branches[b_index].opcode) ||
+                  (taken && is_unconditional_jump(_branches[b_index].opcode)))) {
+                PyErr_SetString(PyExc_ValueError, "no conditional branch (or jump, if taken) at offset");
+                return NULL;
+            }
+
+            arg_indices.clear();
+            if (!const_indices(args, arg_indices)) return NULL;
+
+            std::vector<uint8_t> code;
+            if (!function_call(code, PyLong_AsUnsignedLong(function), arg_indices)) return NULL;
+
+            const Branch& b = _branches[b_index];
+            if (taken) {
+                trampolines.emplace_back(b_index, std::move(code));
+            }
+            else {
+                fall_throughs.push_back(Insertion{b.offset + b.length, std::move(code), true});
+            }
+        }
+
+        apply_insertions(fall_throughs);
+
+        for (auto& [index, code] : trampolines) {
+            size_t start = _patch.size();
+            _patch.insert(_patch.end(), code.begin(), code.end());
+
+            Branch& b = _branches[index];
+            size_t target = b.target;
+            b.target = start;
+
+#if PYTHON_311_OR_LATER
+            if (b.kind == BranchKind::BACKWARD) {
+                b.opcode = forward_branch_opcode(b.opcode);
+                b.kind = BranchKind::FORWARD;
+            }
+            Instruction jump{_patch.size(), 2, JUMP_BACKWARD,
+                             static_cast<unsigned long>(offset2branch(_patch.size() + 2 - target))};
+            BranchKind jump_kind = BranchKind::BACKWARD;
+#else
+            Instruction jump{_patch.size(), 2, JUMP_ABSOLUTE,
+                             static_cast<unsigned long>(offset2branch(target))};
+            BranchKind jump_kind = BranchKind::ABSOLUTE;
+#endif
+            _patch.push_back(jump.opcode);
+            _patch.push_back(0);    // written out by finish()
+
+            _lines.push_back(LineEntry{start, _patch.size(), -1});
+            _branches.emplace_back(jump, jump_kind);
+        }
+
+        Py_RETURN_NONE;
+    }
+
+    /**
+     * Inserts, right after each function object is created (by MAKE_FUNCTION), a call
+     * passing it to the function given by const index.  Returns the number of calls
+     * inserted.
+     */
+    PyObject* insert_creation_calls(PyObject* function) {
+        if (!PyLong_Check(function)) {
+            // we only support const references so far
+            PyErr_SetString(PyExc_TypeError, "function must be a const index");
+            return NULL;
+        }
+
+        ensure_patch();
+        if (!ensure_tables()) return NULL;
+
+        // leaves the new function on the stack
+        std::vector<uint8_t> code;
+#if PYTHON_311_OR_LATER
+        opcode_arg(code, COPY, 1);
+        opcode_arg(code, PUSH_NULL, 0);
+        opcode_arg(code, SWAP, 2);
+        opcode_arg(code, LOAD_CONST, PyLong_AsUnsignedLong(function));
+        opcode_arg(code, SWAP, 2);
+        opcode_arg(code, PRECALL, 1);
+        opcode_arg(code, CALL, 1);
+#else
+        opcode_arg(code, DUP_TOP, 0);
+        opcode_arg(code, LOAD_CONST, PyLong_AsUnsignedLong(function));
+        opcode_arg(code, ROT_TWO, 0);
+        opcode_arg(code, CALL_FUNCTION, 1);
+#endif
+        opcode_arg(code, POP_TOP, 0);    // ignore return
+
+        std::vector<Insertion> insertions;
+        unpack_opargs(_patch.data(), _patch.size(), [&](const Instruction& ins) {
+            if (ins.opcode == MAKE_FUNCTION) {
+                insertions.push_back(Insertion{ins.offset + ins.length, code, true});
+            }
+            return true;
+        });
+
+        if (!insertions.empty()) {
+            _max_addtl_stack = std::max(_max_addtl_stack, calc_max_stack(code));
+            apply_insertions(insertions);
+        }
+
+        return PyLong_FromSize_t(insertions.size());
+    }
+
+    /**
+     * Inserts code on entry to a function that returns the result of calling the function
+     * given by const index, passing it a tuple with the function's closure cells and one
+     * with its parameters' values, in order (positional, keyword-only, *args, **kwargs).
+     * The rest of the code is only reached by jumping to it.
+     */
+    PyObject* insert_entry_call(PyObject* function) {
+        if (!PyLong_Check(function)) {
+            // we only support const references so far
+            PyErr_SetString(PyExc_TypeError, "function must be a const index");
+            return NULL;
+        }
+
+        PyCodeObject* co = reinterpret_cast<PyCodeObject*>((PyObject*)_orig_code);
+        int nparams = co->co_argcount + co->co_kwonlyargcount +
+                      ((co->co_flags & CO_VARARGS) ? 1 : 0) + ((co->co_flags & CO_VARKEYWORDS) ? 1 : 0);
+
+        ensure_patch();
+        if (!ensure_tables()) return NULL;
+
+        PyPtr<> varnames = PyObject_GetAttrString(_orig_code, "co_varnames");
+        if (!varnames) return NULL;
+        PyPtr<> cellvars = PyObject_GetAttrString(_orig_code, "co_cellvars");
+        if (!cellvars) return NULL;
+        PyPtr<> freevars = PyObject_GetAttrString(_orig_code, "co_freevars");
+        if (!freevars) return NULL;
+        Py_ssize_t nfree = PyTuple_Size(freevars);
+
+        std::vector<uint8_t> code;
+#if PYTHON_311_OR_LATER
+        opcode_arg(code, PUSH_NULL, 0);
+#endif
+        opcode_arg(code, LOAD_CONST, PyLong_AsUnsignedLong(function));
+
+        for (Py_ssize_t i = 0; i < nfree; ++i) {
+#if PYTHON_311_OR_LATER
+            // cells live among the locals, with free variables last
+            opcode_arg(code, LOAD_CLOSURE, co->co_nlocalsplus - nfree + i);
+#else
+            // cells come first, then free variables
+            opcode_arg(code, LOAD_CLOSURE, PyTuple_Size(cellvars) + i);
+#endif
+        }
+        opcode_arg(code, BUILD_TUPLE, nfree);
+
+        for (int i = 0; i < nparams; ++i) {
+            // parameters captured by inner functions are kept in cells
+            Py_ssize_t cell = PySequence_Index(cellvars, PyTuple_GetItem(varnames, i));
+            if (cell < 0) {
+                PyErr_Clear();
+                opcode_arg(code, LOAD_FAST, i);
+            }
+            else {
+#if PYTHON_311_OR_LATER
+                opcode_arg(code, LOAD_DEREF, i);    // turned into a cell in place
+#else
+                opcode_arg(code, LOAD_DEREF, cell);
+#endif
+            }
+        }
+        opcode_arg(code, BUILD_TUPLE, nparams);
+
+#if PYTHON_311_OR_LATER
+        opcode_arg(code, PRECALL, 2);
+        opcode_arg(code, CALL, 2);
+#else
+        opcode_arg(code, CALL_FUNCTION, 2);
+#endif
+        opcode_arg(code, RETURN_VALUE, 0);
+
+        size_t offset = 0;
+#if PYTHON_311_OR_LATER
+        // after the cells are set up and the frame is resumed
+        unpack_opargs(_patch.data(), _patch.size(), [&](const Instruction& ins) {
+            if (ins.opcode == RESUME) {
+                offset = ins.offset + ins.length;
+                return false;
+            }
+            return true;
+        });
+#endif
+
+        _max_addtl_stack = std::max(_max_addtl_stack, calc_max_stack(code));
+        apply_insertions({Insertion{offset, code, true}});
+
+        if (offset == 0) {
+            // any line starting at the entry now starts after it
+            _lines.insert(_lines.begin(), LineEntry{0, code.size(), co->co_firstlineno});
+        }
+
+        Py_RETURN_NONE;
+    }
+
+    PyObject* get_inserted_function(PyObject* offset_obj) {
+        size_t offset = PyLong_AsSize_t(offset_obj);
+        if (offset == (size_t)-1 && PyErr_Occurred()) return NULL;
+
+        std::vector<Instruction> loads;
+        if (!find_inserted_function(offset, loads)) Py_RETURN_NONE;
+
+        PyPtr<> result = PyList_New(loads.size());
+        if (!result) return NULL;
+        for (size_t i = 0; i < loads.size(); ++i) {
+            PyObject* n = PyLong_FromUnsignedLong(loads[i].arg);
+            if (!n) return NULL;
+            PyList_SET_ITEM((PyObject*)result, i, n);
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+
+    /**
+     * Returns a list of (offset, [function, args...]) tuples, with const indices,
+     * for the inserted function calls found in the code that aren't disabled.
+     */
+    PyObject* get_inserted_functions() {
+        const std::vector<uint8_t>& code = _patched ? _patch : _orig_bytes;
+
+        std::vector<size_t> nops;
+        unpack_opargs(code.data(), code.size(), [&](const Instruction& ins) {
+            if (ins.opcode == NOP) nops.push_back(ins.offset);
+            return true;
+        });
+
+        PyPtr<> result = PyList_New(0);
+        if (!result) return NULL;
+
+        std::vector<Instruction> loads;
+        for (size_t offset : nops) {
+            loads.clear();
+            if (!find_inserted_function(offset, loads)) continue;
+
+            PyPtr<> indices = PyList_New(loads.size());
+            if (!indices) return NULL;
+            for (size_t i = 0; i < loads.size(); ++i) {
+                PyObject* n = PyLong_FromUnsignedLong(loads[i].arg);
+                if (!n) return NULL;
+                PyList_SET_ITEM((PyObject*)indices, i, n);
+            }
+
+            PyPtr<> t = Py_BuildValue("(nO)", static_cast<Py_ssize_t>(offset), (PyObject*)indices);
+            if (!t || PyList_Append(result, t) < 0) return NULL;
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+
+    PyObject* disable_inserted_function(PyObject* offset_obj) {
+        size_t offset = PyLong_AsSize_t(offset_obj);
+        if (offset == (size_t)-1 && PyErr_Occurred()) return NULL;
+
+        ensure_patch();
+        if (offset >= _patch.size() || _patch[offset] != NOP) {
+            PyErr_SetString(PyExc_Exception, "no inserted function at offset");
+            return NULL;
+        }
+
+        _patch[offset] = JUMP_FORWARD;
+        Py_RETURN_NONE;
+    }
+
+    PyObject* replace_inserted_function(PyObject* offset_obj, PyObject* new_func_index) {
+        size_t offset = PyLong_AsSize_t(offset_obj);
+        if (offset == (size_t)-1 && PyErr_Occurred()) return NULL;
+
+        unsigned long index = PyLong_AsUnsignedLong(new_func_index);
+        if (PyErr_Occurred()) return NULL;
+
+        ensure_patch();
+
+        std::vector<Instruction> loads;
+        if (!find_inserted_function(offset, loads)) {
+            PyErr_SetString(PyExc_Exception, "no inserted function at offset");
+            return NULL;
+        }
+
+        const Instruction& load = loads[0];
+        std::vector<uint8_t> replacement;
+        opcode_arg(replacement, load.opcode, index, (load.length-2)/2);
+        if (replacement.size() != load.length) {
+            PyErr_SetString(PyExc_Exception, "replacement function index too large");
+            return NULL;
+        }
+
+        std::copy(replacement.begin(), replacement.end(), _patch.begin() + load.offset);
+        Py_RETURN_NONE;
+    }
+
+    PyObject* replace_global_with_const(PyObject* global_name, PyObject* const_index) {
+        unsigned long index = PyLong_AsUnsignedLong(const_index);
+        if (PyErr_Occurred()) return NULL;
+
+        ensure_patch();
+        if (!ensure_tables()) return NULL;
+
+        PyPtr<> names = PyObject_GetAttrString(_orig_code, "co_names");
+        if (!names) return NULL;
+
+        Py_ssize_t name_index = PySequence_Index(names, global_name);
+        if (name_index < 0) {
+            PyErr_Clear();
+            Py_RETURN_NONE;
+        }
+
+        std::vector<Instruction> load_globals;
+        unpack_opargs(_patch.data(), _patch.size(), [&](const Instruction& ins) {
+            if (ins.opcode == LOAD_GLOBAL) {
+#if PYTHON_311_OR_LATER
+                if (static_cast<Py_ssize_t>(ins.arg>>1) == name_index)
+#else
+                if (static_cast<Py_ssize_t>(ins.arg) == name_index)
+#endif
+                    load_globals.push_back(ins);
+            }
+            return true;
+        });
+
+        long delta = 0;
+        for (auto& ins : load_globals) {
+            std::vector<uint8_t> repl;
+#if PYTHON_311_OR_LATER
+            if (ins.arg & 1) {
+                opcode_arg(repl, PUSH_NULL, 0);
+            }
+#endif
+            opcode_arg(repl, LOAD_CONST, index);
+
+            size_t op_off = ins.offset + delta; // adjust for any other changes
+            _patch.erase(_patch.begin() + op_off, _patch.begin() + op_off + ins.length);
+            _patch.insert(_patch.begin() + op_off, repl.begin(), repl.end());
+
+            long change = static_cast<long>(repl.size()) - static_cast<long>(ins.length);
+            if (change) {
+                adjust_all(op_off, change);
+            }
+
+            delta += change;
+        }
+
+        Py_RETURN_NONE;
+    }
+
+    /**
+     * Finishes editing by writing the changes into the code object being edited, rather
+     * than creating a new one, so that they take effect wherever it's in use, including
+     * in running frames.  Only edits that keep the code's length and constants (disabling
+     * or replacing inserted functions) can be applied this way, and only on 3.11+, where
+     * the code that runs is a copy of its own; before that, it's co_code, an immutable
+     * (and possibly shared) bytes object.
+     */
+    PyObject* finish_in_place() {
+        if (_finished) {
+            PyErr_SetString(PyExc_Exception, "editor already finished");
+            return NULL;
+        }
+        _finished = true;
+
+#if !PYTHON_311_OR_LATER
+        PyErr_SetString(PyExc_NotImplementedError, "editing in place requires Python 3.11+");
+        return NULL;
+#else
+
+        if (!_patched) {
+            Py_IncRef(_orig_code);
+            return _orig_code;
+        }
+
+        if (_consts || _have_tables || _patch.size() != _orig_bytes.size()) {
+            PyErr_SetString(PyExc_ValueError, "edits can't be applied in place");
+            return NULL;
+        }
+
+        PyCodeObject* code = reinterpret_cast<PyCodeObject*>((PyObject*)_orig_code);
+        // what runs is the "adaptive" copy, which specializing may have changed since
+        // co_code (a de-specialized copy) was read; we only write bytes that differ.
+        uint8_t* live = reinterpret_cast<uint8_t*>(_PyCode_CODE(code));
+
+        for (size_t i = 0; i < _patch.size(); ++i) {
+            if (_patch[i] != _orig_bytes[i] && live[i] != _orig_bytes[i]) {
+                PyErr_SetString(PyExc_Exception, "code changed while being edited");
+                return NULL;
+            }
+        }
+
+        for (size_t i = 0; i < _patch.size(); ++i) {
+            if (_patch[i] != _orig_bytes[i]) {
+                live[i] = _patch[i];
+            }
+        }
+
+        Py_CLEAR(code->_co_code);   // cached co_code
+
+        Py_IncRef(_orig_code);
+        return _orig_code;
+#endif
+    }
+
+    PyObject* finish() {
+        if (_finished) {
+            PyErr_SetString(PyExc_Exception, "editor already finished");
+            return NULL;
+        }
+        _finished = true;
+
+        if (!_patched && !_consts) {
+            Py_IncRef(_orig_code);
+            return _orig_code;
+        }
+
+        if (_have_tables) {
+            // A branch's new target may now require more EXTENDED_ARG opcodes to be expressed.
+            // Inserting space for those may in turn trigger needing more space for others...
+            // Each round makes room for all the branches found to need it, in a single pass.
+            std::vector<Insertion> growth;
+            for (;;) {
+                growth.clear();
+                for (auto& b : _branches) {
+                    size_t length_needed = b.length_needed();
+                    if (length_needed > b.length) {
+                        growth.push_back(Insertion{b.offset,
+                                                   std::vector<uint8_t>(length_needed - b.length, 0)});
+                        b.length = length_needed;
+                    }
+                }
+
+                if (growth.empty()) break;
+
+                // the branches are in code order, so growth is sorted by offset
+                apply_insertions(growth, true);
+            }
+
+            std::vector<uint8_t> code;
+            for (auto& b : _branches) {
+                code.clear();
+                b.code(code);
+                std::copy(code.begin(), code.end(), _patch.begin() + b.offset);
+            }
+        }
+
+        PyPtr<> replace = PyDict_New();
+        if (!replace) return NULL;
+
+        if (_consts) {
+            PyPtr<> consts = PyList_AsTuple(_consts);
+            if (!consts || PyDict_SetItemString(replace, "co_consts", consts) < 0) return NULL;
+        }
+
+        if (_max_addtl_stack) {
+            PyPtr<> stacksize = PyObject_GetAttrString(_orig_code, "co_stacksize");
+            if (!stacksize) return NULL;
+
+            PyPtr<> new_stacksize = PyLong_FromLong(PyLong_AsLong(stacksize) + _max_addtl_stack);
+            if (!new_stacksize || PyDict_SetItemString(replace, "co_stacksize", new_stacksize) < 0) {
+                return NULL;
+            }
+        }
+
+        if (_patched) {
+            PyPtr<> code = bytes_from(_patch);
+            if (!code || PyDict_SetItemString(replace, "co_code", code) < 0) return NULL;
+        }
+
+        if (_have_tables) {
+            PyPtr<> firstlineno_obj = PyObject_GetAttrString(_orig_code, "co_firstlineno");
+            if (!firstlineno_obj) return NULL;
+            long firstlineno = PyLong_AsLong(firstlineno_obj);
+
+            std::vector<uint8_t> table;
+#if PY_VERSION_HEX < 0x030a0000
+            make_lnotab(table, firstlineno, _lines);
+            const char* table_name = "co_lnotab";
+#elif !PYTHON_311_OR_LATER
+            make_linetable_310(table, firstlineno, _lines);
+            const char* table_name = "co_linetable";
+#else
+            make_linetable_311(table, firstlineno, _lines);
+            const char* table_name = "co_linetable";
+#endif
+            PyPtr<> linetable = bytes_from(table);
+            if (!linetable || PyDict_SetItemString(replace, table_name, linetable) < 0) return NULL;
+
+#if PYTHON_311_OR_LATER
+            table.clear();
+            for (auto& e : _ex_table) {
+                append_varint_be(table, offset2branch(e.start), 0x80);
+                append_varint_be(table, offset2branch(e.end - e.start));
+                append_varint_be(table, offset2branch(e.target));
+                append_varint_be(table, e.other);
+            }
+
+            PyPtr<> ex_table = bytes_from(table);
+            if (!ex_table || PyDict_SetItemString(replace, "co_exceptiontable", ex_table) < 0) {
+                return NULL;
+            }
+#endif
+        }
+
+        PyPtr<> replace_method = PyObject_GetAttrString(_orig_code, "replace");
+        if (!replace_method) return NULL;
+
+        PyPtr<> no_args = PyTuple_New(0);
+        if (!no_args) return NULL;
+
+        return PyObject_Call(replace_method, no_args, replace);
+    }
+};
+
+
+/**
+ * Python object wrapping an Editor.
+ */
+struct EditorObject {
+    PyObject_HEAD
+    Editor* editor;
+};
+
+
+PyObject*
+Editor_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    PyObject* code;
+    if (!PyArg_ParseTuple(args, "O!", &PyCode_Type, &code)) {
+        return NULL;
+    }
+
+    PyPtr<EditorObject> self = (EditorObject*)type->tp_alloc(type, 0);
+    if (!self) return NULL;
+
+    self->editor = new Editor(code);
+    if (!self->editor->init()) return NULL;
+
+    Py_IncRef((PyObject*)(EditorObject*)self);
+    return (PyObject*)(EditorObject*)self;
+}
+
+
+void
+Editor_dealloc(EditorObject* self) {
+    delete self->editor;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+bool
+check_nargs(Py_ssize_t nargs, Py_ssize_t required) {
+    if (nargs < required) {
+        PyErr_SetString(PyExc_Exception, "Missing argument(s)");
+        return false;
+    }
+    return true;
+}
+
+
+#define EDITOR_METHOD_0(method) \
+    PyObject*\
+    Editor_##method(EditorObject* self, PyObject* const* args, Py_ssize_t nargs) {\
+        return self->editor->method();\
+    }
+
+#define EDITOR_METHOD_1(method) \
+    PyObject*\
+    Editor_##method(EditorObject* self, PyObject* const* args, Py_ssize_t nargs) {\
+        if (!check_nargs(nargs, 1)) return NULL;\
+        return self->editor->method(args[0]);\
+    }
+
+#define EDITOR_METHOD_2(method) \
+    PyObject*\
+    Editor_##method(EditorObject* self, PyObject* const* args, Py_ssize_t nargs) {\
+        if (!check_nargs(nargs, 2)) return NULL;\
+        return self->editor->method(args[0], args[1]);\
+    }
+
+#define EDITOR_METHOD_3(method) \
+    PyObject*\
+    Editor_##method(EditorObject* self, PyObject* const* args, Py_ssize_t nargs) {\
+        if (!check_nargs(nargs, 3)) return NULL;\
+        return self->editor->method(args[0], args[1], args[2]);\
+    }
+
+EDITOR_METHOD_2(set_const);
+EDITOR_METHOD_1(add_const);
+EDITOR_METHOD_3(insert_function_call);
+EDITOR_METHOD_1(insert_function_calls);
+EDITOR_METHOD_1(insert_branch_calls);
+EDITOR_METHOD_1(insert_creation_calls);
+EDITOR_METHOD_1(insert_entry_call);
+EDITOR_METHOD_1(get_inserted_function);
+EDITOR_METHOD_0(get_inserted_functions);
+EDITOR_METHOD_1(disable_inserted_function);
+EDITOR_METHOD_2(replace_inserted_function);
+EDITOR_METHOD_2(replace_global_with_const);
+EDITOR_METHOD_0(finish);
+EDITOR_METHOD_0(finish_in_place);
+
+
+PyMethodDef Editor_methods[] = {
+    {"set_const", (PyCFunction)Editor_set_const, METH_FASTCALL, "sets a constant"},
+    {"add_const", (PyCFunction)Editor_add_const, METH_FASTCALL, "adds a constant, returning its index"},
+    {"insert_function_call", (PyCFunction)Editor_insert_function_call, METH_FASTCALL,
+        "inserts a function call, returning its length"},
+    {"insert_function_calls", (PyCFunction)Editor_insert_function_calls, METH_FASTCALL,
+        "inserts a batch of (offset, function, args) function calls, returning their total length"},
+    {"insert_branch_calls", (PyCFunction)Editor_insert_branch_calls, METH_FASTCALL,
+        "inserts a batch of (offset, taken, function, args) function calls on conditional branches' "
+        "outcomes, or on unconditional jumps (as taken)"},
+    {"insert_creation_calls", (PyCFunction)Editor_insert_creation_calls, METH_FASTCALL,
+        "inserts calls passing each function object created to a function"},
+    {"insert_entry_call", (PyCFunction)Editor_insert_entry_call, METH_FASTCALL,
+        "inserts code on function entry returning a function's result, given the closure and parameters"},
+    {"get_inserted_function", (PyCFunction)Editor_get_inserted_function, METH_FASTCALL,
+        "returns const indices for an inserted function and its arguments, or None"},
+    {"get_inserted_functions", (PyCFunction)Editor_get_inserted_functions, METH_FASTCALL,
+        "returns (offset, const indices) for each inserted function"},
+    {"disable_inserted_function", (PyCFunction)Editor_disable_inserted_function, METH_FASTCALL,
+        "disables an inserted function at a given offset"},
+    {"replace_inserted_function", (PyCFunction)Editor_replace_inserted_function, METH_FASTCALL,
+        "replaces an inserted function by another function"},
+    {"replace_global_with_const", (PyCFunction)Editor_replace_global_with_const, METH_FASTCALL,
+        "replaces a global name lookup by a constant load"},
+    {"finish", (PyCFunction)Editor_finish, METH_FASTCALL,
+        "finishes editing bytecode, returning a new code object"},
+    {"finish_in_place", (PyCFunction)Editor_finish_in_place, METH_FASTCALL,
+        "finishes editing bytecode by patching the code object in place, returning it (3.11+)"},
+    {NULL, NULL, 0, NULL}
+};
+
+
+PyTypeObject EditorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "slipcover.tracker.Editor",             // tp_name
+    sizeof(EditorObject),                   // tp_basicsize
+    0,                                      // tp_itemsize
+    (destructor)Editor_dealloc,             // tp_dealloc
+};
+
+} // namespace
+
+
+int
+bytecode_add_types(PyObject* module) {
+    EditorType.tp_flags = Py_TPFLAGS_DEFAULT;
+    EditorType.tp_doc = "Implements a bytecode editor.";
+    EditorType.tp_methods = Editor_methods;
+    EditorType.tp_new = Editor_new;
+
+    if (PyType_Ready(&EditorType) < 0) {
+        return -1;
+    }
+
+    Py_IncRef((PyObject*)&EditorType);
+    if (PyModule_AddObject(module, "Editor", (PyObject*)&EditorType) < 0) {
+        Py_DecRef((PyObject*)&EditorType);
+        return -1;
+    }
+
+    return 0;
+}
+
+#else   // Python 3.12+
+
+int
+bytecode_add_types(PyObject* module) {
+    return 0;
+}
+
+#endif
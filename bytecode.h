@@ -0,0 +1,12 @@
+#ifndef SLIPCOVER_BYTECODE_H
+#define SLIPCOVER_BYTECODE_H
+
+#include <Python.h>
+
+/**
+ * Adds the native bytecode editor's types to a module.
+ * Returns 0 on success, -1 (with an exception set) on failure.
+ */
+int bytecode_add_types(PyObject* module);
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef SLIPCOVER_COVERAGE_FILE_H
+#define SLIPCOVER_COVERAGE_FILE_H
+
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+/**
+ * A binary coverage file, memory-mapped so that lines seen (and execution counts) land
+ * in it as they happen, and survive the process ending abruptly (being killed, calling
+ * os._exit, etc.).
+ *
+ * The file is a header followed by a sequence of 8-byte aligned records; integers are
+ * in native byte order.
+ *
+ *   header: "SLIPCOV\0", u32 version, u32 flags (COUNTS if execution counts follow bitmaps)
+ *   record: u32 type, u32 size (in bytes, including this), followed by, if of type
+ *     FILE: u32 name length, u32 N, the (UTF-8) file name padded to 8 bytes, then bitmaps
+ *           of the code lines and of the lines seen (N bits each, in u64 words), then,
+ *           if COUNTS, N u64 execution counts.
+ *     PAD:  nothing more; it fills out the space left at the end of a segment.
+ *   A record of type END (0) ends the sequence.
+ *
+ * A source file may have several FILE records, as its code is instrumented piecemeal;
+ * readers combine them, OR'ing bitmaps and adding counts.  Records are written before
+ * their type is set, so that one left half-written reads as the end.
+ *
+ * The file grows by segments, each mapped on its own so that records never move.
+ * Forked children share the mapping, so their lines and counts land in it as well;
+ * only the process that created it adds records, however.  It isn't implemented
+ * on Windows.
+ */
+class CoverageFile {
+public:
+    static constexpr char MAGIC[8] = {'S', 'L', 'I', 'P', 'C', 'O', 'V', '\0'};
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t COUNTS = 1;
+
+    enum RecordType : uint32_t { END = 0, FILE = 1, PAD = 2 };
+
+    /**
+     * The bitmaps and counts of a FILE record, for lines 0..lines-1.
+     */
+    struct Lines {
+        long lines;
+        uint64_t* code;
+        uint64_t* seen;
+        uint64_t* counts;   // nullptr if not counting
+
+        void mark_seen(long line) {
+            if (line < 0 || line >= lines) return;
+            word(seen, line >> 6)->fetch_or(uint64_t(1) << (line & 63), std::memory_order_relaxed);
+        }
+
+        void mark_code(long line) {
+            if (line < 0 || line >= lines) return;
+            word(code, line >> 6)->fetch_or(uint64_t(1) << (line & 63), std::memory_order_relaxed);
+        }
+
+        void count_hit(long line, uint64_t count) {
+            if (!counts || line < 0 || line >= lines) return;
+            word(counts, line)->fetch_add(count, std::memory_order_relaxed);
+        }
+
+    private:
+        static std::atomic<uint64_t>* word(uint64_t* words, size_t index) {
+            static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) &&
+                          std::atomic<uint64_t>::is_always_lock_free,
+                          "mapped words must be usable as atomics");
+            return reinterpret_cast<std::atomic<uint64_t>*>(&words[index]);
+        }
+    };
+
+private:
+    static constexpr size_t SEGMENT_SIZE = 1 << 20;
+    static constexpr size_t HEADER_SIZE = 16;
+    static constexpr size_t RECORD_HEADER_SIZE = 16;
+
+    int _fd;
+    bool _counting;
+    long _owner;    // pid
+    std::vector<std::pair<char*, size_t>> _segments;
+    size_t _file_size;
+    char* _next;    // free space in the last segment
+    char* _end;
+    std::deque<Lines> _lines;   // never moves its elements
+
+    CoverageFile(int fd, bool counting):
+        _fd(fd), _counting(counting), _owner(pid()), _file_size(0),
+        _next(nullptr), _end(nullptr) {}
+
+    static size_t align8(size_t n) {
+        return (n + 7) & ~size_t(7);
+    }
+
+    static long pid() {
+#ifdef _WIN32
+        return _getpid();
+#else
+        return getpid();
+#endif
+    }
+
+    /**
+     * Grows the file by a new segment of at least the given size, mapping it.
+     */
+    bool add_segment(size_t size) {
+#ifdef _WIN32
+        errno = ENOSYS;
+        return false;
+#else
+        size = std::max(SEGMENT_SIZE, (size + SEGMENT_SIZE - 1) / SEGMENT_SIZE * SEGMENT_SIZE);
+        if (ftruncate(_fd, _file_size + size) < 0) return false;
+
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, _file_size);
+        if (p == MAP_FAILED) return false;
+
+        // pad out what's left of the last one, so that records follow each other
+        if (_next && _end - _next >= 8) {
+            write_record_header(_next, PAD, _end - _next);
+        }
+
+        _segments.emplace_back(static_cast<char*>(p), size);
+        _file_size += size;
+        _next = static_cast<char*>(p);
+        _end = _next + size;
+        return true;
+#endif
+    }
+
+    static void write_record_header(char* rec, uint32_t type, size_t size) {
+        uint32_t size32 = static_cast<uint32_t>(size);
+        std::memcpy(rec + 4, &size32, 4);
+        // the type goes last: until then, the record reads as the end
+        reinterpret_cast<std::atomic<uint32_t>*>(rec)->store(type, std::memory_order_release);
+    }
+
+public:
+    ~CoverageFile() {
+#ifndef _WIN32
+        for (auto& segment : _segments) {
+            munmap(segment.first, segment.second);
+        }
+        close(_fd);
+#endif
+    }
+
+    /**
+     * Creates (or truncates) a coverage file, returning nullptr and setting errno on error.
+     */
+    static std::unique_ptr<CoverageFile> create(const char* path, bool counting) {
+#ifdef _WIN32
+        errno = ENOSYS;
+        return nullptr;
+#else
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return nullptr;
+
+        std::unique_ptr<CoverageFile> file(new CoverageFile(fd, counting));
+        if (!file->add_segment(HEADER_SIZE)) return nullptr;
+
+        uint32_t version = VERSION, flags = counting ? COUNTS : 0;
+        std::memcpy(file->_next, MAGIC, sizeof(MAGIC));
+        std::memcpy(file->_next + 8, &version, 4);
+        std::memcpy(file->_next + 12, &flags, 4);
+        file->_next += HEADER_SIZE;
+        return file;
+#endif
+    }
+
+    /**
+     * Adds a FILE record for lines 0..lines-1 of the named file, with the given code
+     * lines set.  Returns nullptr (with errno set) if it can't be added, such as
+     * in a forked child.
+     */
+    Lines* add_file(const std::string& name, long lines, const std::vector<long>& code_lines) {
+        if (pid() != _owner) {
+            errno = EPERM;
+            return nullptr;
+        }
+
+        size_t words = (lines + 63) / 64;
+        size_t size = RECORD_HEADER_SIZE + align8(name.size()) + 2 * words * 8 +
+                      (_counting ? lines * 8 : 0);
+        if (size > UINT32_MAX) {
+            errno = EFBIG;
+            return nullptr;
+        }
+
+        if (static_cast<size_t>(_end - _next) < size && !add_segment(size)) {
+            return nullptr;
+        }
+
+        char* rec = _next;
+        uint32_t name_len = static_cast<uint32_t>(name.size()), lines32 = static_cast<uint32_t>(lines);
+        std::memcpy(rec + 8, &name_len, 4);
+        std::memcpy(rec + 12, &lines32, 4);
+        std::memcpy(rec + RECORD_HEADER_SIZE, name.data(), name.size());
+
+        uint64_t* code = reinterpret_cast<uint64_t*>(rec + RECORD_HEADER_SIZE + align8(name.size()));
+        _lines.push_back(Lines{lines, code, code + words, _counting ? code + 2*words : nullptr});
+
+        for (long line : code_lines) {
+            if (line >= 0 && line < lines) {
+                code[line >> 6] |= uint64_t(1) << (line & 63);
+            }
+        }
+
+        write_record_header(rec, FILE, size);
+        _next += size;
+        return &_lines.back();
+    }
+};
+
+#endif
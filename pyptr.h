@@ -0,0 +1,56 @@
+#ifndef SLIPCOVER_PYPTR_H
+#define SLIPCOVER_PYPTR_H
+
+#include <Python.h>
+
+/**
+ * Implements a smart pointer to a PyObject.
+ */
+template <class O = PyObject>
+class PyPtr {
+public:
+    // assumes a new reference
+    PyPtr(O* o) : _obj(o) {}
+
+    PyPtr(const PyPtr&) = delete;
+
+    static PyPtr borrowed(O* o) {
+        Py_IncRef((PyObject*)o);
+        return PyPtr(o);
+    }
+
+    O* operator->() { return _obj; }
+
+    operator O*() { return _obj; }
+
+    PyPtr& operator=(O* o) {
+        Py_DecRef((PyObject*)_obj);
+        _obj = o;
+        return *this;
+    }
+
+    PyPtr& operator=(PyPtr&& ptr) {
+        if (this != &ptr) {
+            Py_DecRef((PyObject*)_obj);
+            _obj = ptr._obj;
+            ptr._obj = 0;
+        }
+        return *this;
+    }
+
+    PyPtr& operator=(PyPtr& ptr) {
+        Py_IncRef((PyObject*)ptr._obj);
+        *this = ptr._obj;
+        return *this;
+    }
+
+    ~PyPtr() {
+        Py_DecRef((PyObject*)_obj);
+        _obj = 0;
+    }
+
+private:
+    O* _obj;
+};
+
+#endif
@@ -65,7 +65,8 @@ class CppExtension(build_ext):
 
 tracker = setuptools.extension.Extension(
             'slipcover.tracker',
-            sources=['tracker.cxx'],
+            sources=['tracker.cxx', 'bytecode.cxx'],
+            depends=['pyptr.h', 'bytecode.h', 'coverage_file.h'],
             extra_compile_args=cxx_version('c++17') + platform_compile_args() + limited_api_args(),
             extra_link_args=platform_link_args(),
             py_limited_api=bool(limited_api_args()),
@@ -85,8 +86,9 @@ setuptools.setup(
     author_email="juan@altmayer.com, emery@cs.umass.edu",
     license="Apache License 2.0",
     packages=['slipcover'],
+    package_data={'slipcover': ['_startup/sitecustomize.py']},
     ext_modules=([tracker]),
-    python_requires=">=3.8,<3.12",
+    python_requires=">=3.8,<3.13",
     install_requires=[
         "tabulate"
     ],
@@ -96,6 +98,7 @@ setuptools.setup(
         "Programming Language :: Python :: 3.9",
         "Programming Language :: Python :: 3.10",
         "Programming Language :: Python :: 3.11",
+        "Programming Language :: Python :: 3.12",
         "License :: OSI Approved :: Apache Software License",
         "Operating System :: POSIX :: Linux",
         "Operating System :: MacOS :: MacOS X",
@@ -1,51 +1,144 @@
 import sys
+import os
 from pathlib import Path
 from typing import Any, Dict
 from slipcover import slipcover as sc
 from slipcover import bytecode as bc
+from slipcover.importer import SlipcoverMetaPathFinder
+from slipcover import multiprocess
 import atexit
 
 
-from importlib.abc import MetaPathFinder, Loader
-from importlib.util import spec_from_loader
+import argparse
+
+def file_matcher_for(source, omit):
+    file_matcher = sc.FileMatcher()
 
-class SlipcoverLoader(Loader):
-    def __init__(self, sci, orig_loader):
-        self.sci = sci
-        self.orig_loader = orig_loader
+    if source:
+        for s in source.split(','):
+            file_matcher.addSource(s)
 
-    def create_module(self, spec):
-        return self.orig_loader.create_module(spec)
+    if omit:
+        for o in omit.split(','):
+            file_matcher.addOmit(o)
 
-    def get_code(self, name):   # expected by pyrun
-        return self.orig_loader.get_code(name)
+    return file_matcher
 
-    def exec_module(self, module):
-        code = self.orig_loader.get_code(module.__name__)
-        sci.register_module(module)
-        code = sci.instrument(code)
-        exec(code, module.__dict__)
+#
+# Instrumenting ahead of time, for runs using the same cache and options:
+#
+#   slipcover.py precompile --cache-dir DIR [options]
+#
+if sys.argv[1:2] == ['precompile']:
+    ap = argparse.ArgumentParser(prog='slipcover precompile',
+                                 description="instrument matching source files into a cache, in parallel")
+    ap.add_argument('--cache-dir', type=Path, metavar="DIR", required=True,
+                    help="cache to write, for runs with the same --cache-dir")
+    ap.add_argument('--source', help="specify directories to instrument (default: current directory)")
+    ap.add_argument('--omit', help="specify file(s) to omit")
+    ap.add_argument('-j', '--jobs', type=int, metavar="N", help="number of processes (default: one per core)")
+    # these change the instrumentation, and must match the runs'
+    ap.add_argument('--branch', action='store_true', help="as for runs with --branch")
+    ap.add_argument('--tracker-per-code', action='store_true', help="as for runs with --tracker-per-code")
+    ap.add_argument('--in-place', action='store_true', help="as for runs with --in-place")
+    ap.add_argument('--tiered', action='store_true', help="as for runs with --tiered")
+    ap.add_argument('--count', action='store_true', help="as for runs with --count")
+    ap.add_argument('--stats', action='store_true', help=argparse.SUPPRESS)
+    args = ap.parse_args(sys.argv[2:])
+
+    if sc.PYTHON_VERSION >= (3,12):
+        print("slipcover precompile: nothing to do, as Python 3.12+ code isn't modified")
+        sys.exit(0)
+
+    file_matcher = file_matcher_for(args.source, args.omit)
+    roots = file_matcher.sources if file_matcher.sources else [file_matcher.cwd]
+    files = sorted({p.resolve() for root in roots for p in Path(root).rglob('*.py')
+                    if file_matcher.matches(p.resolve())})
+
+    added = sc.precompile_files(files, jobs=args.jobs, cache_dir=args.cache_dir,
+                                collect_stats=args.stats, branch=args.branch,
+                                tracker_per_code=args.tracker_per_code, in_place=args.in_place,
+                                tiered=args.tiered, count_lines=args.count)
+    print(f"slipcover precompile: {added} of {len(files)} files added to {args.cache_dir}")
+    sys.exit(0)
 
-class SlipcoverMetaPathFinder(MetaPathFinder):
-    def __init__(self, args, sci, file_matcher, meta_path):
-        self.args = args
-        self.sci = sci
-        self.file_matcher = file_matcher
-        self.meta_path = meta_path
+#
+# Converting a coverage file, as written with --coverage-file, to JSON:
+#
+#   slipcover.py convert FILE [options]
+#
+if sys.argv[1:2] == ['convert']:
+    ap = argparse.ArgumentParser(prog='slipcover convert',
+                                 description="convert a coverage file to JSON, as with --json")
+    ap.add_argument('coverage_file', type=Path, metavar="FILE", help="the coverage file")
+    ap.add_argument('--out', type=Path, help="specify output file name")
+    ap.add_argument('--pretty-print', action='store_true', help="pretty-print JSON output")
+    args = ap.parse_args(sys.argv[2:])
+
+    import json
+    try:
+        cov = sc.read_coverage_file(args.coverage_file)
+    except (OSError, ValueError) as e:
+        print(f"slipcover convert: {e}", file=sys.stderr)
+        sys.exit(1)
 
-    def find_spec(self, fullname, path, target=None):
-        if self.args.debug:
-            print(f"Looking for {fullname}")
-        for f in self.meta_path:
-            found = f.find_spec(fullname, path, target) if hasattr(f, 'find_spec') else None
-            if found:
-                if found.origin and file_matcher.matches(found.origin):
-                    if self.args.debug:
-                        print(f"adding {fullname} from {found.origin}")
-                    found.loader = SlipcoverLoader(self.sci, found.loader)
-                return found
+    with (open(args.out, "w") if args.out else sys.stdout) as outfile:
+        print(json.dumps(cov, indent=(4 if args.pretty_print else None)), file=outfile)
+    sys.exit(0)
 
-        return None
+#
+# Combining results (JSON or coverage files) into one, and comparing two of them:
+#
+#   slipcover.py combine [options] FILE...
+#   slipcover.py diff [options] A B
+#
+if sys.argv[1:2] == ['combine']:
+    ap = argparse.ArgumentParser(prog='slipcover combine',
+                                 description="combine coverage results into JSON, in parallel")
+    ap.add_argument('files', type=Path, nargs='+', metavar="FILE",
+                    help="JSON results or coverage files to combine")
+    ap.add_argument('--out', type=Path, help="specify output file name")
+    ap.add_argument('--pretty-print', action='store_true', help="pretty-print JSON output")
+    ap.add_argument('-j', '--jobs', type=int, metavar="N", help="number of processes (default: one per core)")
+    args = ap.parse_args(sys.argv[2:])
+
+    import json
+    from slipcover import combine
+    try:
+        cov = combine.combine(args.files, jobs=args.jobs)
+    except (OSError, ValueError) as e:
+        print(f"slipcover combine: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    with (open(args.out, "w") if args.out else sys.stdout) as outfile:
+        print(json.dumps(combine.to_json(cov), indent=(4 if args.pretty_print else None)), file=outfile)
+    sys.exit(0)
+
+if sys.argv[1:2] == ['diff']:
+    ap = argparse.ArgumentParser(prog='slipcover diff',
+                                 description="show what coverage B gained and lost relative to A")
+    ap.add_argument('a', type=Path, metavar="A", help="JSON results or coverage file (before)")
+    ap.add_argument('b', type=Path, metavar="B", help="JSON results or coverage file (after)")
+    ap.add_argument('--json', action='store_true', help="select JSON output")
+    ap.add_argument('--pretty-print', action='store_true', help="pretty-print JSON output")
+    ap.add_argument('--out', type=Path, help="specify output file name")
+    args = ap.parse_args(sys.argv[2:])
+
+    from slipcover import combine
+    try:
+        a, b = combine.combine([args.a]), combine.combine([args.b])
+    except (OSError, ValueError) as e:
+        print(f"slipcover diff: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    with (open(args.out, "w") if args.out else sys.stdout) as outfile:
+        if args.json:
+            import json
+            print(json.dumps(combine.diff(a, b), indent=(4 if args.pretty_print else None)),
+                  file=outfile)
+        else:
+            combine.print_diff(a, b, outfile)
+    sys.exit(0)
 
 #
 # The intended usage is:
@@ -55,7 +148,6 @@ class SlipcoverMetaPathFinder(MetaPathFinder):
 # but argparse doesn't seem to support this.  We work around that by only
 # showing it what we need.
 #
-import argparse
 ap = argparse.ArgumentParser(prog='slipcover')
 ap.add_argument('--json', action='store_true', help="select JSON output")
 ap.add_argument('--pretty-print', action='store_true', help="pretty-print JSON output")
@@ -63,6 +155,39 @@ ap.add_argument('--out', type=Path, help="specify output file name")
 ap.add_argument('--source', help="specify directories to cover")
 ap.add_argument('--omit', help="specify file(s) to omit")
 ap.add_argument('--threshold', type=int, default=50, metavar="T", help="threshold for de-instrumentation")
+ap.add_argument('--adaptive-threshold', action='store_true',
+                help="adapt each line's threshold to its hit rate and to the cost of de-instrumenting")
+ap.add_argument('--in-place', action='store_true',
+                help="de-instrument by patching code in place, rather than replacing it "
+                     "(Python 3.11+; earlier versions replace it)")
+ap.add_argument('--async-deinstrument', action='store_true',
+                help="de-instrument from a background thread, rather than from the program's own")
+ap.add_argument('--tracker-per-code', action='store_true',
+                help="use a single tracker per function, rather than one per line")
+ap.add_argument('--branch', action='store_true',
+                help="measure branch coverage, in addition to line coverage")
+ap.add_argument('--count', action='store_true',
+                help="count line executions, rather than just detect them")
+ap.add_argument('--count-every', type=int, default=1, metavar="N",
+                help="when counting, only count every Nth line execution, approximating counts")
+ap.add_argument('--cache-dir', type=Path, metavar="DIR",
+                help="cache instrumented code in DIR, reusing it in later runs")
+ap.add_argument('--tiered', action='store_true',
+                help="instrument functions fully only once first called")
+ap.add_argument('--profile-overhead', action='store_true',
+                help="also report the time and memory slipcover's own work took")
+ap.add_argument('--child-processes', action='store_true',
+                help="also cover the Python processes the program starts, merging their coverage")
+ap.add_argument('--coverage-file', type=Path, metavar="FILE",
+                help="keep coverage in FILE as it's collected, so that it survives abrupt exits; " +
+                     "see the 'convert' command")
+ap.add_argument('--dump-signal', metavar="SIGNAL",
+                help="upon SIGNAL (such as USR1), write the coverage so far to --dump-file, as JSON")
+ap.add_argument('--dump-file', type=Path, metavar="FILE",
+                help="file for --dump-signal to write (default: slipcover-PID.json)")
+ap.add_argument('--control-socket', type=Path, metavar="PATH",
+                help="take commands on a Unix domain socket at PATH: 'coverage', 'delta' " +
+                     "(since the last delta) or 'dump FILE'")
 
 # intended for slipcover development only
 ap.add_argument('--silent', action='store_true', help=argparse.SUPPRESS)
@@ -85,19 +210,47 @@ else:
 base_path = Path(args.script).resolve().parent if args.script \
             else Path('.').resolve()
 
-file_matcher = sc.FileMatcher()
-
-if args.source:
-    for s in args.source.split(','):
-        file_matcher.addSource(s)
-elif args.script:
+file_matcher = file_matcher_for(args.source, args.omit)
+if not args.source and args.script:
     file_matcher.addSource(Path(args.script).resolve().parent)
 
-if args.omit:
-    for o in args.omit.split(','):
-        file_matcher.addOmit(o)
-
-sci = sc.Slipcover(collect_stats=args.stats, d_threshold=args.threshold)
+options = dict(collect_stats=args.stats, d_threshold=args.threshold,
+               tracker_per_code=args.tracker_per_code, count_lines=args.count,
+               count_every=args.count_every, branch=args.branch,
+               async_deinstrument=args.async_deinstrument,
+               adaptive_threshold=args.adaptive_threshold, in_place=args.in_place,
+               cache_dir=args.cache_dir, tiered=args.tiered,
+               profile_overhead=args.profile_overhead, coverage_file=args.coverage_file)
+try:
+    sci = sc.Slipcover(**options)
+except RuntimeError as e:
+    print(f"slipcover: {e}", file=sys.stderr)
+    sys.exit(1)
+
+if args.child_processes:
+    multiprocess.enable(sci, options, file_matcher, debug=args.debug)
+
+if args.dump_signal or args.control_socket:
+    import signal
+    from slipcover.control import Exporter
+
+    exporter = Exporter(sci)
+    if args.dump_signal:
+        name = args.dump_signal.upper()
+        try:
+            signum = int(name) if name.isdigit() else \
+                     signal.Signals[name if name.startswith('SIG') else 'SIG' + name]
+        except KeyError:
+            ap.error(f"unknown signal {args.dump_signal}")
+
+        exporter.enable_signal(signum, args.dump_file or Path(f"slipcover-{os.getpid()}.json"))
+
+    if args.control_socket:
+        try:
+            exporter.serve(args.control_socket)
+        except OSError as e:
+            ap.error(f"unable to listen on {args.control_socket}: {e}")
+        atexit.register(exporter.close)
 
 def wrap_pytest():
     def exec_wrapper(obj, g):
@@ -110,6 +263,11 @@ def wrap_pytest():
     except ModuleNotFoundError:
         return
 
+    if sc.PYTHON_VERSION >= (3,12):
+        # there's no bytecode editor; shadowing the builtin has the same effect
+        _pytest.assertion.rewrite.exec = exec_wrapper
+        return
+
     for f in sc.Slipcover.find_functions(_pytest.assertion.rewrite.__dict__.values(), set()):
         if 'exec' in f.__code__.co_names:
             ed = bc.Editor(f.__code__)
@@ -120,18 +278,22 @@ def wrap_pytest():
 if not args.dont_wrap_pytest:
     wrap_pytest()
 
-sys.meta_path.insert(0, SlipcoverMetaPathFinder(args, sci, file_matcher, sys.meta_path.copy()))
+sys.meta_path.insert(0, SlipcoverMetaPathFinder(sci, file_matcher, sys.meta_path.copy(),
+                                                debug=args.debug))
 
 
 def print_coverage(outfile):
+    # without child processes to merge in, the reports retrieve coverage a file at a time
+    cov = multiprocess.get_coverage() if args.child_processes else None
     if args.json:
-        import json
-        print(json.dumps(sci.get_coverage(), indent=(4 if args.pretty_print else None)),
-              file=outfile)
+        sci.write_json(outfile, pretty_print=args.pretty_print, cov=cov)
     else:
-        sci.print_coverage(outfile=outfile)
+        sci.print_coverage(outfile=outfile, cov=cov)
 
 def sci_atexit():
+    if multiprocess.is_child():
+        return  # a forked child, which writes a shard instead
+
     if args.out:
         with open(args.out, "w") as outfile:
             print_coverage(outfile)
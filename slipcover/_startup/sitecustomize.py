@@ -0,0 +1,30 @@
+# Put on PYTHONPATH for the child processes of a program covered with
+# slipcover --child-processes, so that they're covered as well; see slipcover.multiprocess.
+
+def _start_slipcover():
+    try:
+        from slipcover import multiprocess
+    except Exception:
+        return  # not available to this Python; the process just goes uncovered
+
+    multiprocess.start_child()
+
+
+def _run_shadowed():
+    # run the sitecustomize module this one shadows, if any
+    import os
+    import sys
+    import importlib.machinery
+    import importlib.util
+
+    here = os.path.dirname(os.path.abspath(__file__))
+    path = [p for p in sys.path if os.path.abspath(p or os.curdir) != here]
+    spec = importlib.machinery.PathFinder.find_spec(__name__, path)
+    if spec and spec.loader:
+        module = importlib.util.module_from_spec(spec)
+        sys.modules[__name__] = module
+        spec.loader.exec_module(module)
+
+
+_start_slipcover()
+_run_shadowed()
@@ -2,7 +2,8 @@ from __future__ import annotations
 import sys
 import dis
 import types
-from typing import List
+from typing import List, Tuple
+from . import tracker
 
 PYTHON_VERSION = sys.version_info[0:2]
 
@@ -32,10 +33,11 @@ op_LOAD_GLOBAL = dis.opmap["LOAD_GLOBAL"]
 
 if PYTHON_VERSION >= (3,11):
     op_PUSH_NULL = dis.opmap["PUSH_NULL"]
-    op_PRECALL = dis.opmap["PRECALL"]
+    op_PRECALL = dis.opmap.get("PRECALL")   # removed in 3.12
     op_CALL = dis.opmap["CALL"]
     op_CACHE = dis.opmap["CACHE"]
-    is_EXTENDED_ARG.append(dis._all_opmap["EXTENDED_ARG_QUICK"])
+    if "EXTENDED_ARG_QUICK" in dis._all_opmap:  # removed in 3.12
+        is_EXTENDED_ARG.append(dis._all_opmap["EXTENDED_ARG_QUICK"])
 else:
     op_PUSH_NULL = None
     op_CALL_FUNCTION = dis.opmap["CALL_FUNCTION"]
@@ -170,6 +172,113 @@ class Branch:
         return branches
 
 
+def is_conditional_branch(opcode: int) -> bool:
+    """Returns whether an opcode is a conditional branch, with a target and a fall-through."""
+    name = dis.opname[opcode]
+    return name == 'FOR_ITER' or \
+           (name.startswith(('POP_JUMP_', 'JUMP_IF_')) and 'EXC_MATCH' not in name)
+
+unconditional_jumps = {dis.opmap[name] for name in ['JUMP_FORWARD', 'JUMP_ABSOLUTE', 'JUMP_BACKWARD',
+                                                    'JUMP_BACKWARD_NO_INTERRUPT']
+                       if name in dis.opmap}
+
+# instructions after which execution doesn't simply continue with the next one
+flow_ends = {dis.opmap[name] for name in ['RETURN_VALUE', 'RETURN_CONST', 'RAISE_VARARGS', 'RERAISE',
+                                          'YIELD_VALUE', 'YIELD_FROM']
+             if name in dis.opmap}
+
+
+def branch_arcs(co: types.CodeType) -> List[Tuple[int, bool, int, Tuple[int, int]]]:
+    """Finds the arcs between lines that a code object's conditional branches may take.
+
+    Returns a (branch offset, whether taken, destination offset, (from line, to line))
+    tuple for each branch outcome leading to another line.  To find that line, any
+    unconditional jumps are followed, as is straight-line code in the branch's line.
+    """
+    if PYTHON_VERSION >= (3,10):
+        ranges = [(start, line) for (start, _, line) in co.co_lines()]
+    else:
+        ranges = list(dis.findlinestarts(co))
+    starts = [r[0] for r in ranges]
+
+    def line_at(offset: int) -> int:
+        from bisect import bisect_right
+        i = bisect_right(starts, offset) - 1
+        return ranges[i][1] if i >= 0 else None
+
+    instructions = {off: (off+length, op) for (off, length, op, _) in unpack_opargs(co.co_code)}
+    branches = Branch.from_code(co)
+    branch_offsets = {b.offset for b in branches}
+    jumps = {b.offset: b.target for b in branches if b.opcode in unconditional_jumps}
+
+    def next_line(offset: int, from_line: int) -> int:
+        jumps_followed = 0
+        while offset in instructions:
+            if offset in jumps:
+                if jumps_followed == 8: break   # guards against loops
+                jumps_followed += 1
+                offset = jumps[offset]
+                continue
+
+            next_offset, op = instructions[offset]
+            if line_at(offset) != from_line or offset in branch_offsets or op in flow_ends:
+                break
+            offset = next_offset
+
+        return line_at(offset)
+
+    arcs = []
+    for b in branches:
+        if not is_conditional_branch(b.opcode): continue
+
+        target = b.target
+        if PYTHON_VERSION >= (3,12) and b.opcode == dis.opmap['FOR_ITER']:
+            target += 2     # the loop exits past its END_FOR
+
+        from_line = line_at(b.offset)
+        for taken, dest in ((False, b.offset + b.length), (True, target)):
+            to_line = next_line(dest, from_line)
+            if from_line and to_line and from_line != to_line:
+                arcs.append((b.offset, taken, dest, (from_line, to_line)))
+
+    return arcs
+
+
+def line_reentries(co: types.CodeType) -> List[Tuple[int, int]]:
+    """Finds the jumps that go back into the middle of another line, such as a loop's
+    jump back to its 'for' line's FOR_ITER, past any probe at the start of that line.
+    Like sys.settrace and sys.monitoring, forward jumps aren't taken to run the line
+    again.
+
+    Returns a (jump offset, line) tuple for each.  Jumps that don't check for
+    interrupts (JUMP_BACKWARD_NO_INTERRUPT) are left out, as they can't be redirected
+    without changing that.
+    """
+    line_starts = list(dis.findlinestarts(co))
+    starts = [start for start, _ in line_starts]
+    start_set = set(starts)
+
+    def line_at(offset: int) -> int:
+        from bisect import bisect_right
+        i = bisect_right(starts, offset) - 1
+        return line_starts[i][1] if i >= 0 else None
+
+    jumps = {dis.opmap[name] for name in ['JUMP_ABSOLUTE', 'JUMP_BACKWARD']
+             if name in dis.opmap}
+
+    reentries = []
+    for b in Branch.from_code(co):
+        if b.target >= b.offset or b.target in start_set or \
+           not (b.opcode in jumps or is_conditional_branch(b.opcode)):
+            continue
+
+        line = line_at(b.target)
+        if line and line != line_at(b.offset):
+            reentries.append((b.offset, line))
+
+    return reentries
+
+
 def append_varint(data, n):
     """Appends a (little endian) variable length unsigned integer to 'data'"""
     while n > 0x3f:
@@ -432,259 +541,29 @@ class LineEntry:
             return bytes(linetable)
 
 
-class Editor:
-    """Implements a bytecode editor."""
-
-    def __init__(self, code):
-        self.orig_code = code
-
-        self.consts = None
-        self.patch = None
-
-        self.branches = None
-        self.ex_table = None
-        self.lines = None
-
-        self.max_addtl_stack = 0
-        self.finished = False
-
-
-    def set_const(self, index, value):
-        """Sets a constant."""
-        if self.consts is None:
-            self.consts = list(self.orig_code.co_consts)
-
-        self.consts[index] = value
-
-
-    def add_const(self, value):
-        """Adds a constant."""
-        if self.consts is None:
-            self.consts = list(self.orig_code.co_consts)
-
-        self.consts.append(value)
-        return len(self.consts)-1
-
-
-    def insert_function_call(self, offset, function, args):
-        """Inserts a function call."""
-
-        assert isinstance(function, int)    # we only support const references so far
-
-        if self.patch is None:
-            self.patch = bytearray(self.orig_code.co_code)
-
-        if self.branches is None:
-            self.branches = Branch.from_code(self.orig_code)
-            self.ex_table = ExceptionTableEntry.from_code(self.orig_code)
-            self.lines = LineEntry.from_code(self.orig_code)
-
-        insert = bytearray()
-
-        if PYTHON_VERSION >= (3,11):
-            insert.extend([op_NOP, 0,    # for disabling
-                           op_PUSH_NULL, 0] +
-                          opcode_arg(op_LOAD_CONST, function))
-
-            for a in args:
-                insert.extend(opcode_arg(op_LOAD_CONST, a))
-
-
-            insert.extend(opcode_arg(op_PRECALL, len(args)) +
-                          opcode_arg(op_CALL, len(args)) +
-                          [op_POP_TOP, 0])   # ignore return
-        else:
-            insert.extend([op_NOP, 0] +  # for disabling
-                          opcode_arg(op_LOAD_CONST, function))
-
-            for a in args:
-                insert.extend(opcode_arg(op_LOAD_CONST, a))
-
-            insert.extend([op_CALL_FUNCTION, len(args),
-                           op_POP_TOP, 0])   # ignore return
-
-        len_insert = len(insert)
-
-        insert[1] = offset2branch(len_insert-2)    # fails if > 255
-        self.max_addtl_stack = max(self.max_addtl_stack, calc_max_stack(insert))
-
-        self.patch[offset:offset] = insert
-
-        for l in self.lines:
-            l.adjust(offset, len_insert)
-
-        for b in self.branches:
-            b.adjust(offset, len_insert)
-
-        for e in self.ex_table:
-            e.adjust(offset, len_insert)
-
-        return len_insert
-
-
-    def get_inserted_function(self, offset):
-        """Returns const indices for an inserted function and for its arguments,
-           or None if an inserted function isn't recognized.
-        """
-        code = self.patch if self.patch is not None else self.orig_code.co_code
-
-        if code[offset] == op_NOP:
-            it = iter(unpack_opargs(code[offset:]))
-            next(it) # NOP
-            op_offset, op_len, op, op_arg = next(it)
-            if op == op_PUSH_NULL:
-                op_offset, op_len, op, op_arg = next(it)
-
-            if op == op_LOAD_CONST:
-                f_args = [op_arg]
-
-                op_offset, op_len, op, op_arg = next(it)
-                while op == op_LOAD_CONST:
-                    f_args.append(op_arg)
-                    op_offset, op_len, op, op_arg = next(it)
-
-                return f_args
-
-
-    def disable_inserted_function(self, offset):
-        """Disables an inserted function at a given offset."""
-
-        if self.patch is None:
-            self.patch = bytearray(self.orig_code.co_code)
-
-        assert self.patch[offset] == op_NOP
-        self.patch[offset] = op_JUMP_FORWARD
-
-
-    def replace_inserted_function(self, offset, new_func_index):
-        """Replaces an inserted function by another function."""
-
-        if self.patch is None:
-            self.patch = bytearray(self.orig_code.co_code)
-
-        assert self.patch[offset] == op_NOP
-
-        it = iter(unpack_opargs(self.patch[offset:]))
-        next(it) # NOP
-        op_offset, op_len, op, op_arg = next(it)
-        if op == op_PUSH_NULL:
-            op_offset, op_len, op, op_arg = next(it)
-
-        assert op == op_LOAD_CONST
-
-        # FIXME use actual argument lenth rather than art_ext_needed
-        replacement = opcode_arg(op, new_func_index, arg_ext_needed(op_arg))
-        assert len(replacement) == op_len
-
-        op_offset += offset # we unpacked from co.co_code[offset:]
-        self.patch[op_offset:op_offset+op_len] = replacement
-
-
-    def replace_global_with_const(self, global_name, const_index):
-        """Replaces a global name lookup by a constant load."""
-
-        if self.patch is None:
-            self.patch = bytearray(self.orig_code.co_code)
-
-        if self.branches is None:
-            self.branches = Branch.from_code(self.orig_code)
-            self.ex_table = ExceptionTableEntry.from_code(self.orig_code)
-            self.lines = LineEntry.from_code(self.orig_code)
-
-        if global_name in self.orig_code.co_names:
-            name_index = self.orig_code.co_names.index(global_name)
-
-            def find_load_globals():
-                for op_off, op_len, op, op_arg in unpack_opargs(self.patch):
-                    if op == op_LOAD_GLOBAL:
-                        if PYTHON_VERSION >= (3,11):
-                            if (op_arg>>1) == name_index:
-                                yield (op_off, op_len, op, op_arg)
-                        else:
-                            if op_arg == name_index:
-                                yield (op_off, op_len, op, op_arg)
-
-            delta = 0
-            # read from pre-computed list so we can modify on the fly
-            for op_off, op_len, op, op_arg in list(find_load_globals()):
-                repl = bytearray()
-                if sys.version_info[0:2] >= (3,11) and op_arg&1:
-                    repl.extend(opcode_arg(dis.opmap['PUSH_NULL'], 0))
-                repl.extend(opcode_arg(op_LOAD_CONST, const_index))
-
-                op_off += delta     # adjust for any other changes
-                self.patch[op_off:op_off+op_len] = repl
-
-                change = len(repl) - op_len
-                if change:
-                    for l in self.lines:
-                        l.adjust(op_off, change)
-
-                    for b in self.branches:
-                        b.adjust(op_off, change)
-
-                    for e in self.ex_table:
-                        e.adjust(op_off, change)
-
-                delta += change
-
-
-    def finish(self):
-        """Finishes editing bytecode, returning a new code object."""
-
-        assert not self.finished
-        self.finished = True
-
-        if not self.patch and not self.consts:
-            return self.orig_code
-
-        if self.branches is not None:
-            # A branch's new target may now require more EXTENDED_ARG opcodes to be expressed.
-            # Inserting space for those may in turn trigger needing more space for others...
-            # FIXME missing test for length adjustment triggering other length adjustments
-            any_adjusted = True
-            while any_adjusted:
-                any_adjusted = False
-
-                for b in self.branches:
-                    change = b.adjust_length()
-                    if change:
-    #                    print(f"adjusted branch {b.offset}->{b.target} by {change} to length={b.length}")
-                        self.patch[b.offset:b.offset] = [0] * change
-                        for c in self.branches:
-                            if b != c:
-                                c.adjust(b.offset, change)
-
-                        for l in self.lines:
-                            l.adjust(b.offset, change)
-
-                        for e in self.ex_table:
-                            e.adjust(b.offset, change)
-
-                        any_adjusted = True
-
-            for b in self.branches:
-                assert self.patch[b.offset+b.length-2] == b.opcode
-                self.patch[b.offset:b.offset+b.length] = b.code()
-
-
-        replace = {}
-        if self.consts is not None:
-            replace["co_consts"] = tuple(self.consts)
-
-        if self.max_addtl_stack:
-            replace["co_stacksize"] = self.orig_code.co_stacksize + self.max_addtl_stack
-
-        if self.patch is not None:
-            replace["co_code"] = bytes(self.patch)
-
-        if self.branches is not None:
-            if PYTHON_VERSION < (3,10):
-                replace["co_lnotab"] = LineEntry.make_lnotab(self.orig_code.co_firstlineno, self.lines)
-            else:
-                replace["co_linetable"] = LineEntry.make_linetable(self.orig_code.co_firstlineno, self.lines)
-
-                if PYTHON_VERSION >= (3,11):
-                    replace["co_exceptiontable"] = ExceptionTableEntry.make_exceptiontable(self.ex_table)
-
-        return self.orig_code.replace(**replace)
+# The bytecode editor is implemented natively, in the tracker extension, with each
+# Python version's opcode layout specialized at compile time.  It offers the following API:
+#
+#   Editor(code)
+#   set_const(index, value)
+#   add_const(value) -> index
+#   insert_function_call(offset, function_index, arg_indices) -> length inserted
+#   insert_function_calls([(offset, function_index, arg_indices), ...]) -> length inserted
+#   insert_branch_calls([(branch_offset, taken, function_index, arg_indices), ...])
+#   insert_creation_calls(function_index) -> number of calls inserted
+#   insert_entry_call(function_index)
+#   get_inserted_function(offset) -> [function_index, *arg_indices] or None
+#   get_inserted_functions() -> [(offset, [function_index, *arg_indices]), ...]
+#   disable_inserted_function(offset)
+#   replace_inserted_function(offset, new_function_index)
+#   replace_global_with_const(global_name, const_index)
+#   finish() -> code
+#   finish_in_place() -> code (Python 3.11 only)
+#
+# Offsets are those of the code as given to Editor, and batches are in ascending
+# offset order; each method's docstring (see help(Editor)) says more.
+#
+# On Python 3.12+, Slipcover uses sys.monitoring rather than editing bytecode,
+# so no editor is available.
+if PYTHON_VERSION < (3,12):
+    Editor = tracker.Editor
@@ -0,0 +1,212 @@
+"""Combining and comparing coverage results in bulk.
+
+Results may be JSON, as written with --json, or coverage files, as written with
+--coverage-file.  Each source file's lines are kept as bitmaps (see lines_to_bitmap),
+so that combining results is a matter of OR'ing them; reading the inputs, which is
+where the time goes, is spread across a pool of processes.
+"""
+
+from __future__ import annotations
+import os
+import json
+from collections import Counter
+from pathlib import Path
+from typing import Dict, Iterable, List, Set, Tuple
+from .slipcover import (Slipcover, PathSimplifier, lines_to_bitmap, bitmap_to_lines,
+                        read_coverage_file_bitmaps)
+
+
+class FileCoverage:
+    """A source file's coverage, combined from any number of results."""
+    __slots__ = ('code', 'seen', 'counts', 'branches', 'seen_branches')
+
+    def __init__(self):
+        self.code = 0                                   # bitmap of code lines
+        self.seen = 0                                   # bitmap of lines executed
+        self.counts: Counter | None = None              # execution counts, if any
+        self.branches: Set[Tuple[int, int]] | None = None   # branch arcs, if any
+        self.seen_branches: Set[Tuple[int, int]] | None = None
+
+    def update(self, other: FileCoverage) -> None:
+        self.code |= other.code
+        self.seen |= other.seen
+        if other.counts is not None:
+            if self.counts is None:
+                self.counts = Counter()
+            self.counts.update(other.counts)
+        if other.branches is not None:
+            if self.branches is None:
+                self.branches, self.seen_branches = set(), set()
+            self.branches |= other.branches
+            self.seen_branches |= other.seen_branches
+
+    @staticmethod
+    def from_json(f_cov: dict) -> FileCoverage:
+        fc = FileCoverage()
+        fc.seen = lines_to_bitmap(f_cov['executed_lines'])
+        fc.code = fc.seen | lines_to_bitmap(f_cov['missing_lines'])
+        if 'execution_counts' in f_cov:
+            # JSON has the line numbers as strings
+            fc.counts = Counter({int(line): n for line, n in f_cov['execution_counts'].items()})
+        if 'executed_branches' in f_cov:
+            fc.seen_branches = {tuple(arc) for arc in f_cov['executed_branches']}
+            fc.branches = fc.seen_branches | {tuple(arc) for arc in f_cov['missing_branches']}
+        return fc
+
+    def to_json(self) -> dict:
+        f_cov = {
+            'executed_lines': bitmap_to_lines(self.seen & self.code),
+            'missing_lines': bitmap_to_lines(self.code & ~self.seen)
+        }
+        if self.counts is not None:
+            f_cov['execution_counts'] = dict(sorted(self.counts.items()))
+        if self.branches is not None:
+            f_cov['executed_branches'] = [list(arc) for arc in sorted(self.seen_branches)]
+            f_cov['missing_branches'] = [list(arc) for arc in sorted(self.branches - self.seen_branches)]
+        return f_cov
+
+
+Coverage = Dict[str, FileCoverage]
+
+
+def read(path: Path) -> Coverage:
+    """Reads a result, either JSON or a coverage file."""
+    with open(path, "rb") as f:
+        is_coverage_file = (f.read(8) == b"SLIPCOV\0")
+
+    cov: Coverage = dict()
+    if is_coverage_file:
+        code, seen, hits = read_coverage_file_bitmaps(path)
+        simp = PathSimplifier()
+        for name in code:
+            fc = cov.setdefault(simp.simplify(name), FileCoverage())
+            fc.code |= code[name]
+            fc.seen |= seen[name]
+            if hits is not None:
+                fc.counts = (fc.counts or Counter()) + hits[name]
+        return cov
+
+    try:
+        with open(path, "r") as f:
+            results = json.load(f)
+        files = results['files']
+    except (json.JSONDecodeError, UnicodeDecodeError, TypeError, KeyError):
+        raise ValueError(f"{path}: neither JSON coverage results nor a coverage file")
+
+    return {name: FileCoverage.from_json(f_cov) for name, f_cov in files.items()}
+
+
+def _update(cov: Coverage, other: Coverage) -> None:
+    for name, fc in other.items():
+        existing = cov.get(name)
+        if existing is None:
+            cov[name] = fc
+        else:
+            existing.update(fc)
+
+
+def _read_all(paths: List[str]) -> Coverage:
+    cov: Coverage = dict()
+    for path in paths:
+        _update(cov, read(Path(path)))
+    return cov
+
+
+def combine(paths: Iterable[Path], jobs: int | None = None) -> Coverage:
+    """Combines results, reading them across a pool of processes."""
+    paths = [str(p) for p in paths]
+    jobs = min(jobs or os.cpu_count() or 1, len(paths))
+    if jobs <= 1:
+        return _read_all(paths)
+
+    from concurrent.futures import ProcessPoolExecutor
+
+    # each process combines its share, so that only one result per process comes back
+    shares = [paths[i::jobs] for i in range(jobs)]
+    cov: Coverage = dict()
+    with ProcessPoolExecutor(max_workers=jobs) as executor:
+        for share_cov in executor.map(_read_all, shares):
+            _update(cov, share_cov)
+    return cov
+
+
+def to_json(cov: Coverage) -> dict:
+    """Returns combined results as get_coverage would have (without stats)."""
+    return {'files': {name: cov[name].to_json() for name in sorted(cov)}}
+
+
+def _percent(fc: FileCoverage) -> int:
+    seen = bin(fc.seen & fc.code).count('1')
+    total = bin(fc.code).count('1')
+    if fc.branches is not None:
+        # as with coverage.py, branches count towards the percentage
+        seen += len(fc.seen_branches)
+        total += len(fc.branches)
+    return int(100*seen/total) if total else 100
+
+
+def _file_diff(fa: FileCoverage, fb: FileCoverage) -> Tuple[int, int, List, List]:
+    # lines (as bitmaps) and branches that b covers but a doesn't, and vice versa
+    newly_executed = fb.seen & fb.code & ~fa.seen
+    newly_missing = fa.seen & fb.code & ~fb.seen
+    if fa.branches is None or fb.branches is None:
+        return newly_executed, newly_missing, [], []
+
+    return (newly_executed, newly_missing,
+            sorted(fb.seen_branches - fa.seen_branches),
+            sorted((fa.seen_branches & fb.branches) - fb.seen_branches))
+
+
+def diff(a: Coverage, b: Coverage) -> dict:
+    """Compares results, from a (the "before") to b (the "after").  For files in both,
+       reports lines (and branches) that b covers but a doesn't ("newly executed") and
+       lines that a covers but b doesn't, even though they're code in b ("newly missing");
+       files in only one of them are listed as such."""
+    files = dict()
+    for name in sorted(a.keys() & b.keys()):
+        fa, fb = a[name], b[name]
+        newly_executed, newly_missing, new_arcs, lost_arcs = _file_diff(fa, fb)
+        f_diff = {
+            'percent_covered': [_percent(fa), _percent(fb)],
+            'newly_executed_lines': bitmap_to_lines(newly_executed),
+            'newly_missing_lines': bitmap_to_lines(newly_missing),
+        }
+        if fa.branches is not None and fb.branches is not None:
+            f_diff['newly_executed_branches'] = [list(arc) for arc in new_arcs]
+            f_diff['newly_missing_branches'] = [list(arc) for arc in lost_arcs]
+        files[name] = f_diff
+
+    return {
+        'files': files,
+        'only_in_a': sorted(a.keys() - b.keys()),
+        'only_in_b': sorted(b.keys() - a.keys())
+    }
+
+
+def print_diff(a: Coverage, b: Coverage, outfile) -> None:
+    """Prints a table of the files whose coverage differs between a and b, with lines
+       in ranges as for Slipcover.format_missing."""
+    from tabulate import tabulate
+
+    def changes(lines: int, arcs: List, code: int) -> str:
+        # other code lines break up ranges
+        ranges = Slipcover.format_missing(bitmap_to_lines(lines), bitmap_to_lines(code & ~lines))
+        return ", ".join(filter(None, [ranges, *(f"{x}->{y}" for x, y in arcs)]))
+
+    def table():
+        for name in sorted(a.keys() & b.keys()):
+            fa, fb = a[name], b[name]
+            newly_executed, newly_missing, new_arcs, lost_arcs = _file_diff(fa, fb)
+            if newly_executed or newly_missing or new_arcs or lost_arcs:
+                yield (name, _percent(fa), _percent(fb),
+                       changes(newly_executed, new_arcs, fb.code),
+                       changes(newly_missing, lost_arcs, fb.code))
+
+        for name in sorted(a.keys() - b.keys()):
+            yield (name, _percent(a[name]), "", "", "(only in A)")
+        for name in sorted(b.keys() - a.keys()):
+            yield (name, "", _percent(b[name]), "(only in B)", "")
+
+    print("", file=outfile)
+    print(tabulate(table(), headers=["File", "Cover% A", "Cover% B", "Newly executed", "Newly missing"]),
+          file=outfile)
@@ -0,0 +1,159 @@
+"""Exports coverage from a process while it runs, such as a service that never exits,
+so that it needn't wait for the report at exit.
+
+A signal (see enable_signal) has the coverage so far written to a file.  A Unix domain
+control socket (see serve) takes one command per connection:
+
+    coverage        answers with the coverage so far, as JSON
+    delta           answers with what was covered since the last delta (or since the
+                    start), as JSON in the same form (see CoverageSnapshot.since)
+    dump FILE       writes the coverage so far to FILE, answering "ok"
+
+Either way, the work is done on a thread of its own, rather than by the program's
+threads, and reads coverage through snapshots (see Slipcover.snapshot), so that it
+doesn't get in the way of de-instrumentation.
+"""
+
+from __future__ import annotations
+import os
+import sys
+import queue
+import threading
+from pathlib import Path
+from .slipcover import Slipcover, CoverageSnapshot
+
+
+class Exporter:
+    """Exports a Slipcover's coverage upon a signal, through a control socket, or both."""
+
+    def __init__(self, sci: Slipcover, relative_to: Path | None = None):
+        self.sci = sci
+        # file names are given relative to the directory it started in, even if it changes
+        self.relative_to = relative_to if relative_to is not None else Path.cwd()
+        self.pid = os.getpid()
+        self.delta_lock = threading.Lock()
+        self.last_delta: CoverageSnapshot | None = None
+        self.dumps: queue.Queue = queue.Queue(maxsize=1)
+        self.socket_path: Path | None = None
+
+    def coverage(self) -> dict:
+        return self.sci.snapshot().get_coverage(self.relative_to)
+
+    def delta(self) -> dict:
+        with self.delta_lock:
+            snapshot = self.sci.snapshot()
+            cov = snapshot.since(self.last_delta, self.relative_to)
+            self.last_delta = snapshot
+            return cov
+
+    def dump(self, path: Path) -> None:
+        """Writes the coverage so far to a file, replacing it all at once, so that
+           readers never see it partly written."""
+        path = Path(path)
+        tmp = path.with_name(f"{path.name}.{os.getpid()}.tmp")
+        with open(tmp, "w") as f:
+            self.sci.write_json(f, cov=self.coverage())
+        os.replace(tmp, path)
+
+    def enable_signal(self, signum: int, path: Path) -> None:
+        """Has the coverage so far written to a file upon a signal.  The handler just
+           queues a request, coalescing it with any already pending."""
+        import signal
+
+        path = Path(path).resolve()
+
+        def handler(signum, frame):
+            if os.getpid() != self.pid:
+                return  # a forked child; it has no thread to do it
+
+            try:
+                self.dumps.put_nowait(path)
+            except queue.Full:
+                pass    # coalesced with the pending request
+
+        threading.Thread(target=self._run_dumps, name="slipcover-dump", daemon=True).start()
+        signal.signal(signum, handler)
+
+    def _run_dumps(self) -> None:
+        while True:
+            path = self.dumps.get()
+            try:
+                self.dump(path)
+            except Exception:
+                sys.excepthook(*sys.exc_info())
+
+    def serve(self, path: Path) -> None:
+        """Listens for commands on a Unix domain socket at the given path, which only
+           the user running the program may connect to."""
+        import socket
+
+        if not hasattr(socket, 'AF_UNIX'):
+            raise OSError("Unix domain sockets aren't available on this platform")
+
+        path = Path(path).resolve()
+        if path.is_socket():
+            path.unlink()   # left by an earlier run
+
+        server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        # created with those permissions, so that there's no time at which others may connect
+        old_umask = os.umask(0o177)
+        try:
+            server.bind(str(path))
+        finally:
+            os.umask(old_umask)
+        server.listen()
+        self.socket_path = path
+
+        threading.Thread(target=self._run_server, args=(server,), name="slipcover-control",
+                         daemon=True).start()
+
+    def close(self) -> None:
+        if self.socket_path is not None and os.getpid() == self.pid:
+            try:
+                self.socket_path.unlink()
+            except OSError:
+                pass
+
+    def _run_server(self, server) -> None:
+        while True:
+            try:
+                conn, _ = server.accept()
+            except OSError:
+                return  # closed
+
+            with conn:
+                try:
+                    conn.settimeout(10)
+                    conn.sendall(self._command(self._read_command(conn)).encode('utf-8'))
+                except OSError:
+                    pass    # the client went away
+                except Exception:
+                    sys.excepthook(*sys.exc_info())
+
+    @staticmethod
+    def _read_command(conn) -> str:
+        data = b""
+        while b"\n" not in data and len(data) < 4096:
+            chunk = conn.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+        return data.split(b"\n", 1)[0].decode('utf-8', errors='replace').strip()
+
+    def _command(self, command: str) -> str:
+        import io
+
+        name, _, arg = command.partition(' ')
+        if name in ('coverage', 'delta') and not arg:
+            out = io.StringIO()
+            self.sci.write_json(out, cov=(self.coverage() if name == 'coverage' else self.delta()))
+            return out.getvalue()
+
+        if name == 'dump' and arg:
+            try:
+                self.dump(self.relative_to / arg.strip())
+            except OSError as e:
+                return f"error: {e}\n"
+            return "ok\n"
+
+        return f"error: unknown command {command!r}\n"
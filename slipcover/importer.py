@@ -0,0 +1,41 @@
+from importlib.abc import MetaPathFinder, Loader
+from .slipcover import Slipcover, FileMatcher
+
+
+class SlipcoverLoader(Loader):
+    def __init__(self, sci: Slipcover, orig_loader):
+        self.sci = sci
+        self.orig_loader = orig_loader
+
+    def create_module(self, spec):
+        return self.orig_loader.create_module(spec)
+
+    def get_code(self, name):   # expected by pyrun
+        return self.orig_loader.get_code(name)
+
+    def exec_module(self, module):
+        code = self.orig_loader.get_code(module.__name__)
+        self.sci.register_module(module)
+        code = self.sci.instrument(code)
+        exec(code, module.__dict__)
+
+class SlipcoverMetaPathFinder(MetaPathFinder):
+    def __init__(self, sci: Slipcover, file_matcher: FileMatcher, meta_path, debug: bool = False):
+        self.sci = sci
+        self.file_matcher = file_matcher
+        self.meta_path = meta_path
+        self.debug = debug
+
+    def find_spec(self, fullname, path, target=None):
+        if self.debug:
+            print(f"Looking for {fullname}")
+        for f in self.meta_path:
+            found = f.find_spec(fullname, path, target) if hasattr(f, 'find_spec') else None
+            if found:
+                if found.origin and self.file_matcher.matches(found.origin):
+                    if self.debug:
+                        print(f"adding {fullname} from {found.origin}")
+                    found.loader = SlipcoverLoader(self.sci, found.loader)
+                return found
+
+        return None
@@ -0,0 +1,180 @@
+"""Coverage for the Python processes that a covered program starts.
+
+The main process passes its settings down in an environment variable, and puts a
+directory with a sitecustomize module on PYTHONPATH, so that the Python processes it
+starts (with subprocess, multiprocessing, etc.) start slipcover as well; so do theirs.
+Forked children, which start off as copies of their parent, forget what it had seen.
+Each child writes its coverage to a shard file as it exits, and the main process merges
+those it finds into its report.
+"""
+
+from __future__ import annotations
+import os
+import sys
+import json
+import atexit
+import threading
+from pathlib import Path
+from . import slipcover as sc
+from . import tracker
+
+ENV_VAR = "SLIPCOVER_MULTIPROCESS"
+STARTUP_DIR = Path(__file__).parent / "_startup"
+
+_sci: sc.Slipcover | None = None
+_config: dict | None = None
+_shard_pid: int | None = None   # the process that wrote a shard
+
+
+def enable(sci: sc.Slipcover, options: dict, file_matcher: sc.FileMatcher,
+           debug: bool = False) -> None:
+    """Arranges for the child processes of the main process to be covered, with the
+       same Slipcover options and file matching."""
+    import tempfile
+    global _sci, _config
+
+    _sci = sci
+    _config = {
+        'main_pid': os.getpid(),
+        'shard_dir': tempfile.mkdtemp(prefix="slipcover-"),
+        'options': options,
+        'cwd': str(file_matcher.cwd),
+        'sources': [str(s) for s in file_matcher.sources],
+        'omit': [str(o) for o in file_matcher.omit],
+        'debug': debug
+    }
+
+    os.environ[ENV_VAR] = json.dumps(_config, default=str)
+    os.environ['PYTHONPATH'] = os.pathsep.join([str(STARTUP_DIR)] +
+                                               ([os.environ['PYTHONPATH']]
+                                                if os.environ.get('PYTHONPATH') else []))
+
+    atexit.register(_remove_shards)
+    _watch_forks()
+
+
+def is_child() -> bool:
+    """Returns whether this is a child process, reporting through a shard."""
+    return _config is not None and os.getpid() != _config['main_pid']
+
+
+def start_child() -> None:
+    """Starts covering a child process; invoked by sitecustomize."""
+    global _sci, _config
+    from .importer import SlipcoverMetaPathFinder
+
+    config = json.loads(os.environ[ENV_VAR])
+
+    file_matcher = sc.FileMatcher()
+    file_matcher.cwd = Path(config['cwd'])
+    file_matcher.sources = [Path(s) for s in config['sources']]
+    file_matcher.omit = config['omit']
+
+    script = sys.argv[0] if sys.argv else ''
+    if os.name == 'posix' and script not in ('', '-c', '-m') and os.path.isfile(script) \
+       and file_matcher.matches(Path(script).resolve()):
+        # Python runs the main script itself, rather than importing it; to instrument
+        # it, this process re-executes itself to run it through run_script instead.
+        import subprocess
+        os.execv(sys.executable, [sys.executable, *subprocess._args_from_interpreter_flags(),
+                                  '-c', "from slipcover import multiprocess; multiprocess.run_script()",
+                                  *sys.argv])
+
+    _config = config
+    # children report through shards, rather than each writing over the main process' file
+    _sci = sc.Slipcover(**dict(config['options'], coverage_file=None))
+    sys.meta_path.insert(0, SlipcoverMetaPathFinder(_sci, file_matcher, sys.meta_path.copy(),
+                                                    debug=config['debug']))
+    _watch_forks()
+
+
+def run_script() -> None:
+    """Runs a child's main script instrumented, as Python would have; see start_child."""
+    import __main__
+
+    script = Path(sys.argv[1])
+    sys.argv = sys.argv[1:]
+    sys.path[0] = str(script.resolve().parent)     # rather than -c's ''
+
+    with open(script, "r") as f:
+        code = compile(f.read(), str(script.resolve()), "exec")
+
+    __main__.__file__ = str(script)
+    exec(_sci.instrument(code), __main__.__dict__)
+
+
+def _watch_forks() -> None:
+    atexit.register(write_shard)
+    os.register_at_fork(after_in_child=_forked)
+
+
+def _forked() -> None:
+    # what the parent saw is for it to report
+    tracker.forget_seen(_sci.line_map)
+    if sc.PYTHON_VERSION >= (3,12):
+        # the parent disabled the locations it saw; they're reported again once here
+        sys.monitoring.restart_events()
+
+    # these may have been in use by other threads, which didn't make it here
+    _sci.lock = threading.RLock()
+    if _sci.deinstrument_worker:
+        _sci.deinstrument_worker = sc.DeinstrumentWorker(_sci)
+
+    # multiprocessing's forked processes exit with os._exit, skipping atexit
+    process = sys.modules.get('multiprocessing.process')
+    if process and not hasattr(process.BaseProcess._bootstrap, '__wrapped__'):
+        bootstrap = process.BaseProcess._bootstrap
+
+        def _bootstrap(self, *args, **kwargs):
+            try:
+                return bootstrap(self, *args, **kwargs)
+            finally:
+                write_shard()
+
+        _bootstrap.__wrapped__ = bootstrap
+        process.BaseProcess._bootstrap = _bootstrap
+
+
+def write_shard() -> None:
+    """Writes a child process' coverage to its shard file."""
+    global _shard_pid
+    if not is_child() or _shard_pid == os.getpid():
+        return
+    _shard_pid = os.getpid()
+
+    import tempfile
+
+    cov = _sci.get_coverage(relative_to=Path(_config['cwd']))
+    try:
+        # PIDs get reused, so each shard's name is made unique, rather than just the PID;
+        # it reads as empty (and is skipped) until replaced by the complete shard
+        fd, shard = tempfile.mkstemp(dir=_config['shard_dir'], prefix=f"{os.getpid()}-",
+                                     suffix=".json")
+        os.close(fd)
+        tmp = Path(shard).with_suffix(".tmp")
+        with open(tmp, "w") as f:
+            json.dump(cov, f)
+        os.replace(tmp, shard)
+    except OSError:
+        pass    # the directory is gone if the main process already exited
+
+
+def get_coverage() -> dict:
+    """Returns the main process' coverage, merged with that of the child processes that
+       have exited."""
+    cov = _sci.get_coverage(relative_to=Path(_config['cwd']))
+
+    for shard in sorted(Path(_config['shard_dir']).glob("*.json")):
+        try:
+            with open(shard, "r") as f:
+                sc.Slipcover.merge_coverage(cov, json.load(f))
+        except (OSError, ValueError):
+            continue
+
+    return cov
+
+
+def _remove_shards() -> None:
+    if not is_child():
+        import shutil
+        shutil.rmtree(_config['shard_dir'], ignore_errors=True)
@@ -1,26 +1,73 @@
 from __future__ import annotations
 import sys
 import dis
+import inspect
 import types
-from typing import Dict, Set, List
+from typing import Dict, Set, List, Tuple, Iterator, Iterable
 from collections import defaultdict, Counter
 import threading
+import queue
+import time
+import weakref
+import os
+import marshal
+import hashlib
+import contextlib
+import itertools
+import copy
 from . import tracker
 from . import bytecode as bc
 from pathlib import Path
 
 # FIXME provide __all__
 
+PYTHON_VERSION = sys.version_info[0:2]
+
+if PYTHON_VERSION >= (3,12):
+    op_RESUME = dis.opmap["RESUME"]
+
+    def monitored_lines(co: types.CodeType) -> List[int]:
+        """Returns the lines for which sys.monitoring reports LINE events in a code object."""
+
+        # Events aren't reported for instructions up to (and including) the first RESUME,
+        # which has the 'def' line in functions.  Those have no CACHE entries.
+        code = co.co_code
+        first_traceable = next((off+2 for off in range(0, len(code), 2) if code[off] == op_RESUME), 0)
+        return [line for (start, end, line) in co.co_lines()
+                if line is not None and end > first_traceable]
+
+    # sys.monitoring takes a single callback per event for each tool, so all instances
+    # share the handlers, which send each code object's events to the line map of the
+    # instance that last instrumented it (see tracker.set_code_owner).
+    _monitoring_registered = False
+
+    def start_monitoring() -> None:
+        global _monitoring_registered
+
+        mon = sys.monitoring
+        if mon.get_tool(mon.COVERAGE_ID) != "slipcover":
+            try:
+                mon.use_tool_id(mon.COVERAGE_ID, "slipcover")
+            except ValueError:
+                raise RuntimeError("can't collect coverage: sys.monitoring's coverage tool ID " +
+                                   f"is already in use by {mon.get_tool(mon.COVERAGE_ID)!r}")
+            _monitoring_registered = False
+
+        if not _monitoring_registered:
+            mon.register_callback(mon.COVERAGE_ID, mon.events.LINE, tracker.new_line_handler())
+            mon.register_callback(mon.COVERAGE_ID, mon.events.BRANCH, tracker.new_branch_handler())
+            _monitoring_registered = True
+
 # Counter.total() is new in 3.10
-if sys.version_info[0:2] < (3,10):
+if PYTHON_VERSION < (3,10):
     def counter_total(self: Counter) -> int:
         return sum([self[n] for n in self])
     setattr(Counter, 'total', counter_total)
 
 
 class PathSimplifier:
-    def __init__(self):
-        self.cwd = Path.cwd()
+    def __init__(self, cwd: Path | None = None):
+        self.cwd = cwd if cwd is not None else Path.cwd()
 
     def simplify(self, path : str) -> str:
         f = Path(path)
@@ -58,7 +105,7 @@ class FileMatcher:
 
     def matches(self, filename : Path):
         if isinstance(filename, str):
-            if filename == 'built-in': return False     # can't instrument
+            if filename in ('built-in', 'frozen'): return False   # can't instrument
             filename = Path(filename)
 
         if filename.suffix in ('.pyd', '.so'): return False  # can't instrument DLLs
@@ -80,10 +127,324 @@ class FileMatcher:
         return self.cwd in filename.parents
 
 
+class DeinstrumentWorker:
+    """Runs de-instrumentation passes on a background thread, so that the application
+       thread which happens to reach the threshold doesn't pay for them.
+
+       Requests go into a single-slot queue, so that any made while one is pending are
+       coalesced with it; those made while a pass runs lead to just one more pass."""
+
+    def __init__(self, sci: Slipcover):
+        self.sci = sci
+        self.requests: queue.Queue = queue.Queue(maxsize=1)
+        self.thread: threading.Thread | None = None
+        self.thread_lock = threading.Lock()
+
+    def request(self) -> None:
+        try:
+            self.requests.put_nowait(None)
+        except queue.Full:
+            return  # coalesced with the pending request
+
+        # started lazily, and restarted if missing, such as in a forked child
+        if self.thread is None or not self.thread.is_alive():
+            with self.thread_lock:
+                if self.thread is None or not self.thread.is_alive():
+                    self.thread = threading.Thread(target=self._run, name="slipcover-deinstrument",
+                                                   daemon=True)
+                    self.thread.start()
+
+    def wait(self) -> None:
+        """Waits for all requested passes to complete."""
+        self.requests.join()
+
+    def _run(self) -> None:
+        while True:
+            self.requests.get()
+            try:
+                self.sci.deinstrument_seen()
+            except Exception:
+                sys.excepthook(*sys.exc_info())
+            finally:
+                self.requests.task_done()
+
+
+class OverheadProfile:
+    """Tallies the time Slipcover's own work takes, and how much it adds to the code,
+       for the overhead report (see Slipcover's profile_overhead option)."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.seconds: Counter = Counter()   # by activity
+        self.counts: Counter = Counter()    # of those activities, and of things added
+        self.probe_seconds: float | None = None
+
+    @contextlib.contextmanager
+    def timing(self, what: str):
+        start = time.perf_counter()
+        try:
+            yield
+        finally:
+            self.add(what, time.perf_counter() - start)
+
+    def add(self, what: str, seconds: float = 0.0, count: int = 1) -> None:
+        with self.lock:
+            self.seconds[what] += seconds
+            self.counts[what] += count
+
+    @staticmethod
+    def code_size(co: types.CodeType) -> Tuple[int, int]:
+        """Returns the length of a code object's bytecode and its number of constants,
+           including those of the code objects nested in it."""
+        size, consts = len(co.co_code), len(co.co_consts)
+        for c in co.co_consts:
+            if isinstance(c, types.CodeType):
+                c_size, c_consts = OverheadProfile.code_size(c)
+                size += c_size
+                consts += c_consts
+        return size, consts
+
+    def note_instrumented(self, original: types.CodeType, new: types.CodeType) -> None:
+        (orig_size, orig_consts), (new_size, new_consts) = \
+            self.code_size(original), self.code_size(new)
+        self.add('bytecode_added', count=new_size - orig_size)
+        self.add('consts_added', count=new_consts - orig_consts)
+
+    def probe_cost(self) -> float:
+        """Estimates the time a probe takes, by timing calls to a scratch tracker
+           (as D misses, as most probe calls are)."""
+        if self.probe_seconds is None:
+            class Scratch:
+                line_map = tracker.new_line_map()
+            tr = tracker.register_many(Scratch, "<probe cost>", [1], 2**31-1)[0]
+
+            def loop(call: bool, n = 100_000) -> float:
+                start = time.perf_counter()
+                if call:
+                    for _ in range(n): tr()
+                else:
+                    for _ in range(n): tr
+                return (time.perf_counter() - start) / n
+
+            self.probe_seconds = max(0.0, min(loop(True) for _ in range(3)) -
+                                          min(loop(False) for _ in range(3)))
+
+        return self.probe_seconds
+
+
+class InstrumentationCache:
+    """Keeps instrumented code on disk, as pyc files keep compiled code, so that later runs
+       only need to bind it to new trackers.
+
+       Entries are keyed by a digest of the original code object, which covers its source,
+       file name and compilation, along with the Python and slipcover builds and the options
+       that affect instrumentation."""
+
+    def __init__(self, cache_dir: Path, options: tuple):
+        self.cache_dir = Path(cache_dir)
+
+        # any of the package's modules may affect the layout, such as bytecode's branch_arcs
+        build = [sys.version]
+        for f in sorted(Path(__file__).parent.glob("*.py")) + [Path(tracker.__file__)]:
+            st = os.stat(f)
+            build.append((f.name, st.st_size, st.st_mtime_ns))
+        self.salt = marshal.dumps((tuple(build), options), 2)
+
+    def key(self, co: types.CodeType) -> Path | None:
+        """Returns the cache key for a code object, or None if it can't be cached."""
+        try:
+            # marshal's format 3+ depends on reference counts; 2 is deterministic, so that
+            # keys can be computed in other processes, such as when precompiling
+            data = marshal.dumps(co, 2)
+        except ValueError:
+            return None     # not marshallable
+
+        h = hashlib.sha256(self.salt)
+        h.update(data)
+        return self.cache_dir / f"{Path(co.co_filename).stem}.{h.hexdigest()[:32]}.slipcover"
+
+    def lookup(self, co: types.CodeType) -> Tuple[Path | None, tuple | None]:
+        """Returns the cache key for a code object, along with the entry cached for it,
+           if any."""
+        key = self.key(co)
+        if key is None:
+            return None, None
+
+        try:
+            return key, marshal.loads(key.read_bytes())
+        except (OSError, EOFError, ValueError, TypeError):
+            return key, None
+
+    def store(self, key: Path | None, entry: tuple) -> None:
+        if key is None:
+            return
+
+        try:
+            self.cache_dir.mkdir(parents=True, exist_ok=True)
+            # written under a temporary name, so that concurrent runs only see complete entries
+            tmp = key.with_name(f"{key.name}.{os.getpid()}.tmp")
+            tmp.write_bytes(marshal.dumps(entry))
+            os.replace(tmp, key)
+        except (OSError, ValueError):
+            pass    # caching is just an optimization
+
+
+class TieredCode:
+    """Called on entry to code laid out with just an entry probe (see Slipcover's tiered
+       option).  The first call fully instruments the original code and points the functions
+       known to use the entry code to it; each call through here then runs on that code."""
+
+    MAX_FUNCTIONS = 16  # functions kept for calls through here; see __init__
+
+    def __init__(self, sci: Slipcover, original: types.CodeType):
+        self.sci = sci
+        self.original = original
+        self.code: types.CodeType | None = None     # fully instrumented
+        self.entry: weakref.ref | None = None       # to the entry code
+
+        # Functions not pointed to the full code (not found through FunctionIndex) keep
+        # calling in here; the function built to run it is kept, rather than built on each
+        # call.  It keeps its globals and closure cells alive, so their ids identify them.
+        self.functions: Dict[tuple, types.FunctionType] = dict()
+
+        self.argcount = original.co_argcount
+        self.kwonly = original.co_varnames[self.argcount:self.argcount+original.co_kwonlyargcount]
+        self.varargs = bool(original.co_flags & inspect.CO_VARARGS)
+        self.varkw = bool(original.co_flags & inspect.CO_VARKEYWORDS)
+
+    def __call__(self, closure: tuple, params: tuple):
+        __tracebackhide__ = True    # for pytest
+
+        code = self.code or self.sci._tier_up(self)
+        f_globals = sys._getframe(1).f_globals
+        key = (id(f_globals), *map(id, closure or ()))
+        f = self.functions.get(key)
+        if f is None:
+            if len(self.functions) >= TieredCode.MAX_FUNCTIONS:
+                self.functions.clear()  # such as for closures made over and over
+            f = self.functions[key] = types.FunctionType(code, f_globals, code.co_name, None,
+                                                         closure or None)
+
+        # the parameters' values, as bound by the entry code
+        n = self.argcount + len(self.kwonly)
+        args = params[:self.argcount]
+        kwargs = dict(zip(self.kwonly, params[self.argcount:n]))
+        if self.varargs:
+            args += params[n]
+            n += 1
+        if self.varkw:
+            kwargs.update(params[n])
+
+        return f(*args, **kwargs)
+
+
+class CoverageSnapshot:
+    """Coverage as of some point in a run (see Slipcover.snapshot), such as after a warm-up
+       or a benchmark phase.  It holds copies of the tracker's bitmaps, converting them to
+       line lists only when asked for its coverage."""
+
+    def __init__(self, sci: Slipcover, epoch: int, files: dict):
+        self.count_lines = sci.count_lines
+        self.branch = sci.branch
+        self.epoch = epoch      # of snapshots taken from that Slipcover, starting at 1
+        self.files = files      # filename -> (code, seen, hits, code_arcs, seen_arcs)
+
+    def get_coverage(self, relative_to: Path | None = None) -> dict:
+        """Returns the coverage in this snapshot, as Slipcover.get_coverage does."""
+        return self.since(None, relative_to)
+
+    def since(self, earlier: CoverageSnapshot | None, relative_to: Path | None = None) -> dict:
+        """Returns what was covered between an earlier snapshot and this one, in the same
+           form as get_coverage: lines and branches first executed in between are listed as
+           executed, those still not executed as missing, and execution counts are those
+           in between.  File names are as for get_coverage."""
+        simp = PathSimplifier(relative_to)
+
+        def counts(hits: bytes | None) -> Counter:
+            from array import array
+            return Counter({line: n for line, n in enumerate(array('Q', hits)) if n}) \
+                   if hits is not None else Counter()
+
+        files = dict()
+        for f, (code_words, seen_words, hits, code_arcs, seen_arcs) in sorted(self.files.items()):
+            before = earlier.files.get(f) if earlier is not None else None
+
+            code = words_to_bitmap(code_words)
+            seen = words_to_bitmap(seen_words)
+            seen_before = words_to_bitmap(before[1]) if before else 0
+            f_files = {
+                'executed_lines': bitmap_to_lines(seen & ~seen_before),
+                'missing_lines': bitmap_to_lines(code & ~seen)
+            }
+
+            if self.count_lines:
+                # counts only grow, so the difference keeps just the lines executed in between
+                delta = counts(hits) - counts(before[2] if before else None)
+                f_files['execution_counts'] = dict(sorted(delta.items()))
+
+            if self.branch:
+                seen_arcs_before = set(before[4]) if before else set()
+                all_seen_arcs = set(seen_arcs)
+                f_files['executed_branches'] = [list(arc) for arc in seen_arcs
+                                                if arc not in seen_arcs_before]
+                f_files['missing_branches'] = [list(arc) for arc in code_arcs
+                                               if arc not in all_seen_arcs]
+
+            files[simp.simplify(f)] = f_files
+
+        return {'files': files}
+
+
 class Slipcover:
-    def __init__(self, collect_stats : bool = False, d_threshold = 50):
+    def __init__(self, collect_stats : bool = False, d_threshold = 50,
+                 tracker_per_code : bool = False, count_lines : bool = False,
+                 count_every : int = 1, branch : bool = False,
+                 async_deinstrument : bool = False, adaptive_threshold : bool = False,
+                 in_place : bool = False, cache_dir : Path | None = None,
+                 tiered : bool = False, profile_overhead : bool = False,
+                 coverage_file : Path | None = None):
         self.collect_stats = collect_stats
-        self.d_threshold = d_threshold
+
+        # whether to de-instrument by patching code objects in place, rather than replacing
+        # them; that removes probes for all users of the code at once, even running frames.
+        # Before 3.11, that would mean writing into co_code (see Editor.finish_in_place),
+        # so code is replaced there.
+        self.in_place = in_place and PYTHON_VERSION >= (3,11)
+
+        # whether to de-instrument from a background thread, rather than on whichever
+        # thread has a line reach the threshold
+        self.deinstrument_worker = DeinstrumentWorker(self) if async_deinstrument else None
+
+        # whether to also detect which branch arcs, from one line to another, are taken
+        self.branch = branch
+
+        # whether to count line executions, rather than just detect lines seen; if
+        # count_every > 1, only every Nth line execution is counted, approximating counts.
+        # Counting keeps the probes in place, so we never de-instrument.
+        self.count_lines = count_lines
+        self.d_threshold = -1 if count_lines else d_threshold
+
+        # whether to use a single tracker for each code object, with probes passing it
+        # the line's index, rather than one tracker (and constant) per line
+        self.tracker_per_code = tracker_per_code
+
+        # whether to give functions just an entry probe, instrumenting them fully only once
+        # called, so that the cost of instrumentation follows the code executed
+        self.tiered = tiered
+        self.entry_only: weakref.WeakSet = weakref.WeakSet()  # TieredCode not yet called
+
+        self.snapshot_epochs = itertools.count(1)   # numbers snapshots, see snapshot()
+
+        # whether to profile slipcover's own overhead, reporting it along with coverage;
+        # if so, all trackers are kept, so that their probe calls can be added up
+        self.overhead = OverheadProfile() if profile_overhead else None
+        self.profiled_trackers = []
+
+        # if given a directory, instrumented code is cached there across runs; probes are
+        # laid out the same way regardless of thresholds, as trackers handle those
+        self.cache = InstrumentationCache(cache_dir, (collect_stats, tracker_per_code, branch,
+                                                      self.in_place, tiered, count_lines)) \
+                     if cache_dir is not None and PYTHON_VERSION < (3,12) else None
 
         # mutex protecting this state
         self.lock = threading.RLock()
@@ -92,31 +453,46 @@ class Slipcover:
         self.replace_map: Dict[types.CodeType, types.CodeType] = dict()
         self.instrumented: Dict[str, set] = defaultdict(set)
 
-        # notes which code lines have been instrumented
-        self.code_lines: Dict[str, set] = defaultdict(set)
-
-        # notes which lines have been seen.
-        self.lines_seen: Dict[str, Set[int]] = defaultdict(set)
-
-        # notes lines seen since last de-instrumentation
-        self._get_new_lines()
+        # code objects replaced during de-instrumentation, by file.  Frames already running
+        # (suspended generators and coroutines, long loops) keep executing them, so their
+        # probes are disarmed in place as lines are seen; they drop out once unused.
+        # They're keyed by id, as versions of a code object compare equal.
+        self.retired: Dict[str, weakref.WeakValueDictionary] = \
+            defaultdict(weakref.WeakValueDictionary)
+
+        # function objects by code object, so that de-instrumentation can point them to
+        # new code without searching for them; instrumented code adds those it creates
+        self.function_index = tracker.new_function_index()
+
+        # notes which code lines have been instrumented and which have been seen,
+        # using per-file bitmaps kept by the tracker module; it also keeps execution
+        # counts, if counting.  With sys.monitoring, stats come from these counts.
+        # If adaptive_threshold, d_threshold is just where lines' thresholds start; the
+        # tracker module then also weighs D misses against the cost of passes.
+        # If given a coverage_file, it mirrors lines seen and counts into it as they
+        # happen (see read_coverage_file).
+        if count_lines:
+            self.line_map = tracker.new_line_map(max(count_every, 1), False, coverage_file)
+        else:
+            self.line_map = tracker.new_line_map(1 if collect_stats and PYTHON_VERSION >= (3,12) else 0,
+                                                 adaptive_threshold, coverage_file)
 
         self.modules = []
         self.all_trackers = []
 
-    def _get_new_lines(self):
-        """Returns the current set of ``new'' lines, leaving a new container in place."""
+        if PYTHON_VERSION >= (3,12):
+            # On 3.12+, rather than inserting probes, we enable sys.monitoring (PEP 669) LINE
+            # events on the code objects.  The handler records into the same line map, disabling
+            # each location once seen, unless the line map counts executions.
+            start_monitoring()
 
-        # We trust that assigning to self.new_lines_seen is atomic, as it is triggered
-        # by a STORE_NAME or similar opcode and Python synchronizes those.  We rely on
-        # C extensions' atomicity for updates within self.new_lines_seen.  The lock here
-        # is just to protect callers of this method (so that the exchange is atomic).
+    def _get_new_lines(self) -> Dict[str, Set[int]]:
+        """Returns the lines seen since the last call, by file."""
 
+        # The lock here is just to protect callers of this method (so that the exchange is
+        # atomic); trackers hand new lines over to the line map without locking.
         with self.lock:
-            new_lines = self.new_lines_seen if hasattr(self, "new_lines_seen") else None
-            self.new_lines_seen: Dict[str, Set[int]] = defaultdict(set)
-
-        return new_lines
+            return tracker.get_new_lines(self.line_map)
 
 
     def instrument(self, co: types.CodeType, parent: types.CodeType = 0) -> types.CodeType:
@@ -127,22 +503,100 @@ class Slipcover:
 
         if isinstance(co, types.FunctionType):
             co.__code__ = self.instrument(co.__code__)
+            self.function_index(co)
             return co.__code__
 
+        if self.overhead and not parent:
+            with self.overhead.timing('instrument'):
+                new_code = self._instrument_code(co, parent)
+            self.overhead.note_instrumented(co, new_code)
+            return new_code
+
+        return self._instrument_code(co, parent)
+
+
+    def _instrument_code(self, co: types.CodeType, parent: types.CodeType) -> types.CodeType:
         assert isinstance(co, types.CodeType)
         # print(f"instrumenting {co.co_name}")
 
+        if PYTHON_VERSION >= (3,12):
+            if self.branch:
+                def opcode_offset(offset: int) -> int:
+                    # events give the branch's own offset, past any EXTENDED_ARGs
+                    while co.co_code[offset] == bc.op_EXTENDED_ARG:
+                        offset += 2
+                    return offset
+
+                arcs = bc.branch_arcs(co)
+                code_arcs = {(opcode_offset(offset), dest): arc for (offset, _, dest, arc) in arcs}
+
+            previous_owner = tracker.set_code_owner(co, self.line_map,
+                                                    code_arcs if self.branch else None)
+
+            events = sys.monitoring.events
+            sys.monitoring.set_local_events(sys.monitoring.COVERAGE_ID, co,
+                                            events.LINE | (events.BRANCH if self.branch else 0))
+            if previous_owner is not None and previous_owner is not self.line_map:
+                sys.monitoring.restart_events()     # it may have disabled locations
+
+            # handle functions-within-functions
+            for c in co.co_consts:
+                if isinstance(c, types.CodeType):
+                    self.instrument(c, co)
+
+            with self.lock:
+                tracker.add_code_lines(self.line_map, co.co_filename, monitored_lines(co))
+
+                if self.branch:
+                    tracker.add_code_arcs(self.line_map, co.co_filename, [arc for *_, arc in arcs])
+
+            return co
+
+        new_code = self._bind(*self._cached_lay_out(co))
+
+        with self.lock:
+            self.instrumented[co.co_filename].add(new_code)
+
+        return new_code
+
+
+    def _cached_lay_out(self, co: types.CodeType) -> Tuple[types.CodeType, dict]:
+        """Like _lay_out, but going through the cache, if any."""
+        if not self.cache:
+            return self._lay_out(co)
+
+        cache_key, entry = self.cache.lookup(co)
+        if entry is None:
+            entry = self._lay_out(co)
+            self.cache.store(cache_key, entry)
+
+        return entry
+
+
+    def _lay_out(self, co: types.CodeType) -> Tuple[types.CodeType, dict]:
+        """Inserts probes into a code object, leaving None in the constants for the
+        trackers and other objects they use.
+
+        Returns the new code object, along with a description of where those go (see
+        _bind).  Both can be marshalled, so that they can be cached.
+        """
+
         ed = bc.Editor(co)
 
         # handle functions-within-functions
+        nested = []
         for i, c in enumerate(co.co_consts):
             if isinstance(c, types.CodeType):
-                ed.set_const(i, self.instrument(c, co))
+                nested_code, nested_layout = self._lay_out_entry(c) if self._tierable(c) \
+                                             else self._lay_out(c)
+                ed.set_const(i, nested_code)
+                nested.append((i, nested_layout))
 
-        ed.add_const(tracker.hit)   # used during de-instrumentation
-        tracker_signal_index = ed.add_const(tracker.signal)
+        hit_index = ed.add_const(None)  # tracker.hit, used during de-instrumentation
+        tracker_signal_index = ed.add_const(None)   # tracker.signal
 
-        delta = 0
+        offsets = []
+        linenos = []
         for (offset, lineno) in dis.findlinestarts(co):
             if lineno == 0: continue    # Python 3.11.0b4 generates a 0th line
 
@@ -151,70 +605,313 @@ class Slipcover:
                 while (offset < len(co.co_code) and co.co_code[offset-2] == bc.op_EXTENDED_ARG):
                     offset += 2 # TODO will we overtake the next offset from findlinestarts?
 
-            tr = tracker.register(self, co.co_filename, lineno, self.d_threshold)
-            tr_index = ed.add_const(tr)
-            if self.collect_stats:
-                self.all_trackers.append(tr)
+            offsets.append(offset)
+            linenos.append(lineno)
+
+        slab_index = None
+        if self.tracker_per_code:
+            slab_index = ed.add_const(None)
+
+            # reuse any int constants already present, as they're likely small
+            int_consts = {c: i for i, c in enumerate(co.co_consts) if type(c) is int}
+            def int_const(n: int) -> int:
+                if n not in int_consts:
+                    int_consts[n] = ed.add_const(n)
+                return int_consts[n]
+
+            tracker_indices = []
+            calls = [(offset, tracker_signal_index, (slab_index, int_const(i)))
+                     for i, offset in enumerate(offsets)]
+        else:
+            # the trackers for a code object are allocated (and freed) together
+            tracker_indices = [ed.add_const(None) for _ in linenos]
+            if self.collect_stats or PYTHON_VERSION >= (3,11):
+                # Call through tracker.signal: when collecting stats, so that it can be switched
+                # to tracker.hit; on 3.11+, because call specialization makes calling a builtin
+                # function faster than calling the tracker itself.
+                calls = [(offset, tracker_signal_index, (tr_index,))
+                         for offset, tr_index in zip(offsets, tracker_indices)]
+            else:
+                # trackers are callable, signalling their line
+                calls = [(offset, tr_index, ())
+                         for offset, tr_index in zip(offsets, tracker_indices)]
+
+        # inserting them all at once relocates the code in a single pass
+        ed.insert_function_calls(calls)
+
+        arcs = []
+        arc_indices = []
+        if self.branch:
+            # probes on branch outcomes call tracker.signal, like line probes collecting stats,
+            # so that they can be de-instrumented the same way
+            arcs = bc.branch_arcs(co)
+            arc_indices = [ed.add_const(None) for _ in arcs]
+            ed.insert_branch_calls([(offset, taken, tracker_signal_index, (tr_index,))
+                                    for (offset, taken, _, _), tr_index in zip(arcs, arc_indices)])
+
+        reentries = []
+        reentry_indices = []
+        if self.count_lines:
+            # jumps into the middle of a line, such as a loop's back to its 'for', skip
+            # the probe at its start, so they get probes of their own to count it again
+            reentries = bc.line_reentries(co)
+            reentry_indices = [ed.add_const(None) for _ in reentries]
+            ed.insert_branch_calls([(offset, True, tracker_signal_index, (tr_index,))
+                                    for (offset, _), tr_index in zip(reentries, reentry_indices)])
+
+        function_index_index = None
+        # tiered code needs the index as well, to point functions to their full instrumentation
+        if (not self.in_place or self.tiered) and \
+           any(isinstance(c, types.CodeType) for c in co.co_consts):
+            function_index_index = ed.add_const(None)
+            ed.insert_creation_calls(function_index_index)
+
+        ed.add_const('__slipcover__')  # mark instrumented
+
+        layout = {
+            'nested': nested,
+            'hit': hit_index,
+            'signal': tracker_signal_index,
+            'slab': slab_index,
+            'linenos': linenos,
+            'trackers': tracker_indices,
+            'arcs': [arc for *_, arc in arcs],
+            'arc_trackers': arc_indices,
+            'reentry_lines': [line for _, line in reentries],
+            'reentry_trackers': reentry_indices,
+            'function_index': function_index_index,
+            # Python 3.11.0b4 generates a 0th line
+            'code_lines': [line[1] for line in dis.findlinestarts(co) if line[1] != 0]
+        }
+
+        return self._finish(ed), layout
+
 
-            delta += ed.insert_function_call(offset+delta, tracker_signal_index, (tr_index,))
+    def _tierable(self, co: types.CodeType) -> bool:
+        """Returns whether a nested code object is to get just an entry probe at first."""
+        # Functions only: a class body runs as soon as it's defined, and generators and
+        # coroutines don't start running when called; comprehensions also run right away.
+        return self.tiered and \
+               (co.co_flags & (inspect.CO_OPTIMIZED | inspect.CO_NEWLOCALS)) == \
+                    (inspect.CO_OPTIMIZED | inspect.CO_NEWLOCALS) and \
+               not (co.co_flags & (inspect.CO_GENERATOR | inspect.CO_COROUTINE |
+                                   inspect.CO_ASYNC_GENERATOR | inspect.CO_ITERABLE_COROUTINE)) and \
+               (co.co_name == '<lambda>' or not co.co_name.startswith('<'))
 
+
+    def _lay_out_entry(self, co: types.CodeType) -> Tuple[types.CodeType, dict]:
+        """Like _lay_out, but inserting just an entry probe, which instruments the
+        original code once it's called (see TieredCode).
+        """
+        ed = bc.Editor(co)
+        entry_index = ed.add_const(None)
+        ed.insert_entry_call(entry_index)
         ed.add_const('__slipcover__')  # mark instrumented
-        new_code = ed.finish()
 
-        with self.lock:
+        layout = {
+            'original': co,
+            'entry': entry_index,
             # Python 3.11.0b4 generates a 0th line
-            self.code_lines[co.co_filename].update(line[1] for line in dis.findlinestarts(co) if line[1] != 0)
+            'code_lines': [line[1] for line in dis.findlinestarts(co) if line[1] != 0]
+        }
 
-            if not parent:
-                self.instrumented[co.co_filename].add(new_code)
+        return self._finish(ed), layout
 
-        return new_code
 
+    def _tier_up(self, tiered: TieredCode) -> types.CodeType:
+        """Fully instruments code first called through its entry probe."""
+        with self.lock, (self.overhead.timing('instrument') if self.overhead
+                         else contextlib.nullcontext()):
+            if tiered.code is None:
+                new_code = self._bind(*self._cached_lay_out(tiered.original))
+                self.instrumented[new_code.co_filename].add(new_code)
+                self.entry_only.discard(tiered)
+                tiered.code = new_code
+                if self.overhead:
+                    self.overhead.note_instrumented(tiered.original, new_code)
+
+                if (entry_code := tiered.entry()) is not None:
+                    for f in tracker.take_functions(self.function_index, entry_code):
+                        if f.__code__ is entry_code:
+                            f.__code__ = new_code
+                        self.function_index(f)
+
+            return tiered.code
+
+
+    def _finish(self, ed: bc.Editor, in_place: bool = False) -> types.CodeType:
+        """Finishes editing a code object, timing it if profiling overhead."""
+        finish = ed.finish_in_place if in_place else ed.finish
+        if not self.overhead:
+            return finish()
+
+        with self.overhead.timing('finish'):
+            return finish()
+
+
+    def precompile(self, co: types.CodeType) -> bool:
+        """Lays out instrumentation for a code object into the cache, so that instrumenting
+        it in a later run only needs to bind it.
+
+        Returns whether it was added, rather than already there or not cacheable.
+        """
+        if not self.cache:
+            return False
+
+        key = self.cache.key(co)
+        if key is None or key.exists():
+            return False
+
+        self.cache.store(key, self._lay_out(co))
+        return True
 
-    def deinstrument(self, co, lines: set) -> types.CodeType:
-        """De-instruments a code object previously instrumented for coverage detection.
 
-        If invoked on a function, de-instruments its code.
+    def _bind(self, co: types.CodeType, layout: dict) -> types.CodeType:
+        """Fills in the constants left out by _lay_out, registering new trackers."""
+
+        consts = list(co.co_consts)
+
+        if 'entry' in layout:
+            tiered = TieredCode(self, layout['original'])
+            consts[layout['entry']] = tiered
+
+            # lines are known up front, to be reported as missing; as finding branches isn't
+            # as quick, that's left for when reporting (if still needed then)
+            with self.lock:
+                tracker.add_code_lines(self.line_map, co.co_filename, layout['code_lines'])
+                if self.branch:
+                    self.entry_only.add(tiered)
+
+            co = co.replace(co_consts=tuple(consts))
+            tiered.entry = weakref.ref(co)
+            return co
+
+        for i, nested_layout in layout['nested']:
+            consts[i] = self._bind(consts[i], nested_layout)
+
+        consts[layout['hit']] = tracker.hit
+        consts[layout['signal']] = tracker.signal
+
+        if layout['slab'] is not None:
+            slab = tracker.register_code(self, co.co_filename, layout['linenos'], self.d_threshold)
+            consts[layout['slab']] = slab
+            trackers = [(slab, i) for i in range(len(layout['linenos']))]
+        else:
+            trackers = []
+            for i, tr in zip(layout['trackers'],
+                             tracker.register_many(self, co.co_filename, layout['linenos'],
+                                                   self.d_threshold)):
+                consts[i] = tr
+                trackers.append((tr,))
+
+        if self.collect_stats:
+            self.all_trackers.extend(trackers)
+        if self.overhead:
+            self.profiled_trackers.extend(trackers)
+
+        if layout['arcs']:
+            for i, tr in zip(layout['arc_trackers'],
+                             tracker.register_arcs(self, co.co_filename, layout['arcs'],
+                                                   self.d_threshold)):
+                consts[i] = tr
+                if self.overhead:
+                    self.profiled_trackers.append((tr,))
+
+        if layout['reentry_lines']:
+            # counted with the line, rather than in stats as probes of their own
+            for i, tr in zip(layout['reentry_trackers'],
+                             tracker.register_many(self, co.co_filename, layout['reentry_lines'],
+                                                   self.d_threshold)):
+                consts[i] = tr
+
+        if layout['function_index'] is not None:
+            consts[layout['function_index']] = self.function_index
+
+        with self.lock:
+            tracker.add_code_lines(self.line_map, co.co_filename, layout['code_lines'])
+            if self.branch:
+                tracker.add_code_arcs(self.line_map, co.co_filename, layout['arcs'])
+
+        return co.replace(co_consts=tuple(consts))
+
+
+    def deinstrument(self, co, lines: set, arcs: set = frozenset(),
+                     retired: bool = False) -> types.CodeType:
+        """De-instruments a code object previously instrumented for coverage detection,
+        removing the probes for the given lines and branch arcs.
+
+        If invoked on a function, de-instruments its code.  If retired, the code object
+        is one that has already been replaced, and is patched in place, leaving out any
+        code objects in its constants (they're retired themselves, if replaced).
         """
 
         if isinstance(co, types.FunctionType):
-            co.__code__ = self.deinstrument(co.__code__, lines)
+            co.__code__ = self.deinstrument(co.__code__, lines, arcs)
             return co.__code__
 
         assert isinstance(co, types.CodeType)
         # print(f"de-instrumenting {co.co_name}")
 
+        if PYTHON_VERSION >= (3,12):
+            return co   # sys.monitoring events are disabled as they're seen
+
+        if self.count_lines:
+            return co   # counting needs the probes
+
+        if any(isinstance(c, TieredCode) for c in co.co_consts):
+            return co   # just an entry probe, which removes itself once called
+
         ed = bc.Editor(co)
 
         co_consts = co.co_consts
-        for i, c in enumerate(co_consts):
+        for i, c in enumerate(co_consts if not retired else ()):
             if isinstance(c, types.CodeType):
-                nc = self.deinstrument(c, lines)
+                nc = self.deinstrument(c, lines, arcs)
                 if nc is not c:
                     ed.set_const(i, nc)
 
+        def deinstrument_signal(offset: int, func: list) -> None:
+            # the tracker is passed either by itself or as a (slab, index) pair
+            tracker.deinstrument(*(co_consts[i] for i in func[1:]))
+
+            if not self.collect_stats:
+                ed.disable_inserted_function(offset)
+            else:
+                # If collecting stats, rather than disabling the tracker, we switch to
+                # calling the 'tracker.hit' function on it (which we conveniently added
+                # to the consts before tracker.signal, during instrumentation), so that
+                # we have the total execution count needed for the reports.
+                ed.replace_inserted_function(offset, func[0]-1)
+
         for (offset, lineno) in dis.findlinestarts(co):
             if lineno in lines and (func := ed.get_inserted_function(offset)):
                 func_index = func[0]
-                if co_consts[func_index] == tracker.signal:
-                    tracker.deinstrument(co_consts[func[1]])
-
-                    if not self.collect_stats:
-                        ed.disable_inserted_function(offset)
-                    else:
-                        # If collecting stats, rather than disabling the tracker, we switch to
-                        # calling the 'tracker.hit' function on it (which we conveniently added
-                        # to the consts before tracker.signal, during instrumentation), so that
-                        # we have the total execution count needed for the reports.
-                        ed.replace_inserted_function(offset, func_index-1)
-
-        new_code = ed.finish()
+                if isinstance(co_consts[func_index], tracker.Tracker):
+                    tracker.deinstrument(co_consts[func_index])
+                    ed.disable_inserted_function(offset)
+
+                elif co_consts[func_index] == tracker.signal:
+                    deinstrument_signal(offset, func)
+
+        if arcs:
+            # branch probes aren't at line starts; their trackers identify them
+            for (offset, func) in ed.get_inserted_functions():
+                if co_consts[func[0]] == tracker.signal and len(func) == 2 and \
+                   isinstance(co_consts[func[1]], tracker.Tracker) and \
+                   tracker.get_arc(co_consts[func[1]]) in arcs:
+                    deinstrument_signal(offset, func)
+
+        if self.in_place or retired:
+            return self._finish(ed, in_place=True)
+
+        new_code = self._finish(ed)
         if new_code is co:
             return co
 
         with self.lock:
             # Interesting (and useful fact): dict sees code edited this way as being the same
             self.replace_map[co] = new_code
+            self.retired[co.co_filename][id(co)] = co
 
             if co in self.instrumented[co.co_filename]:
                 self.instrumented[co.co_filename].remove(co)
@@ -223,70 +920,148 @@ class Slipcover:
         return new_code
 
 
-    def get_coverage(self):
-        """Returns coverage information collected."""
+    def get_coverage(self, relative_to: Path | None = None):
+        """Returns coverage information collected.  File names under relative_to
+        (by default, the current directory) are given relative to it."""
 
-        with self.lock:
-            # FIXME calling _get_new_lines will prevent de-instrumentation if still running!
-            new_lines = self._get_new_lines()
+        cov = {'files': dict(self.iter_coverage(relative_to))}
+        if self.overhead:
+            with self.lock:
+                cov['overhead'] = self._overhead_report()
 
-            for file, lines in new_lines.items():
-                self.lines_seen[file].update(lines)
+        return cov
 
-            simp = PathSimplifier()
+
+    def snapshot(self) -> CoverageSnapshot:
+        """Takes a snapshot of the coverage so far, for comparing phases of a run.  It's
+        cheap, and doesn't disturb the run: it neither waits for nor holds up
+        de-instrumentation, and leaves the lines awaiting it as they are.  Unlike
+        get_coverage, it doesn't list the branches of tiered code not yet called."""
+        return CoverageSnapshot(self, next(self.snapshot_epochs), tracker.snapshot(self.line_map))
+
+
+    def iter_coverage(self, relative_to: Path | None = None) -> Iterator[Tuple[str, dict]]:
+        """Yields coverage information collected, as (file name, file coverage) pairs
+        sorted by file name, as in get_coverage's 'files'.  Each file's is retrieved
+        as it's yielded, so that reports needn't hold all of them at once."""
+
+        with self.lock:
+            simp = PathSimplifier(relative_to)
 
             if self.collect_stats:
                 d_misses = defaultdict(Counter)
                 u_misses = defaultdict(Counter)
                 totals = defaultdict(Counter)
                 for t in self.all_trackers:
-                    filename, lineno, d_miss_count, u_miss_count, total_count = tracker.get_stats(t)
+                    filename, lineno, d_miss_count, u_miss_count, total_count = tracker.get_stats(*t)
                     if d_miss_count: d_misses[filename].update({lineno: d_miss_count})
                     if u_miss_count: u_misses[filename].update({lineno: u_miss_count})
                     totals[filename].update({lineno: total_count})
 
-            files = dict()
-            for f, f_code_lines in self.code_lines.items():
-                seen = self.lines_seen[f] if f in self.lines_seen else set()
+                # with sys.monitoring, events are never disabled while collecting stats,
+                # so there are no misses; just execution counts.
+                if PYTHON_VERSION >= (3,12):
+                    for filename, counts in tracker.get_hit_counts(self.line_map).items():
+                        totals[filename].update(counts)
 
-                f_files = {
-                    'executed_lines': sorted(seen),
-                    'missing_lines': sorted(f_code_lines - seen)
-                }
+            if self.branch:
+                for tiered in list(self.entry_only):
+                    tracker.add_code_arcs(self.line_map, tiered.original.co_filename,
+                                          [arc for *_, arc in bc.branch_arcs(tiered.original)])
+                self.entry_only.clear()
 
-                if self.collect_stats:
-                    # Once a line reports in, it's available for deinstrumentation.
-                    # Each time it reports in after that, we consider it a miss (like a cache miss).
-                    # We differentiate between (de-instrument) "D misses", where a line
-                    # reports in after it _could_ have been de-instrumented and (use) "U misses"
-                    # and where a line reports in after it _has_ been de-instrumented, but
-                    # didn't use the code object where it's deinstrumented.
-                    f_files['stats'] = {
-                        'd_misses_pct': round(d_misses[f].total()/totals[f].total()*100, 1),
-                        'u_misses_pct': round(u_misses[f].total()/totals[f].total()*100, 1),
-                        'top_d_misses': [f"{it[0]}:{it[1]}" for it in d_misses[f].most_common(5)],
-                        'top_u_misses': [f"{it[0]}:{it[1]}" for it in u_misses[f].most_common(5)],
-                        'top_lines': [f"{it[0]}:{it[1]}" for it in totals[f].most_common(5)],
-                    }
+            files = sorted((simp.simplify(f), f) for f in tracker.get_files(self.line_map))
 
-                files[simp.simplify(f)] = f_files
+        for name, f in files:
+            executed, missing, executed_arcs, missing_arcs, counts = \
+                tracker.get_file_coverage(self.line_map, f)
+            f_files = {
+                'executed_lines': executed,
+                'missing_lines': missing
+            }
+
+            if self.count_lines:
+                f_files['execution_counts'] = counts if counts is not None else {}
+
+            if self.branch:
+                f_files['executed_branches'] = [list(arc) for arc in executed_arcs]
+                f_files['missing_branches'] = [list(arc) for arc in missing_arcs]
+
+            if self.collect_stats:
+                # Once a line reports in, it's available for deinstrumentation.
+                # Each time it reports in after that, we consider it a miss (like a cache miss).
+                # We differentiate between (de-instrument) "D misses", where a line
+                # reports in after it _could_ have been de-instrumented and (use) "U misses"
+                # and where a line reports in after it _has_ been de-instrumented, but
+                # didn't use the code object where it's deinstrumented.
+                f_files['stats'] = {
+                    'd_misses_pct': round(d_misses[f].total()/totals[f].total()*100, 1),
+                    'u_misses_pct': round(u_misses[f].total()/totals[f].total()*100, 1),
+                    'top_d_misses': [f"{it[0]}:{it[1]}" for it in d_misses[f].most_common(5)],
+                    'top_u_misses': [f"{it[0]}:{it[1]}" for it in u_misses[f].most_common(5)],
+                    'top_lines': [f"{it[0]}:{it[1]}" for it in totals[f].most_common(5)],
+                }
 
-            return {'files': files}
+            yield name, f_files
+
+
+    def _overhead_report(self) -> dict:
+        """Summarizes the time and space taken by slipcover's own work."""
+        def ms(what: str) -> float:
+            return round(self.overhead.seconds[what] * 1000, 1)
+
+        counts = self.overhead.counts
+        report = {
+            'instrument_ms': ms('instrument'),
+            'instrumented_code': counts['instrument'],
+            'editor_finish_ms': ms('finish'),
+            'editor_finishes': counts['finish'],
+            'deinstrument_ms': ms('deinstrument'),
+            'deinstrument_edit_ms': ms('deinstrument_edit'),
+            'deinstrument_functions_ms': ms('deinstrument_functions'),
+            'deinstrument_passes': counts['deinstrument'],
+            'bytecode_added': counts['bytecode_added'],
+            'consts_added': counts['consts_added'],
+            'trackers': len(self.profiled_trackers),
+            'tracker_bytes': len(self.profiled_trackers) * tracker.Tracker.__basicsize__,
+        }
+
+        if PYTHON_VERSION < (3,12):
+            # trackers count every call, including the first (their "total" in stats)
+            probe_calls = sum(tracker.get_stats(*t)[4] for t in self.profiled_trackers)
+            report['probe_calls'] = probe_calls
+            report['probe_ms_estimate'] = round(probe_calls * self.overhead.probe_cost() * 1000, 1)
+
+        # replaced code still referenced, such as by running frames
+        old_code = [co for file_retired in self.retired.values() for co in file_retired.values()]
+        report['old_code'] = len(old_code)
+        report['old_code_bytes'] = sum(sys.getsizeof(co) +
+                                       (sys.getsizeof(co.co_code) if PYTHON_VERSION < (3,11) else 0)
+                                       for co in old_code)
+
+        return report
 
 
     @staticmethod
-    def format_missing(missing_lines : List[int], executed_lines : List[int]) -> List[str]:
-        """Formats ranges of missing lines, including non-code (e.g., comments) ones that fall between missed ones"""
+    def format_missing(missing_lines : List[int], executed_lines : List[int],
+                       missing_branches : List[List[int]] = []) -> List[str]:
+        """Formats ranges of missing lines, including non-code (e.g., comments) ones that fall between missed ones,
+           followed by any missing branches from lines executed"""
         def find_ranges():
-            executed = set(executed_lines)
+            # a single pass over both, in order, so that it takes linear time
+            ex = iter(sorted(executed_lines))   # usually already sorted, and then linear
+            e = next(ex, None)
             it = iter(missing_lines)    # assumed sorted
             a = next(it, None)
             while a is not None:
                 b = a
                 n = next(it, None)
                 while n is not None:
-                    if any(l in executed for l in range(b+1, n+1)):
-                        break
+                    while e is not None and e <= b:
+                        e = next(ex, None)
+
+                    if e is not None and e <= n:
+                        break   # an executed line falls between b and n
 
                     b = n
                     n = next(it, None)
@@ -295,42 +1070,195 @@ class Slipcover:
 
                 a = n
 
-        return ", ".join(find_ranges())
-
+        executed = set(executed_lines)
+        partial = [f"{a}->{b}" for a, b in missing_branches if a in executed]
+        return ", ".join([*find_ranges(), *partial])
 
-    def print_coverage(self, outfile=sys.stdout) -> None:
-        cov = self.get_coverage()
 
+    @staticmethod
+    def merge_coverage(cov: dict, other: dict) -> None:
+        """Merges coverage information from another process (or run) of the same code
+        into cov, as returned by get_coverage.  Either may have been through JSON."""
+
+        def merge(f_cov: dict, f_other: dict, executed: str, missing: str, key=int) -> None:
+            if executed not in f_other:
+                return
+
+            seen = set(map(key, f_cov[executed])) | set(map(key, f_other[executed]))
+            code = seen | set(map(key, f_cov[missing])) | set(map(key, f_other[missing]))
+            f_cov[executed] = sorted(seen)
+            f_cov[missing] = sorted(code - seen)
+
+        for f, f_other in other['files'].items():
+            if f not in cov['files']:
+                # a copy, so that merging more into it leaves other as it was
+                cov['files'][f] = copy.deepcopy(f_other)
+                continue
+
+            f_cov = cov['files'][f]
+
+            merge(f_cov, f_other, 'executed_lines', 'missing_lines')
+            if 'executed_branches' in f_cov:
+                merge(f_cov, f_other, 'executed_branches', 'missing_branches', key=tuple)
+                f_cov['executed_branches'] = [list(arc) for arc in f_cov['executed_branches']]
+                f_cov['missing_branches'] = [list(arc) for arc in f_cov['missing_branches']]
+
+            if 'execution_counts' in f_cov:
+                # JSON has the line numbers as strings
+                counts = Counter({int(line): n for line, n in f_cov['execution_counts'].items()})
+                counts.update({int(line): n for line, n in
+                               f_other.get('execution_counts', {}).items()})
+                f_cov['execution_counts'] = dict(sorted(counts.items()))
+
+            # stats describe a single process' probes; they're kept as they are
+
+
+    def write_json(self, outfile=sys.stdout, pretty_print: bool = False, cov: dict | None = None) -> None:
+        """Writes the given coverage or, by default, the coverage collected, as JSON; the
+           same JSON as json.dumps would, but written a file at a time (see iter_coverage)."""
+        import json
+
+        # what json.dumps(..., indent=4) puts between items, and before each level
+        newline, sep, pad = ("\n", ",", " " * 4) if pretty_print else ("", ", ", "")
+
+        def dumps(obj, level: int) -> str:
+            return json.dumps(obj, indent=4).replace("\n", "\n" + pad * level) \
+                   if pretty_print else json.dumps(obj)
+
+        if cov is not None:
+            files = cov['files'].items()
+            others = [(k, v) for k, v in cov.items() if k != 'files']
+        else:
+            files = self.iter_coverage()
+            others = []
+
+        outfile.write('{' + newline + pad + '"files": {')
+        empty = True
+        for f, f_info in files:
+            outfile.write(("" if empty else sep) + newline + pad * 2 +
+                          json.dumps(f) + ": " + dumps(f_info, 2))
+            empty = False
+        outfile.write("}" if empty else newline + pad + "}")
+
+        if cov is None and self.overhead:
+            with self.lock:
+                others.append(('overhead', self._overhead_report()))
+
+        for k, v in others:
+            outfile.write(sep + newline + pad + json.dumps(k) + ": " + dumps(v, 1))
+
+        outfile.write(newline + "}\n")
+
+
+    def print_coverage(self, outfile=sys.stdout, cov: dict | None = None) -> None:
+        """Prints a report of the given coverage or, by default, of the coverage collected,
+           retrieving it a file at a time (see iter_coverage)."""
         from tabulate import tabulate
 
-        def table(files):
-            for f, f_info in sorted(files.items()):
-                seen = len(f_info['executed_lines'])
-                miss = len(f_info['missing_lines'])
-                total = seen+miss
-                yield [f, total, miss, int(100*seen/total),
-                       Slipcover.format_missing(f_info['missing_lines'], f_info['executed_lines'])]
+        # The main table can be as long as the code is large, so rather than handing it
+        # all to tabulate, it's laid out as tabulate would, with columns sized from just
+        # the numbers of lines and branches, and printed a file at a time.
+        if cov is not None:
+            files: Iterable[Tuple[str, dict]] = sorted(cov['files'].items())
+            sizes = [(f, len(f_info['executed_lines']), len(f_info['missing_lines']),
+                      len(f_info.get('executed_branches', [])), len(f_info.get('missing_branches', [])))
+                     for f, f_info in files]
+        else:
+            simp = PathSimplifier()
+            sizes = [(simp.simplify(f), *f_sizes)
+                     for f, f_sizes in tracker.get_coverage_sizes(self.line_map).items()]
+            files = self.iter_coverage()
+
+        def row(f: str, seen: int, miss: int, br_seen: int, br_miss: int) -> list:
+            total = seen+miss
+            cells = [f, total, miss]
+
+            if self.branch:
+                # as with coverage.py, branches count towards the percentage
+                cells += [br_seen+br_miss, br_miss]
+                seen += br_seen
+                total += br_seen+br_miss
+
+            return cells + [int(100*seen/total)]
+
+        headers = ["File", "#lines", "#miss"] + (["#br", "#brmiss"] if self.branch else []) + \
+                  ["Cover%", "Lines missing"]
+        size_rows = [row(*f_sizes) for f_sizes in sizes]
+        widths = [max([len(h) + 2] + [len(str(r[i])) for r in size_rows])
+                  for i, h in enumerate(headers[:-1])] + [len(headers[-1]) + 2]
+
+        def print_row(cells) -> None:
+            # the file name and missing lines are left aligned, the numbers right aligned
+            print("  ".join(str(c).ljust(w) if i in (0, len(widths)-1) else str(c).rjust(w)
+                            for i, (c, w) in enumerate(zip(cells, widths))).rstrip(), file=outfile)
 
         print("", file=outfile)
-        print(tabulate(table(cov['files']),
-              headers=["File", "#lines", "#miss", "Cover%", "Lines missing"]), file=outfile)
+        print_row(headers)
+        print_row(["-" * w for w in widths])
+
+        stats_rows = []
+        counts_rows = []
+        for f, f_info in files:
+            # the numbers come from the same retrieval as the missing lines, so they agree
+            print_row(row(f, len(f_info['executed_lines']), len(f_info['missing_lines']),
+                          len(f_info.get('executed_branches', [])),
+                          len(f_info.get('missing_branches', []))) +
+                      [Slipcover.format_missing(f_info['missing_lines'], f_info['executed_lines'],
+                                                f_info.get('missing_branches', []))])
 
-        def stats_table(files):
-            for f, f_info in sorted(files.items()):
+            if self.collect_stats:
                 stats = f_info['stats']
+                stats_rows.append((f, stats['d_misses_pct'], stats['u_misses_pct'],
+                                   " ".join(stats['top_d_misses'][:4]),
+                                   " ".join(stats['top_u_misses'][:4]),
+                                   " ".join(stats['top_lines'][:4])))
 
-                yield (f, stats['d_misses_pct'], stats['u_misses_pct'],
-                       " ".join(stats['top_d_misses'][:4]),
-                       " ".join(stats['top_u_misses'][:4]),
-                       " ".join(stats['top_lines'][:4])
-                )
+            if self.count_lines:
+                counts = Counter(f_info['execution_counts'])
+                counts_rows.append((f, counts.total(),
+                                    " ".join(f"{it[0]}:{it[1]}" for it in counts.most_common(5))))
 
         if self.collect_stats:
             print("\n", file=outfile)
-            print(tabulate(stats_table(cov['files']),
+            print(tabulate(stats_rows,
                            headers=["File", "D miss%", "U miss%", "Top D", "Top U", "Top lines"]),
                   file=outfile)
 
+        if self.count_lines:
+            print("\n", file=outfile)
+            print(tabulate(counts_rows, headers=["File", "Executions", "Top lines"]), file=outfile)
+
+        def overhead_table(overhead):
+            yield ("instrument()", f"{overhead['instrument_ms']} ms",
+                   f"{overhead['instrumented_code']} code objects")
+            yield ("Editor.finish()", f"{overhead['editor_finish_ms']} ms",
+                   f"{overhead['editor_finishes']} calls, within the others")
+            yield ("deinstrument_seen()", f"{overhead['deinstrument_ms']} ms",
+                   f"{overhead['deinstrument_passes']} passes")
+            yield ("editing code", f"{overhead['deinstrument_edit_ms']} ms", "within passes")
+            yield ("repointing functions", f"{overhead['deinstrument_functions_ms']} ms",
+                   "within passes")
+            if 'probe_calls' in overhead:
+                yield ("probe calls", f"~{overhead['probe_ms_estimate']} ms",
+                       f"{overhead['probe_calls']} calls")
+            yield ("bytecode added", f"{overhead['bytecode_added']} bytes",
+                   f"{overhead['consts_added']} constants")
+            yield ("trackers", f"{overhead['tracker_bytes']} bytes",
+                   f"{overhead['trackers']} trackers")
+            yield ("old code versions", f"{overhead['old_code_bytes']} bytes",
+                   f"{overhead['old_code']} code objects")
+
+        if self.overhead:
+            if cov is not None:
+                overhead = cov['overhead']
+            else:
+                with self.lock:
+                    overhead = self._overhead_report()
+
+            print("\n", file=outfile)
+            print(tabulate(overhead_table(overhead), headers=["Overhead", "", ""],
+                           colalign=("left", "right", "left")), file=outfile)
+
 
     @staticmethod
     def find_functions(items, visited : set):
@@ -379,43 +1307,173 @@ class Slipcover:
         self.modules.append(m)
 
 
+    def threshold_reached(self) -> None:
+        """Invoked by the tracker when a line's D misses reach the de-instrumentation threshold."""
+        if self.deinstrument_worker:
+            self.deinstrument_worker.request()
+        else:
+            self.deinstrument_seen()
+
+
     def deinstrument_seen(self) -> None:
+        start = time.perf_counter()
+
         with self.lock:
             new_lines = self._get_new_lines()
+            new_arcs = tracker.get_new_arcs(self.line_map) if self.branch else dict()
 
-            for file, new_set in new_lines.items():
-                if self.collect_stats: new_set = set(new_set)    # Counter -> set
-
+            edit_start = time.perf_counter()
+            for file in new_lines.keys() | new_arcs.keys():
                 for co in self.instrumented[file]:
-                    self.deinstrument(co, new_set)
-
-                self.lines_seen[file].update(new_set)
-
-            # Replace references to code
-            if self.replace_map:
-                visited = set()
-
-                # XXX the set of function objects could be pre-computed at register_module;
-                # also, the same could be done for functions objects in globals()
-                for m in self.modules:
-                    for f in Slipcover.find_functions(m.__dict__.values(), visited):
-                        if f.__code__ in self.replace_map:
-                            f.__code__ = self.replace_map[f.__code__]
-
-                globals_seen = []
-                for frame in sys._current_frames().values():
-                    while frame:
-                        if not frame.f_globals in globals_seen:
-                            globals_seen.append(frame.f_globals)
-                            for f in Slipcover.find_functions(frame.f_globals.values(), visited):
-                                if f.__code__ in self.replace_map:
-                                    f.__code__ = self.replace_map[f.__code__]
-
-                        for f in Slipcover.find_functions(frame.f_locals.values(), visited):
-                            if f.__code__ in self.replace_map:
-                                f.__code__ = self.replace_map[f.__code__]
-
-                        frame = frame.f_back
-
-                # all references should have been replaced now... right?
-                self.replace_map.clear()
+                    self.deinstrument(co, new_lines.get(file, set()), new_arcs.get(file, set()))
+
+                # replaced code can only be patched in place on 3.11+
+                for co in list(self.retired[file].values()) if PYTHON_VERSION >= (3,11) else ():
+                    self.deinstrument(co, new_lines.get(file, set()), new_arcs.get(file, set()),
+                                      retired=True)
+
+            # Point functions to the new code
+            functions_start = time.perf_counter()
+            for old_code, new_code in self.replace_map.items():
+                for f in tracker.take_functions(self.function_index, old_code):
+                    if f.__code__ is old_code:
+                        f.__code__ = new_code
+                    self.function_index(f)
+
+            self.replace_map.clear()
+
+            if self.overhead:
+                end = time.perf_counter()
+                self.overhead.add('deinstrument_edit', functions_start - edit_start)
+                self.overhead.add('deinstrument_functions', end - functions_start)
+                self.overhead.add('deinstrument', end - start)
+
+        tracker.deinstrument_pass_done(self.line_map, time.perf_counter() - start)
+
+
+_precompiler: Slipcover | None = None
+
+def _precompile_init(options: dict) -> None:
+    global _precompiler
+    _precompiler = Slipcover(**options)
+
+def _precompile_file(path: str) -> bool:
+    from importlib.machinery import SourceFileLoader
+
+    # the same code the import system gets, so that the loader finds it in the cache
+    try:
+        co = SourceFileLoader(Path(path).stem, path).get_code(None)
+    except (ImportError, SyntaxError, ValueError, OSError):
+        return False    # importing it would fail as well
+
+    return _precompiler.precompile(co)
+
+def precompile_files(files: List[Path], jobs: int | None = None, **options) -> int:
+    """Lays out instrumentation for the given source files into the cache, across a pool
+       of processes.  The options are as for Slipcover, and must include cache_dir; they
+       should match those of the runs meant to use the cache.  Returns how many files
+       were added to the cache."""
+    from concurrent.futures import ProcessPoolExecutor
+
+    files = [str(f) for f in files]
+    jobs = jobs or os.cpu_count() or 1
+    with ProcessPoolExecutor(max_workers=jobs, initializer=_precompile_init,
+                             initargs=(options,)) as executor:
+        return sum(executor.map(_precompile_file, files,
+                                chunksize=max(1, len(files) // (4*jobs))))
+
+
+def lines_to_bitmap(lines: List[int]) -> int:
+    """Returns a bitmap, as a Python int, with the given line numbers set."""
+    if not lines:
+        return 0
+
+    b = bytearray((max(lines) >> 3) + 1)
+    for line in lines:
+        b[line >> 3] |= 1 << (line & 7)
+    return int.from_bytes(b, 'little')
+
+
+def bitmap_to_lines(bitmap: int) -> List[int]:
+    """Returns the sorted line numbers set in a bitmap, as from lines_to_bitmap."""
+    lines = []
+    for i, byte in enumerate(bitmap.to_bytes((bitmap.bit_length() + 7) >> 3, 'little')):
+        while byte:
+            low = byte & -byte
+            lines.append((i << 3) + low.bit_length() - 1)
+            byte ^= low
+    return lines
+
+
+def words_to_bitmap(words: bytes) -> int:
+    """Returns a bitmap, as from lines_to_bitmap, from bytes of native u64 words,
+       as the tracker module keeps them."""
+    from array import array
+
+    a = array('Q', words)
+    if sys.byteorder == 'big':
+        a.byteswap()
+    return int.from_bytes(a.tobytes(), 'little')
+
+
+def read_coverage_file_bitmaps(path: Path) -> Tuple[dict, dict, dict | None]:
+    """Reads a coverage file written while running with Slipcover's coverage_file option,
+       returning bitmaps of code lines and of lines seen (see lines_to_bitmap), and
+       execution counts if it has them, each by file name.  The file may have been left
+       by a process that ended abruptly, or that's still running."""
+    import struct
+
+    data = Path(path).read_bytes()
+    if len(data) < 16 or data[:8] != b"SLIPCOV\0":
+        raise ValueError(f"{path}: not a slipcover coverage file")
+    version, flags = struct.unpack_from("=II", data, 8)
+    if version != 1:
+        raise ValueError(f"{path}: unsupported coverage file version {version}")
+
+    def bitmap(start: int, size: int) -> int:
+        return words_to_bitmap(data[start:start + size])
+
+    code: Dict[str, int] = defaultdict(int)
+    seen: Dict[str, int] = defaultdict(int)
+    hits: Dict[str, Counter] | None = defaultdict(Counter) if flags & 1 else None
+
+    pos = 16
+    while pos + 8 <= len(data):
+        rec_type, size = struct.unpack_from("=II", data, pos)
+        if rec_type == 0 or size < 8 or pos + size > len(data):
+            break   # the end, or a record left half-written
+
+        if rec_type == 1:
+            name_len, lines = struct.unpack_from("=II", data, pos + 8)
+            name = data[pos + 16:pos + 16 + name_len].decode("utf-8", errors="surrogateescape")
+            bitmap_size = (lines + 63) // 64 * 8
+            bitmaps = pos + 16 + (name_len + 7) // 8 * 8
+            code[name] |= bitmap(bitmaps, bitmap_size)
+            seen[name] |= bitmap(bitmaps + bitmap_size, bitmap_size)
+            if hits is not None:
+                file_hits = struct.unpack_from(f"={lines}Q", data, bitmaps + 2*bitmap_size)
+                hits[name].update({line: n for line, n in enumerate(file_hits) if n})
+
+        pos += size
+
+    return code, seen, hits
+
+
+def read_coverage_file(path: Path, relative_to: Path | None = None) -> dict:
+    """Reads a coverage file (see read_coverage_file_bitmaps), returning its contents
+       as get_coverage would have (without branches or stats)."""
+    code, seen, hits = read_coverage_file_bitmaps(path)
+
+    simp = PathSimplifier(relative_to)
+    files = dict()
+    for name in code:
+        f_files = {
+            'executed_lines': bitmap_to_lines(seen[name] & code[name]),
+            'missing_lines': bitmap_to_lines(code[name] & ~seen[name])
+        }
+        if hits is not None:
+            f_files['execution_counts'] = dict(sorted(hits[name].items()))
+
+        files[simp.simplify(name)] = f_files
+
+    return {'files': files}
@@ -7,6 +7,9 @@ import sys
 
 PYTHON_VERSION = sys.version_info[0:2]
 
+if PYTHON_VERSION >= (3,12):
+    pytest.skip("N/A: 3.12+ uses sys.monitoring rather than editing bytecode", allow_module_level=True)
+
 def current_line():
     import inspect as i
     return i.getframeinfo(i.currentframe().f_back).lineno
@@ -602,3 +605,268 @@ def test_adjust_long_jump(N):
     print([b.arg() for b in orig_branches])
     print([b.arg() for b in bc.Branch.from_code(code)])
     assert any(b.length > orig_branches[i].length for i, b in enumerate(bc.Branch.from_code(code)))
+
+
+def test_insert_function_calls_same_as_one_at_a_time():
+    src = "def foo(x):\n" + \
+          "".join(f"  if x == {i}:\n" + \
+                  f"    x += 1\n" + \
+                  f"  for j in range(2):\n" + \
+                  f"    try:\n" + \
+                  f"      x += j\n" + \
+                  f"    except Exception:\n" + \
+                  f"      pass\n" for i in range(100)) + \
+          "  return x\n"
+
+    orig_code = compile(src, "foo", "exec")
+    orig_code = next(c for c in orig_code.co_consts if isinstance(c, types.CodeType))
+
+    def bar():
+        pass
+
+    starts = [off for off, line in dis.findlinestarts(orig_code) if line]
+
+    ed = bc.Editor(orig_code)
+    bar_index = ed.add_const(bar)
+    delta = 0
+    for off in starts:
+        delta += ed.insert_function_call(off+delta, bar_index, ())
+    one_at_a_time = ed.finish()
+
+    ed = bc.Editor(orig_code)
+    bar_index = ed.add_const(bar)
+    assert delta == ed.insert_function_calls([(off, bar_index, ()) for off in starts])
+    batched = ed.finish()
+
+    assert one_at_a_time.co_code == batched.co_code
+    assert list(dis.findlinestarts(one_at_a_time)) == list(dis.findlinestarts(batched))
+    if PYTHON_VERSION >= (3,11):
+        assert one_at_a_time.co_exceptiontable == batched.co_exceptiontable
+
+    # and of course it should still work...
+    assert types.FunctionType(orig_code, globals())(0) == types.FunctionType(batched, globals())(0)
+
+
+def test_branch_arcs():
+    def foo(n):
+        x = 0
+        for i in range(n):
+            if i % 2:
+                x += 1
+        return x
+
+    base = foo.__code__.co_firstlineno
+    arcs = bc.branch_arcs(foo.__code__)
+
+    assert {(2, 3), (2, 5), (3, 4), (3, 2)} == {(a-base, b-base) for *_, (a, b) in arcs}
+    assert all(taken in (False, True) for _, taken, _, _ in arcs)
+    assert [a[:2] for a in arcs] == sorted(a[:2] for a in arcs)
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: uses sys.monitoring")
+def test_insert_branch_calls():
+    def foo(n):
+        x = 0
+        for i in range(n):
+            if i % 2:
+                x += 1
+            else:
+                x -= 1
+        while x > 0:
+            x -= 1
+        return x
+
+    seen = []
+    def mark(arc):
+        seen.append(arc)
+
+    orig_code = foo.__code__
+    arcs = bc.branch_arcs(orig_code)
+
+    ed = bc.Editor(orig_code)
+    mark_index = ed.add_const(mark)
+    ed.insert_branch_calls([(offset, taken, mark_index, (ed.add_const(arc),))
+                            for offset, taken, _, arc in arcs])
+    foo.__code__ = ed.finish()
+
+    base = orig_code.co_firstlineno
+    assert 0 == foo(4)
+    assert {(2, 3), (2, 7), (3, 4), (3, 6), (7, 9)} == {(a-base, b-base) for a, b in seen}
+
+    # the inserted calls are found, but don't show up as line starts
+    assert len(arcs) == len(ed.get_inserted_functions())
+    assert {line for _, line in dis.findlinestarts(orig_code)} == \
+           {line for _, line in dis.findlinestarts(foo.__code__)}
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: uses sys.monitoring")
+def test_insert_branch_calls_line_reentries():
+    def foo(n):
+        x = 0
+        for i in range(n):
+            x += 1
+        return x
+
+    seen = []
+    def mark(line):
+        seen.append(line)
+
+    orig_code = foo.__code__
+    reentries = bc.line_reentries(orig_code)
+
+    base = orig_code.co_firstlineno
+    assert [2] == [line-base for _, line in reentries]
+
+    ed = bc.Editor(orig_code)
+    mark_index = ed.add_const(mark)
+    ed.insert_branch_calls([(offset, True, mark_index, (ed.add_const(line),))
+                            for offset, line in reentries])
+    foo.__code__ = ed.finish()
+
+    assert 3 == foo(3)
+    assert [2, 2, 2] == [line-base for line in seen]
+
+    with pytest.raises(ValueError):
+        # a jump is always taken
+        ed = bc.Editor(orig_code)
+        ed.insert_branch_calls([(reentries[0][0], False, ed.add_const(mark), ())])
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: uses sys.monitoring")
+def test_insert_branch_calls_out_of_order():
+    def foo(x):
+        if x:
+            x += 1
+        if x > 2:
+            return 1
+        return 2
+
+    arcs = bc.branch_arcs(foo.__code__)
+    ed = bc.Editor(foo.__code__)
+    f = ed.add_const(print)
+
+    with pytest.raises(ValueError):
+        ed.insert_branch_calls([(offset, taken, f, ()) for offset, taken, _, _ in reversed(arcs)])
+
+    with pytest.raises(ValueError):
+        ed.insert_branch_calls([(0, True, f, ())])
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: uses sys.monitoring")
+def test_insert_creation_calls():
+    src = "def make(n):\n" + \
+          "    fs = [lambda: i for i in range(n)]\n" + \
+          "    def g(x=None if n else 1):\n" + \
+          "        return x\n" + \
+          "    class C:\n" + \
+          "        def m(self): return n\n" + \
+          "    return fs, g, C.m, (lambda: 0) if n else None\n"
+
+    created = []
+
+    module = compile(src, "foo", "exec")
+    make_code = next(c for c in module.co_consts if isinstance(c, types.CodeType))
+
+    ed = bc.Editor(make_code)
+    assert 4 == ed.insert_creation_calls(ed.add_const(created.append))
+    make = types.FunctionType(ed.finish(), globals())
+
+    fs, g, m, h = make(2)
+    assert [1, 1] == [f() for f in fs]
+    assert g() is None
+    assert 2 == m(None)
+
+    # C.m is created by C's body, which wasn't edited
+    assert ['<listcomp>', 'g', 'C', '<lambda>'] == [f.__name__ for f in created]
+    assert g is created[1] and h is created[3]
+
+
+@pytest.mark.skipif(PYTHON_VERSION != (3,11), reason="N/A: needs 3.11's adaptive code copy")
+def test_finish_in_place():
+    calls = []
+
+    def gen(n):
+        for i in range(n):
+            yield i
+
+    starts = [off for off, line in dis.findlinestarts(gen.__code__)]
+    ed = bc.Editor(gen.__code__)
+    probe = ed.add_const(calls.append)
+    ed.insert_function_calls([(off, probe, (ed.add_const(line),))
+                              for off, line in dis.findlinestarts(gen.__code__)])
+    gen.__code__ = ed.finish()
+
+    # warm it up, so that on 3.11 it's been specialized
+    for _ in range(100):
+        assert [0, 1] == list(gen(2))
+
+    g = gen(100)
+    next(g)
+    calls.clear()
+
+    ed = bc.Editor(gen.__code__)
+    for offset, _ in ed.get_inserted_functions():
+        ed.disable_inserted_function(offset)
+    code = gen.__code__
+    assert code is ed.finish_in_place()
+    assert code is gen.__code__
+    assert [] == bc.Editor(code).get_inserted_functions()
+
+    # even the generator already running is no longer calling the probes
+    assert [*range(1, 100)] == list(g)
+    assert [*range(5)] == list(gen(5))
+    assert [] == calls
+
+
+@pytest.mark.skipif(PYTHON_VERSION != (3,11), reason="N/A: needs 3.11's adaptive code copy")
+def test_finish_in_place_only_same_length():
+    def foo(x):
+        return x + 1
+
+    ed = bc.Editor(foo.__code__)
+    ed.insert_function_calls([(0, ed.add_const(print), ())])
+    with pytest.raises(ValueError):
+        ed.finish_in_place()
+
+    ed = bc.Editor(foo.__code__)
+    assert foo.__code__ is ed.finish_in_place()
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,11), reason="N/A: edits in place")
+def test_finish_in_place_unsupported():
+    def foo(x):
+        return x + 1
+
+    # co_code is immutable, and may be shared with other code objects
+    with pytest.raises(NotImplementedError):
+        bc.Editor(foo.__code__).finish_in_place()
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: uses sys.monitoring")
+def test_insert_entry_call():
+    calls = []
+
+    def make(z):
+        def foo(a, /, b, *args, c, **kw):
+            a += 1  # keeps a local, not a cell
+            def g():
+                return b + z
+            return a, g(), args, c, kw
+        return foo
+
+    foo = make(10)
+
+    def entry(closure, params):
+        calls.append((closure, params))
+        return 'entered'
+
+    ed = bc.Editor(foo.__code__)
+    ed.insert_entry_call(ed.add_const(entry))
+    foo.__code__ = ed.finish()
+
+    assert 'entered' == foo(1, 2, 3, c=4, d=5)
+    assert 1 == len(calls)
+    closure, params = calls[0]
+    assert 1 == len(closure) and 10 == closure[0].cell_contents
+    # in co_varnames order: positional, keyword-only, then *args and **kwargs
+    assert (1, 2, 4, (3,), {'d': 5}) == params
@@ -40,7 +40,7 @@ def test_tracker_signal(stats):
     # line never executed
     t_666 = tracker.register(sci, "/foo/beast.py", 666, -1)
 
-    d = sci.new_lines_seen
+    d = tracker.get_new_lines(sci.line_map)
     assert ["/foo/bar.py", "/foo2/baz.py"] == sorted(d.keys())
     assert [123] == sorted(list(d["/foo/bar.py"]))
     assert [42, 314] == sorted(list(d["/foo2/baz.py"]))
@@ -50,6 +50,9 @@ def test_tracker_signal(stats):
 
     assert ("/foo/beast.py", 666, 0, 0, 0) == tracker.get_stats(t_666)
 
+    # lines are only reported as new once
+    assert {} == tracker.get_new_lines(sci.line_map)
+
 
 @pytest.mark.parametrize("stats", [False, True])
 def test_tracker_deinstrument(stats):
@@ -60,7 +63,7 @@ def test_tracker_deinstrument(stats):
     t = tracker.register(sci, "/foo/bar.py", 123, 3)
     tracker.signal(t)
 
-    assert ["/foo/bar.py"] == sorted(sci.new_lines_seen.keys())
+    assert {"/foo/bar.py": {123}} == tracker.get_new_lines(sci.line_map)
 
     tracker.signal(t)
     tracker.signal(t)
@@ -71,12 +74,304 @@ def test_tracker_deinstrument(stats):
 
     tracker.hit(t)
 
-    assert [] == sorted(sci.new_lines_seen.keys())
-    assert ["/foo/bar.py"] == sorted(sci.lines_seen.keys())
+    assert {} == tracker.get_new_lines(sci.line_map)
 
     assert ("/foo/bar.py", 123, 3, 1, 6) == tracker.get_stats(t)
 
 
+def test_tracker_adaptive_threshold_rate_limits_passes():
+    from slipcover import tracker
+
+    sci = sc.Slipcover(adaptive_threshold=True)
+    passes = []
+    sci.threshold_reached = lambda: passes.append(1)
+
+    t = tracker.register(sci, "/foo/bar.py", 1, 10)
+    for _ in range(11):
+        tracker.signal(t)
+    assert 1 == len(passes)
+
+    # while that pass is pending, further D misses don't request more
+    for _ in range(10):
+        tracker.signal(t)
+    assert 1 == len(passes)
+
+    # a (really) long pass defers the next
+    tracker.deinstrument_pass_done(sci.line_map, 100.0)
+    t = tracker.register(sci, "/foo/bar.py", 2, 10)
+    for _ in range(1000):
+        tracker.signal(t)
+    assert 1 == len(passes)
+
+
+def test_tracker_adaptive_threshold_pending_misses():
+    from slipcover import tracker
+
+    sci = sc.Slipcover(adaptive_threshold=True)
+    passes = []
+    sci.threshold_reached = lambda: passes.append(1)
+
+    # quick passes make it worth de-instrumenting after just a few D misses, in any lines
+    tracker.deinstrument_pass_done(sci.line_map, 1e-9)
+    trackers = tracker.register_many(sci, "/foo/bar.py", [*range(1, 1001)], 1000)
+    for t in trackers:
+        tracker.signal(t)   # seen
+        tracker.signal(t)   # D miss
+
+    assert 1 <= len(passes) <= 10
+
+
+def test_tracker_register_many():
+    from slipcover import tracker
+
+    sci = sc.Slipcover()
+
+    trackers = tracker.register_many(sci, "/foo/bar.py", [1, 2, 3], -1)
+    assert 3 == len(trackers)
+
+    # the slab must outlive the trackers still referenced
+    t_2 = trackers[1]
+    del trackers
+
+    tracker.signal(t_2)
+    tracker.signal(t_2)
+    assert ("/foo/bar.py", 2, 1, 0, 2) == tracker.get_stats(t_2)
+    assert {"/foo/bar.py": {2}} == tracker.get_new_lines(sci.line_map)
+
+    assert [] == tracker.register_many(sci, "/foo/bar.py", [], -1)
+
+
+def test_tracker_callable():
+    from slipcover import tracker
+
+    sci = sc.Slipcover()
+
+    t = tracker.register(sci, "/foo/bar.py", 123, -1)
+    assert isinstance(t, tracker.Tracker)
+
+    t()
+    t()
+    assert ("/foo/bar.py", 123, 1, 0, 2) == tracker.get_stats(t)
+    assert {"/foo/bar.py": {123}} == tracker.get_new_lines(sci.line_map)
+
+    with pytest.raises(TypeError):
+        t(42)
+
+    with pytest.raises(TypeError):
+        tracker.signal(42)
+
+
+def test_tracker_register_code():
+    from slipcover import tracker
+
+    sci = sc.Slipcover()
+
+    slab = tracker.register_code(sci, "/foo/bar.py", [10, 20, 30], -1)
+    tracker.signal(slab, 1)
+    tracker.signal(slab, 1)
+    tracker.signal(slab, 2)
+
+    assert ("/foo/bar.py", 20, 1, 0, 2) == tracker.get_stats(slab, 1)
+    assert ("/foo/bar.py", 10, 0, 0, 0) == tracker.get_stats(slab, 0)
+    assert {"/foo/bar.py": {20, 30}} == tracker.get_new_lines(sci.line_map)
+
+    with pytest.raises(IndexError):
+        tracker.signal(slab, 3)
+
+
+def test_tracker_threads():
+    from slipcover import tracker
+    import threading
+
+    sci = sc.Slipcover()
+    trackers = tracker.register_many(sci, "/foo/bar.py", range(1, 9), -1)
+
+    def run(n):
+        for _ in range(1000):
+            tracker.signal(trackers[0])
+            tracker.signal(trackers[n])
+
+    threads = [threading.Thread(target=run, args=(n,)) for n in range(1, 8)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    assert {"/foo/bar.py": set(range(1, 9))} == tracker.get_new_lines(sci.line_map)
+    assert ("/foo/bar.py", 1, 7*1000-1, 0, 7*1000) == tracker.get_stats(trackers[0])
+    for n in range(1, 8):
+        assert ("/foo/bar.py", n+1, 1000-1, 0, 1000) == tracker.get_stats(trackers[n])
+
+@pytest.mark.skipif(PYTHON_VERSION < (3,12), reason="N/A: needs sys.monitoring")
+@pytest.mark.parametrize("stats", [False, True])
+def test_tracker_line_handler(stats):
+    from slipcover import tracker
+
+    sci = sc.Slipcover(collect_stats=stats)
+
+    code = test_tracker_line_handler.__code__
+    tracker.set_code_owner(code, sci.line_map, None)
+    handler = tracker.new_line_handler()
+
+    # code objects no instance owns are just disabled
+    assert sys.monitoring.DISABLE is handler(test_tracker_signal.__code__, 42)
+
+    for _ in range(3):
+        result = handler(code, 42)
+        assert (None if stats else sys.monitoring.DISABLE) is result
+
+    assert {code.co_filename: {42}} == tracker.get_new_lines(sci.line_map)
+    assert ({code.co_filename: {42: 3}} if stats else {}) == tracker.get_hit_counts(sci.line_map)
+
+    # lines already seen aren't noted again, even if the handler keeps counting them;
+    # far-off lines grow the bitmap
+    handler(code, 42)
+    handler(code, 100_000)
+    assert {code.co_filename: {100_000}} == tracker.get_new_lines(sci.line_map)
+
+
+@pytest.mark.skipif(PYTHON_VERSION < (3,12), reason="N/A: needs sys.monitoring")
+@pytest.mark.skipif(not sys.platform.startswith('linux'), reason="N/A: reads /proc")
+def test_tracker_line_handler_counting_memory():
+    import os
+    from slipcover import tracker
+
+    def rss():
+        with open("/proc/self/statm") as f:
+            return int(f.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+
+    sci = sc.Slipcover(count_lines=True)
+    code = test_tracker_line_handler_counting_memory.__code__
+    tracker.set_code_owner(code, sci.line_map, None)
+    handler = tracker.new_line_handler()
+
+    before = rss()
+    for _ in range(1_000_000):
+        handler(code, 42)
+
+    # noting each hit as seen took ~45MB
+    assert rss() - before < 8*1024*1024
+    assert {code.co_filename: {42: 1_000_000}} == tracker.get_hit_counts(sci.line_map)
+
+
+@pytest.mark.skipif(PYTHON_VERSION < (3,12), reason="N/A: needs sys.monitoring")
+def test_monitoring_multiple_instances():
+    def foo(n):
+        x = 0
+        for i in range(n):
+            x += i
+        return x
+
+    a = sc.Slipcover()
+    foo.__code__ = a.instrument(foo.__code__)
+
+    # another instance doesn't take over the events of code it didn't instrument
+    b = sc.Slipcover()
+    foo(3)
+
+    base_line = foo.__code__.co_firstlineno
+    assert [base_line+1, base_line+2, base_line+3, base_line+4] == \
+           a.get_coverage()['files'][simple_current_file()]['executed_lines']
+    assert {} == b.get_coverage()['files']
+
+    # it does if it instruments it itself, even if the other disabled its lines
+    foo.__code__ = b.instrument(foo.__code__)
+    foo(3)
+    assert [base_line+1, base_line+2, base_line+3, base_line+4] == \
+           b.get_coverage()['files'][simple_current_file()]['executed_lines']
+
+
+@pytest.mark.skipif(PYTHON_VERSION < (3,12), reason="N/A: needs sys.monitoring")
+def test_monitoring_tool_in_use():
+    mon = sys.monitoring
+    mon.free_tool_id(mon.COVERAGE_ID)
+    mon.use_tool_id(mon.COVERAGE_ID, "other")
+    try:
+        with pytest.raises(RuntimeError, match="already in use by 'other'"):
+            sc.Slipcover()
+    finally:
+        mon.free_tool_id(mon.COVERAGE_ID)
+
+
+@pytest.mark.parametrize("count_every", [1, 10])
+def test_tracker_count_lines(count_every):
+    from slipcover import tracker
+
+    sci = sc.Slipcover(count_lines=True, count_every=count_every)
+    t_1, t_2 = tracker.register_many(sci, "/foo/bar.py", [1, 2], sci.d_threshold)
+
+    for _ in range(100):
+        tracker.signal(t_1)
+        tracker.signal(t_1)
+        tracker.signal(t_2)
+
+    # sampled counts are approximate, but the total is exact if a multiple of the interval
+    counts = tracker.get_hit_counts(sci.line_map)["/foo/bar.py"]
+    assert 300 == sum(counts.values())
+    if count_every == 1:
+        assert {1: 200, 2: 100} == counts
+
+    assert {"/foo/bar.py": {1, 2}} == tracker.get_new_lines(sci.line_map)
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: uses sys.monitoring")
+def test_tracker_register_arcs():
+    from slipcover import tracker
+
+    sci = sc.Slipcover(branch=True)
+    t_1, t_2 = tracker.register_arcs(sci, "/foo/bar.py", [(1, 2), (1, 5)], sci.d_threshold)
+    tracker.add_code_arcs(sci.line_map, "/foo/bar.py", [(1, 2), (1, 5)])
+
+    assert (1, 2) == tracker.get_arc(t_1)
+    assert (1, 5) == tracker.get_arc(t_2)
+    assert None == tracker.get_arc(tracker.register(sci, "/foo/bar.py", 1, sci.d_threshold))
+
+    tracker.signal(t_2)
+
+    # arcs aren't lines
+    assert {} == tracker.get_new_lines(sci.line_map)
+    assert {"/foo/bar.py": {(1, 5)}} == tracker.get_new_arcs(sci.line_map)
+    assert {} == tracker.get_new_arcs(sci.line_map)
+    assert {"/foo/bar.py": ([(1, 5)], [(1, 2)])} == tracker.get_arc_coverage(sci.line_map)
+
+
+def test_tracker_line_map_checked():
+    from slipcover import tracker
+    import datetime
+
+    # other capsules aren't taken for a line map
+    for capsule in (datetime.datetime_CAPI, tracker.register_code(sc.Slipcover(), "/foo/bar.py", [1], -1)):
+        with pytest.raises(ValueError):
+            tracker.get_coverage(capsule)
+        with pytest.raises(ValueError):
+            tracker.add_code_lines(capsule, "/foo/bar.py", [1])
+
+
+def test_tracker_get_coverage():
+    from slipcover import tracker
+
+    sci = sc.Slipcover()
+
+    tracker.add_code_lines(sci.line_map, "/foo/bar.py", [1, 2, 3, 64, 65, 200])
+    tracker.add_code_lines(sci.line_map, "/foo/bar.py", [4])
+    tracker.add_code_lines(sci.line_map, "/foo/baz.py", [10])
+
+    for line in [2, 64, 200]:
+        tracker.signal(tracker.register(sci, "/foo/bar.py", line, -1))
+
+    # a file without code lines isn't reported
+    tracker.signal(tracker.register(sci, "/foo/other.py", 1, -1))
+
+    cov = tracker.get_coverage(sci.line_map)
+    assert {"/foo/bar.py", "/foo/baz.py"} == cov.keys()
+    assert ([2, 64, 200], [1, 3, 4, 65]) == cov["/foo/bar.py"]
+    assert ([], [10]) == cov["/foo/baz.py"]
+
+    assert {"/foo/bar.py": (3, 4, 0, 0), "/foo/baz.py": (0, 1, 0, 0)} == \
+           tracker.get_coverage_sizes(sci.line_map)
+
+    # getting coverage doesn't prevent de-instrumentation
+    assert {"/foo/bar.py": {2, 64, 200}, "/foo/other.py": {1}} == tracker.get_new_lines(sci.line_map)
 
 
 def test_pathsimplifier_not_relative():
@@ -243,12 +538,13 @@ def test_instrument(stats):
     dis.dis(foo)
     sci.instrument(foo)
 
-    assert foo.__code__.co_stacksize >= bc.calc_max_stack(foo.__code__.co_code)
-    assert '__slipcover__' in foo.__code__.co_consts
+    if PYTHON_VERSION < (3,12):
+        assert foo.__code__.co_stacksize >= bc.calc_max_stack(foo.__code__.co_code)
+        assert '__slipcover__' in foo.__code__.co_consts
 
-    # Are all lines where we expect?
-    for (offset, _) in dis.findlinestarts(foo.__code__):
-        assert bc.op_NOP == foo.__code__.co_code[offset]
+        # Are all lines where we expect?
+        for (offset, _) in dis.findlinestarts(foo.__code__):
+            assert bc.op_NOP == foo.__code__.co_code[offset]
 
     dis.dis(foo)
     assert 6 == foo(3)
@@ -257,13 +553,153 @@ def test_instrument(stats):
     assert {simple_current_file()} == cov['files'].keys()
 
     cov = cov['files'][simple_current_file()]
-    if PYTHON_VERSION >= (3,11):
+    if PYTHON_VERSION == (3,11):
         assert [1, 2, 4, 5, 6, 7] == [l-base_line for l in cov['executed_lines']]
     else:
         assert [2, 4, 5, 6, 7] == [l-base_line for l in cov['executed_lines']]
     assert [3] == [l-base_line for l in cov['missing_lines']]
 
 
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: no probes with sys.monitoring")
+def test_instrument_tracker_per_code():
+    sci = sc.Slipcover(tracker_per_code=True)
+
+    base_line = current_line()
+    def foo(n):
+        x = 0
+        for i in range(n):
+            x += (i+1)
+        return x
+
+    orig_consts = len(foo.__code__.co_consts)
+    sci.instrument(foo)
+
+    # a single tracker, rather than one per line; the line indices reuse the ints present
+    new_consts = foo.__code__.co_consts[orig_consts:]
+    assert 1 == sum(type(c).__name__ == 'PyCapsule' for c in new_consts)
+
+    assert 6 == foo(3)
+
+    cov = sci.get_coverage()['files'][simple_current_file()]
+    if PYTHON_VERSION == (3,11):
+        assert [1, 2, 3, 4, 5] == [l-base_line for l in cov['executed_lines']]
+    else:
+        assert [2, 3, 4, 5] == [l-base_line for l in cov['executed_lines']]
+    assert [] == cov['missing_lines']
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: no probes with sys.monitoring")
+@pytest.mark.parametrize("branch", [False, True])
+def test_instrument_cache(tmp_path, branch):
+    from slipcover import tracker
+
+    src = "def foo(n):\n" + \
+          "    if n > 0:\n" + \
+          "        n -= 1\n" + \
+          "    return [x for x in range(n)]\n" + \
+          "x = foo(2)\n"
+    code = compile(src, "foo.py", "exec")
+
+    def run(sci):
+        g = dict()
+        exec(sci.instrument(code), g)
+        assert [0] == g['x']
+        return sci.get_coverage()['files']['foo.py']
+
+    cov = run(sc.Slipcover(branch=branch, cache_dir=tmp_path))
+    assert 1 == len(list(tmp_path.iterdir()))
+
+    # the cached entry is bound to the new instance's trackers, without instrumenting again
+    sci = sc.Slipcover(branch=branch, cache_dir=tmp_path)
+    def no_lay_out(co):
+        assert False, "cache not used"
+    sci._lay_out = no_lay_out
+
+    assert cov == run(sci)
+    assert 1 == len(list(tmp_path.iterdir()))
+
+    # options that change the instrumentation make for separate entries
+    run(sc.Slipcover(branch=branch, tracker_per_code=True, cache_dir=tmp_path))
+    assert 2 == len(list(tmp_path.iterdir()))
+
+    # an unusable entry is replaced
+    for entry in tmp_path.iterdir():
+        entry.write_bytes(b'garbage')
+
+    assert cov == run(sc.Slipcover(branch=branch, cache_dir=tmp_path))
+    assert 1 == sum(entry.read_bytes() != b'garbage' for entry in tmp_path.iterdir())
+
+    # entries depend on all of slipcover's modules, such as bytecode's branch_arcs
+    salt = sc.InstrumentationCache(tmp_path, ()).salt
+    assert b"bytecode.py" in salt and b"slipcover.py" in salt
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: no probes with sys.monitoring")
+@pytest.mark.parametrize("branch", [False, True])
+def test_instrument_tiered(branch):
+    src = "def foo(n, *, k=0):\n" + \
+          "    if n > 0:\n" + \
+          "        n -= 1\n" + \
+          "    return [x + k for x in range(n)]\n" + \
+          "def bar():\n" + \
+          "    return 1\n" + \
+          "x = foo(2, k=1)\n"
+    code = compile(src, "foo.py", "exec")
+
+    sci = sc.Slipcover(branch=branch, tiered=True)
+    g = dict()
+    exec(sci.instrument(code), g)
+    assert [1] == g['x']
+
+    # foo now runs its fully instrumented code; bar still has just its entry probe
+    assert '__slipcover__' in g['foo'].__code__.co_consts
+    assert not any(isinstance(c, sc.TieredCode) for c in g['foo'].__code__.co_consts)
+    assert any(isinstance(c, sc.TieredCode) for c in g['bar'].__code__.co_consts)
+
+    cov = sci.get_coverage()['files']['foo.py']
+    assert [1, 2, 3, 4, 5, 7] == cov['executed_lines']
+    assert [6] == cov['missing_lines']
+
+    # the same coverage as instrumenting it all up front
+    sci_full = sc.Slipcover(branch=branch)
+    g = dict()
+    exec(sci_full.instrument(code), g)
+    cov_full = sci_full.get_coverage()['files']['foo.py']
+    assert cov_full == cov
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: no probes with sys.monitoring")
+def test_instrument_tiered_unindexed_function():
+    import gc
+
+    src = "def foo(n):\n" + \
+          "    return n + 1\n"
+    code = compile(src, "foo.py", "exec")
+
+    sci = sc.Slipcover(tiered=True)
+    g = dict()
+    exec(sci.instrument(code), g)
+
+    # made from the entry code without going through the index, so it keeps calling it
+    foo = types.FunctionType(g['foo'].__code__, g)
+    tiered = next(c for c in foo.__code__.co_consts if isinstance(c, sc.TieredCode))
+
+    def running_full_code():
+        # other than g['foo'], which was pointed to it
+        return [o for o in gc.get_objects() if type(o) is types.FunctionType and
+                o.__code__ is tiered.code and o is not g['foo']]
+
+    assert 2 == foo(1)
+    assert foo.__code__ is not tiered.code
+    running = running_full_code()
+    assert 1 == len(running)
+
+    # the function built to run the full code is reused, rather than built on every call
+    for i in range(10):
+        assert i + 1 == foo(i)
+        assert running == running_full_code()
+
+
 @pytest.mark.parametrize("stats", [False, True])
 def test_instrument_generators(stats):
     sci = sc.Slipcover(collect_stats=stats)
@@ -283,12 +719,13 @@ def test_instrument_generators(stats):
 #    dis.dis(foo)
     sci.instrument(foo)
 
-    assert foo.__code__.co_stacksize >= bc.calc_max_stack(foo.__code__.co_code)
-    assert '__slipcover__' in foo.__code__.co_consts
+    if PYTHON_VERSION < (3,12):
+        assert foo.__code__.co_stacksize >= bc.calc_max_stack(foo.__code__.co_code)
+        assert '__slipcover__' in foo.__code__.co_consts
 
-    # Are all lines where we expect?
-    for (offset, _) in dis.findlinestarts(foo.__code__):
-        assert bc.op_NOP == foo.__code__.co_code[offset]
+        # Are all lines where we expect?
+        for (offset, _) in dis.findlinestarts(foo.__code__):
+            assert bc.op_NOP == foo.__code__.co_code[offset]
 
 #    dis.dis(foo)
     assert X == foo(123)
@@ -297,7 +734,7 @@ def test_instrument_generators(stats):
     assert {simple_current_file()} == cov['files'].keys()
 
     cov = cov['files'][simple_current_file()]
-    if PYTHON_VERSION >= (3,11):
+    if PYTHON_VERSION == (3,11):
         assert [1, 2, 3, 4, 5, 6, 7, 8] == [l-base_line for l in cov['executed_lines']]
     else:
         assert [2, 3, 4, 5, 6, 7, 8] == [l-base_line for l in cov['executed_lines']]
@@ -329,12 +766,13 @@ def test_instrument_exception(stats):
     sci.instrument(foo)
     dis.dis(orig_code)
 
-    assert foo.__code__.co_stacksize >= orig_code.co_stacksize
-    assert '__slipcover__' in foo.__code__.co_consts
+    if PYTHON_VERSION < (3,12):
+        assert foo.__code__.co_stacksize >= orig_code.co_stacksize
+        assert '__slipcover__' in foo.__code__.co_consts
 
-    # Are all lines where we expect?
-    for (offset, _) in dis.findlinestarts(foo.__code__):
-        assert bc.op_NOP == foo.__code__.co_code[offset]
+        # Are all lines where we expect?
+        for (offset, _) in dis.findlinestarts(foo.__code__):
+            assert bc.op_NOP == foo.__code__.co_code[offset]
 
     dis.dis(foo)
     assert X == foo(42)
@@ -343,7 +781,7 @@ def test_instrument_exception(stats):
     assert {simple_current_file()} == cov['files'].keys()
 
     cov = cov['files'][simple_current_file()]
-    if PYTHON_VERSION >= (3,11):
+    if PYTHON_VERSION == (3,11):
         assert [1, 2, 3, 4, 5, 7, 8, 10, 12] == [l-base_line for l in cov['executed_lines']]
     else:
         assert [2, 3, 4, 5, 7, 8, 10, 12] == [l-base_line for l in cov['executed_lines']]
@@ -416,7 +854,7 @@ def test_instrument_threads():
     assert {simple_current_file()} == cov['files'].keys()
 
     cov = cov['files'][simple_current_file()]
-    if PYTHON_VERSION >= (3,11):
+    if PYTHON_VERSION == (3,11):
         assert [1, 3, 4, 5, 6] == [l-base_line for l in cov['executed_lines']]
     else:
         assert [3, 4, 5, 6] == [l-base_line for l in cov['executed_lines']]
@@ -496,13 +934,85 @@ def test_get_coverage_detects_lines():
     assert {simple_current_file()} == cov['files'].keys()
 
     cov = cov['files'][simple_current_file()]
-    if PYTHON_VERSION >= (3,11):
+    if PYTHON_VERSION == (3,11):
         assert [1, 6, 8, 9, 12, 13, 15] == [l-base_line for l in cov['missing_lines']]
     else:
         assert [6, 8, 9, 12, 13, 15] == [l-base_line for l in cov['missing_lines']]
     assert [] == cov['executed_lines']
 
 
+@pytest.mark.parametrize("branch", [False, True])
+def test_get_coverage_execution_counts(branch):
+    sci = sc.Slipcover(count_lines=True, branch=branch)
+
+    base_line = current_line()
+    def foo(n):
+        x = 0
+        for i in range(n):
+            x += (i+1)
+        return x
+
+    sci.instrument(foo)
+    for _ in range(150):    # well past the de-instrumentation threshold
+        foo(3)
+
+    cov = sci.get_coverage()['files'][simple_current_file()]
+    counts = {l-base_line: c for l, c in cov['execution_counts'].items()}
+    if PYTHON_VERSION == (3,11):
+        counts.pop(1)   # the 'def' line, from RESUME
+
+    # the loop jumps back into the middle of the 'for' line, counting it again
+    assert {2: 150, 3: 600, 4: 450, 5: 150} == counts
+
+
+@pytest.mark.parametrize("stats", [False, True])
+def test_get_coverage_branches(stats):
+    from slipcover import tracker
+
+    sci = sc.Slipcover(branch=True, collect_stats=stats)
+
+    base_line = current_line()
+    def foo(n):
+        x = 0
+        for i in range(n):
+            if i % 2:
+                x += 1
+        while x > 0:
+            x -= 1
+        return x
+
+    sci.instrument(foo)
+    for _ in range(150):    # well past the de-instrumentation threshold
+        foo(3)
+
+    cov = sci.get_coverage()['files'][simple_current_file()]
+    assert [[3, 4], [3, 6], [4, 3], [4, 5], [6, 7], [6, 8]] == \
+           sorted([a-base_line, b-base_line] for a, b in cov['executed_branches'])
+    assert [] == cov['missing_branches']
+
+    if PYTHON_VERSION < (3,12):
+        # executed arcs' probes were removed, but still being counted if collecting stats
+        assert 0 == sum(1 for _, func in bc.Editor(foo.__code__).get_inserted_functions()
+                        if foo.__code__.co_consts[func[0]] == tracker.signal)
+
+
+def test_get_coverage_missing_branches():
+    sci = sc.Slipcover(branch=True)
+
+    base_line = current_line()
+    def foo(x):
+        if x:
+            return 1
+        return 2
+
+    sci.instrument(foo)
+    foo(True)
+
+    cov = sci.get_coverage()['files'][simple_current_file()]
+    assert [[2, 3]] == [[a-base_line, b-base_line] for a, b in cov['executed_branches']]
+    assert [[2, 4]] == [[a-base_line, b-base_line] for a, b in cov['missing_branches']]
+
+
 def gen_long_jump_code(N):
     return "x = 0\n" + \
            "for _ in range(1):\n" + \
@@ -519,6 +1029,7 @@ def gen_test_sequence():
     return [(64*1024*arg)//b.arg() for arg in [0xFF, 0xFFFF]]#, 0xFFFFFF]]
 
 
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: no probes with sys.monitoring")
 @pytest.mark.skipif(sys.version.split()[0] == '3.11.0b4', reason='brittle test')
 @pytest.mark.parametrize("N", gen_test_sequence())
 def test_instrument_long_jump(N):
@@ -557,6 +1068,7 @@ def test_instrument_long_jump(N):
     assert any(b.length > orig_branches[i].length for i, b in enumerate(bc.Branch.from_code(code)))
 
 
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: sys.monitoring disables lines as they're seen")
 @pytest.mark.parametrize("stats", [False, True])
 def test_deinstrument(stats):
     sci = sc.Slipcover(collect_stats=stats)
@@ -581,9 +1093,11 @@ def test_deinstrument(stats):
     assert [] == sci.get_coverage()['files'][simple_current_file()]['executed_lines']
 
 
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: sys.monitoring disables lines as they're seen")
 @pytest.mark.parametrize("stats", [False, True])
-def test_deinstrument_with_many_consts(stats):
-    sci = sc.Slipcover(collect_stats=stats)
+@pytest.mark.parametrize("per_code", [False, True])
+def test_deinstrument_with_many_consts(stats, per_code):
+    sci = sc.Slipcover(collect_stats=stats, tracker_per_code=per_code)
 
     N = 1024
     src = 'x=0\n' + ''.join([f'x = {i}\n' for i in range(1, N)])
@@ -607,9 +1121,11 @@ def test_deinstrument_with_many_consts(stats):
     assert [*range(1,N)] == cov['missing_lines']
 
 
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: sys.monitoring disables lines as they're seen")
 @pytest.mark.parametrize("stats", [False, True])
-def test_deinstrument_some(stats):
-    sci = sc.Slipcover(collect_stats=stats)
+@pytest.mark.parametrize("per_code", [False, True])
+def test_deinstrument_some(stats, per_code):
+    sci = sc.Slipcover(collect_stats=stats, tracker_per_code=per_code)
 
     base_line = current_line()
     def foo(n):
@@ -625,13 +1141,14 @@ def test_deinstrument_some(stats):
 
     assert 6 == foo(3)
     cov = sci.get_coverage()['files'][simple_current_file()]
-    if PYTHON_VERSION >= (3,11):
+    if PYTHON_VERSION == (3,11):
         assert [1, 2, 5] == [l-base_line for l in cov['executed_lines']]
     else:
         assert [2, 5] == [l-base_line for l in cov['executed_lines']]
     assert [3, 4] == [l-base_line for l in cov['missing_lines']]
 
 
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: sys.monitoring disables lines as they're seen")
 def test_deinstrument_seen_d_threshold():
     sci = sc.Slipcover()
 
@@ -650,18 +1167,213 @@ def test_deinstrument_seen_d_threshold():
 
     foo(0)
 
-    assert old_code != foo.__code__, "Code never de-instrumented"
+    assert old_code is not foo.__code__, "Code never de-instrumented"
 
     foo(1)
 
     cov = sci.get_coverage()['files'][simple_current_file()]
+    if PYTHON_VERSION == (3,11):
+        assert [*range(first_line, last_line)] == cov['executed_lines']
+    else:
+        assert [*range(first_line+1, last_line)] == cov['executed_lines']
+    assert [] == cov['missing_lines']
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: sys.monitoring disables lines as they're seen")
+def test_deinstrument_seen_finds_functions():
+    sci = sc.Slipcover()
+
+    src = "class C:\n" + \
+          "    def m(self, x):\n" + \
+          "        return x + 1\n" + \
+          "def make():\n" + \
+          "    def inner(x):\n" + \
+          "        return x * 2\n" + \
+          "    return inner\n" + \
+          "objs = [C().m, make(), (lambda x: x - 1)]\n"
+
+    g = dict()
+    exec(sci.instrument(compile(src, "foo.py", "exec")), g)
+
+    # only reachable through a list: a bound method, a closure and a lambda
+    objs = g.pop('objs')
+    for _ in range(sci.d_threshold+10):
+        for o in objs:
+            o(1)
+
+    for o in objs:
+        f = getattr(o, '__func__', o)
+        assert [] == bc.Editor(f.__code__).get_inserted_functions(), f"{f.__name__} not de-instrumented"
+
+
+@pytest.mark.skipif(PYTHON_VERSION != (3,11), reason="N/A: edits in place only on 3.11")
+@pytest.mark.parametrize("stats", [False, True])
+def test_deinstrument_seen_in_place(stats):
+    from slipcover import tracker
+
+    sci = sc.Slipcover(in_place=True, collect_stats=stats)
+
+    base_line = current_line()
+    def foo(n):
+        x = 0
+        for i in range(n):
+            x += i
+            yield x
+
+    sci.instrument(foo)
+    code = foo.__code__
+
+    g = foo(1000)
+    next(g)
+    for _ in range(sci.d_threshold+1):
+        next(g)
+
+    assert code is foo.__code__
+    # if collecting stats, probes call tracker.hit instead
+    assert [] == [func for _, func in bc.Editor(code).get_inserted_functions()
+                  if code.co_consts[func[0]] is tracker.signal or
+                     isinstance(code.co_consts[func[0]], tracker.Tracker)]
+
+    # the suspended generator was de-instrumented along with the function
+    list(g)
+
+    cov = sci.get_coverage()['files'][simple_current_file()]
+    assert [2, 3, 4, 5] == [l-base_line for l in cov['executed_lines'] if l-base_line > 1]
+    if stats:
+        assert 0 == cov['stats']['u_misses_pct']
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,11), reason="N/A: edits in place")
+def test_deinstrument_seen_in_place_replaces_before_311():
+    sci = sc.Slipcover(in_place=True)
+
+    def foo(n):
+        x = 0
+        for i in range(n):
+            x += i
+        return x
+
+    sci.instrument(foo)
+    code = foo.__code__
+    co_code, code_hash = code.co_code, hash(code)
+
+    for _ in range(sci.d_threshold+1):
+        foo(3)
+
+    # co_code is immutable (and may be shared), so the code is replaced instead
+    assert code is not foo.__code__
+    assert [] == bc.Editor(foo.__code__).get_inserted_functions()
+    assert co_code == code.co_code and code_hash == hash(code)
+    assert [] != bc.Editor(code).get_inserted_functions()
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: sys.monitoring disables lines as they're seen")
+@pytest.mark.parametrize("stats", [False, True])
+def test_deinstrument_seen_retired_code(stats):
+    from slipcover import tracker
+
+    sci = sc.Slipcover(collect_stats=stats)
+
+    base_line = current_line()
+    def foo(n):
+        x = 0
+        for i in range(n):
+            if i < 100:
+                x += i
+            else:
+                x -= i
+            yield x
+
+    sci.instrument(foo)
+    code = foo.__code__
+
+    g = foo(1000)
+    for _ in range(sci.d_threshold+2):
+        next(g)
+
+    assert code is not foo.__code__
+
+    # the suspended generator keeps running the old code, reaching lines that
+    # hadn't been seen when it was replaced
+    list(g)
+
     if PYTHON_VERSION >= (3,11):
+        # if collecting stats, probes call tracker.hit instead
+        assert [] == [func for _, func in bc.Editor(code).get_inserted_functions()
+                      if code.co_consts[func[0]] is tracker.signal or
+                         isinstance(code.co_consts[func[0]], tracker.Tracker)]
+
+    cov = sci.get_coverage()['files'][simple_current_file()]
+    assert [2, 3, 4, 5, 7, 8] == [l-base_line for l in cov['executed_lines'] if l-base_line > 1]
+    if stats and PYTHON_VERSION >= (3,11):
+        assert 0 == cov['stats']['u_misses_pct']
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: sys.monitoring disables lines as they're seen")
+def test_deinstrument_seen_async():
+    import threading
+    sci = sc.Slipcover(async_deinstrument=True)
+
+    first_line = current_line()+1
+    def foo(n):
+        x = 0;
+        for _ in range(100):
+            x += n
+        return x
+    last_line = current_line()
+
+    sci.instrument(foo)
+    old_code = foo.__code__
+
+    threads = []
+    orig_deinstrument_seen = sci.deinstrument_seen
+    def deinstrument_seen():
+        threads.append(threading.current_thread())
+        orig_deinstrument_seen()
+    sci.deinstrument_seen = deinstrument_seen
+
+    foo(0)
+    sci.deinstrument_worker.wait()
+
+    assert old_code is not foo.__code__, "Code never de-instrumented"
+    assert threads and threading.current_thread() not in threads
+
+    foo(1)
+
+    cov = sci.get_coverage()['files'][simple_current_file()]
+    if PYTHON_VERSION == (3,11):
         assert [*range(first_line, last_line)] == cov['executed_lines']
     else:
         assert [*range(first_line+1, last_line)] == cov['executed_lines']
     assert [] == cov['missing_lines']
 
 
+def test_deinstrument_async_coalesces_requests():
+    import threading
+    sci = sc.Slipcover(async_deinstrument=True)
+
+    started = threading.Event()
+    release = threading.Event()
+    passes = []
+    def deinstrument_seen():
+        passes.append(1)
+        started.set()
+        release.wait()
+    sci.deinstrument_seen = deinstrument_seen
+
+    sci.threshold_reached()
+    started.wait()
+
+    # requests made during a pass lead to just one more
+    for _ in range(10):
+        sci.threshold_reached()
+
+    release.set()
+    sci.deinstrument_worker.wait()
+    assert 2 == len(passes)
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: sys.monitoring disables lines as they're seen")
 def test_deinstrument_seen_d_threshold_doesnt_count_while_deinstrumenting():
     sci = sc.Slipcover()
 
@@ -684,18 +1396,19 @@ def test_deinstrument_seen_d_threshold_doesnt_count_while_deinstrumenting():
 
     foo(0)
 
-    assert old_code != foo.__code__, "Code never de-instrumented"
+    assert old_code is not foo.__code__, "Code never de-instrumented"
 
     foo(1)
 
     cov = sci.get_coverage()['files'][simple_current_file()]
-    if PYTHON_VERSION >= (3,11):
+    if PYTHON_VERSION == (3,11):
         assert [1, 2, 3, 5, 6, 7, 8, 9, 10] == [l-base_line for l in cov['executed_lines']]
     else:
         assert [2, 3, 5, 6, 7, 8, 9, 10] == [l-base_line for l in cov['executed_lines']]
     assert [4] == [l-base_line for l in cov['missing_lines']]
 
 
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: sys.monitoring disables lines as they're seen")
 def test_deinstrument_seen_descriptor_not_invoked():
     sci = sc.Slipcover()
 
@@ -719,12 +1432,12 @@ def test_deinstrument_seen_descriptor_not_invoked():
 
     foo(0)
 
-    assert old_code != foo.__code__, "Code never de-instrumented"
+    assert old_code is not foo.__code__, "Code never de-instrumented"
 
     foo(1)
 
     cov = sci.get_coverage()['files'][simple_current_file()]
-    if PYTHON_VERSION >= (3,11):
+    if PYTHON_VERSION == (3,11):
         assert [1, 2, 3, 5, 6, 7, 8, 9, 10] == [l-base_line for l in cov['executed_lines']]
     else:
         assert [2, 3, 5, 6, 7, 8, 9, 10] == [l-base_line for l in cov['executed_lines']]
@@ -766,6 +1479,12 @@ def test_format_missing():
 
     assert "2-6, 9-11" == fm([2,4,6, 9,11], [8])
 
+    # missing branches are only listed if their line was executed
+    assert "4, 2->4" == fm([4], [1,2,3], [[2,4], [4,5]])
+
+    # gaps are stepped over, not scanned line by line
+    assert "1-100000000, 100000002" == fm([1, 100_000_000, 100_000_002], [100_000_001])
+
 
 @pytest.mark.parametrize("stats", [False, True])
 def test_print_coverage(stats, capsys):
@@ -782,7 +1501,14 @@ def test_print_coverage(stats, capsys):
 
     sci.instrument(foo)
     foo(3)
+
+    # each file's coverage is retrieved just once
+    iter_coverage = sci.iter_coverage
+    retrievals = []
+    sci.iter_coverage = lambda *args: retrievals.append(1) or iter_coverage(*args)
     sci.print_coverage(sys.stdout)
+    assert 1 == len(retrievals)
+    del sci.iter_coverage
 
     cov = sci.get_coverage()['files'][simple_current_file()]
     execd = len(cov['executed_lines'])
@@ -800,6 +1526,113 @@ def test_print_coverage(stats, capsys):
         assert re.match('^tests[/\\\\]slipcover_test\\.py +[\\d.]+ +0', output[8])
 
 
+@pytest.mark.parametrize("branch", [False, True])
+def test_snapshot(branch):
+    from slipcover import tracker
+
+    sci = sc.Slipcover(branch=branch, count_lines=True)
+
+    base_line = current_line()
+    def foo(n):
+        if n > 5:
+            return 1
+        x = 0
+        for i in range(n):
+            x += i
+        return x
+
+    sci.instrument(foo)
+    foo(3)
+
+    warm_up = sci.snapshot()
+    assert sci.get_coverage() == warm_up.get_coverage()
+
+    # lines seen are still there for de-instrumentation to pick up
+    assert {base_line+2, base_line+4, base_line+5, base_line+6, base_line+7} <= \
+           tracker.get_new_lines(sci.line_map)[foo.__code__.co_filename]
+
+    foo(10)
+    phase = sci.snapshot()
+    assert warm_up.epoch < phase.epoch
+    assert sci.get_coverage() == phase.get_coverage()
+
+    cov = phase.since(warm_up)['files'][simple_current_file()]
+    assert [base_line+3] == cov['executed_lines']
+    assert [] == cov['missing_lines']
+    # (3.11 also counts the 'def' line, as functions are entered)
+    assert {base_line+2: 1, base_line+3: 1} == \
+           {line: n for line, n in cov['execution_counts'].items() if line > base_line+1}
+    if branch:
+        assert [[base_line+2, base_line+3]] == cov['executed_branches']
+
+
+@pytest.mark.parametrize("pretty_print", [False, True])
+def test_write_json(pretty_print):
+    import json
+    import io
+
+    sci = sc.Slipcover(branch=True, count_lines=True)
+
+    def foo(n):
+        if n == 42:
+            return 666
+        return n
+
+    def bar():
+        return 0
+
+    sci.instrument(foo)
+    sci.instrument(bar)
+    foo(3)
+
+    cov = sci.get_coverage()
+    expected = json.dumps(cov, indent=(4 if pretty_print else None)) + "\n"
+
+    out = io.StringIO()
+    sci.write_json(out, pretty_print=pretty_print)
+    assert expected == out.getvalue()
+
+    out = io.StringIO()
+    sci.write_json(out, pretty_print=pretty_print, cov=cov)
+    assert expected == out.getvalue()
+
+    out = io.StringIO()
+    sci.write_json(out, pretty_print=pretty_print, cov={'files': {}})
+    assert json.dumps({'files': {}}, indent=(4 if pretty_print else None)) + "\n" == out.getvalue()
+
+
+def test_profile_overhead(capsys):
+    sci = sc.Slipcover(profile_overhead=True, d_threshold=5)
+
+    def foo(n):
+        x = 0
+        for i in range(n):
+            x += i
+        return x
+
+    sci.instrument(foo)
+    for _ in range(10):
+        foo(10)
+
+    overhead = sci.get_coverage()['overhead']
+    assert 1 == overhead['instrumented_code']
+    assert overhead['deinstrument_ms'] >= overhead['deinstrument_edit_ms']
+
+    if PYTHON_VERSION < (3,12):
+        assert overhead['deinstrument_passes'] >= 1
+        assert overhead['bytecode_added'] > 0
+        assert overhead['consts_added'] > 0
+        assert overhead['trackers'] > 0
+        assert overhead['tracker_bytes'] > 0
+        # each line ran at least once, and its probe was disabled before the last call
+        assert len(sci.get_coverage()['files'][simple_current_file()]['executed_lines']) < \
+               overhead['probe_calls'] < 10 * 10 * overhead['trackers']
+        assert overhead['editor_finishes'] >= 1 + overhead['deinstrument_passes']
+
+    sci.print_coverage(sys.stdout)
+    assert 'repointing functions' in capsys.readouterr()[0]
+
+
 def func_names(funcs):
     return sorted(map(lambda f: f.__name__, funcs))
 
@@ -848,6 +1681,403 @@ def test_interpose_on_module_load(tmp_path):
     assert [] == cov['files'][module_file]['missing_lines']
 
 
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: no probes with sys.monitoring")
+def test_interpose_on_module_load_cached(tmp_path):
+    from pathlib import Path
+    import subprocess
+    import json
+
+    cache_dir = tmp_path / "cache"
+    module_file = str(Path('tests') / 'imported' / '__init__.py')
+
+    for _ in range(2):
+        out_file = tmp_path / "out.json"
+        subprocess.run(f"{sys.executable} -m slipcover --cache-dir {cache_dir} --json --out {out_file} tests/importer.py".split(),
+                       check=True)
+        with open(out_file, "r") as f:
+            cov = json.load(f)
+
+        assert list(range(1,5+1)) == cov['files'][module_file]['executed_lines']
+        assert [] == cov['files'][module_file]['missing_lines']
+
+    # the script and the module it imports
+    assert 2 == len(list(cache_dir.iterdir()))
+
+
+@pytest.mark.parametrize("count", [False, True])
+def test_coverage_file(tmp_path, count):
+    sci = sc.Slipcover(count_lines=count, coverage_file=tmp_path / "cov.bin")
+
+    def foo(n):
+        x = 0
+        for i in range(n):
+            x += i
+        if x < 0:
+            x = 0
+        return x
+
+    sci.instrument(foo)
+    foo(10)
+
+    # it's there as soon as it happens, with no need to write it out
+    assert sci.get_coverage() == sc.read_coverage_file(tmp_path / "cov.bin")
+
+
+def test_coverage_file_survives_exit(tmp_path):
+    from pathlib import Path
+    import subprocess
+    import json
+    import os
+
+    (tmp_path / "t.py").write_text("import os\n" +
+                                   "x = 0\n" +
+                                   "for i in range(10):\n" +
+                                   "    x += i\n" +
+                                   "os._exit(0)\n" +
+                                   "x = 1\n")
+
+    env = dict(os.environ, PYTHONPATH=str(Path(sc.__file__).parent.parent))
+    subprocess.run([sys.executable, "-m", "slipcover", "--count", "--coverage-file", "cov.bin",
+                    "t.py"], check=True, cwd=tmp_path, env=env)
+    p = subprocess.run([sys.executable, "-m", "slipcover", "convert", "cov.bin"],
+                       check=True, cwd=tmp_path, env=env, capture_output=True, text=True)
+    cov = json.loads(p.stdout)
+
+    assert [1, 2, 3, 4, 5] == cov['files']['t.py']['executed_lines']
+    assert [6] == cov['files']['t.py']['missing_lines']
+    assert 10 == cov['files']['t.py']['execution_counts']['4']
+
+
+def test_child_processes(tmp_path):
+    from pathlib import Path
+    import subprocess
+    import json
+    import os
+
+    (tmp_path / "mod.py").write_text("def f(x):\n" +
+                                     "    return x + 1\n" +
+                                     "def g(x):\n" +
+                                     "    return x * 2\n" +
+                                     "def h(x):\n" +
+                                     "    return x - 1\n" +
+                                     "def never():\n" +
+                                     "    return 0\n" +
+                                     "X = 1\n")
+    (tmp_path / "child.py").write_text("import sys\n" +
+                                       "if sys.argv[1:] == ['arg']:\n" +
+                                       "    x = 1\n")
+    (tmp_path / "main.py").write_text("import os, sys, subprocess, multiprocessing\n" +
+                                      "import mod\n" +
+                                      "subprocess.run([sys.executable, 'child.py', 'arg'], check=True)\n" +
+                                      "subprocess.run([sys.executable, '-c', 'import mod; mod.f(2)'], check=True)\n" +
+                                      "if hasattr(os, 'fork'):\n" +
+                                      "    p = multiprocessing.get_context('fork').Process(target=mod.g, args=(1,))\n" +
+                                      "    p.start(); p.join()\n" +
+                                      "    if (pid := os.fork()) == 0:\n" +
+                                      "        mod.h(1)\n" +
+                                      "        sys.exit(0)\n" +
+                                      "    os.waitpid(pid, 0)\n")
+
+    out_file = tmp_path / "out.json"
+    env = dict(os.environ, PYTHONPATH=str(Path(sc.__file__).parent.parent))
+    subprocess.run([sys.executable, "-m", "slipcover", "--child-processes", "--count",
+                    "--json", "--out", str(out_file), "main.py"],
+                   check=True, cwd=tmp_path, env=env)
+    with open(out_file, "r") as f:
+        cov = json.load(f)
+
+    # the child's main script is covered, as are functions run by each kind of child
+    assert [1, 2, 3] == cov['files']['child.py']['executed_lines']
+    if hasattr(os, 'fork'):
+        assert [8] == cov['files']['mod.py']['missing_lines']
+
+        # forked children don't count their parent's executions again
+        assert {'2': 1, '4': 1, '6': 1, '9': 2} == \
+               {line: n for line, n in cov['files']['mod.py']['execution_counts'].items()
+                if line in ('2', '4', '6', '9')}
+
+
+@pytest.mark.skipif(sys.platform == 'win32', reason="N/A: needs fork")
+def test_forked_child_signals_again(tmp_path):
+    from pathlib import Path
+    import subprocess
+    import json
+    import os
+
+    (tmp_path / "mod.py").write_text("def f(x):\n" +
+                                     "    return x + 1\n")
+    (tmp_path / "main.py").write_text("import os, sys, json\n" +
+                                      "from pathlib import Path\n" +
+                                      "from slipcover import multiprocess\n" +
+                                      "import mod\n" +
+                                      "code = mod.f.__code__\n" +
+                                      "mod.f(1)\n" +     # signalled, but not yet de-instrumented
+                                      "if (pid := os.fork()) == 0:\n" +
+                                      "    for _ in range(1000): mod.f(1)\n" +
+                                      "    Path('replaced.json').write_text(json.dumps(mod.f.__code__ is not code))\n" +
+                                      "    sys.exit(0)\n" +
+                                      "os.waitpid(pid, 0)\n" +
+                                      "shards = [json.loads(p.read_text()) for p in\n" +
+                                      "          Path(multiprocess._config['shard_dir']).glob('*.json')]\n" +
+                                      "Path('shards.json').write_text(json.dumps(shards))\n")
+
+    env = dict(os.environ, PYTHONPATH=str(Path(sc.__file__).parent.parent))
+    subprocess.run([sys.executable, "-m", "slipcover", "--child-processes", "--json",
+                    "--out", str(tmp_path / "out.json"), "main.py"],
+                   check=True, cwd=tmp_path, env=env)
+
+    # the line the parent signalled before forking is in the child's own shard...
+    shards = json.loads((tmp_path / "shards.json").read_text())
+    assert 1 == len(shards)
+    assert 2 in shards[0]['files']['mod.py']['executed_lines']
+
+    if PYTHON_VERSION < (3,12):
+        # ... and is de-instrumented in the child, rather than probed from then on
+        assert json.loads((tmp_path / "replaced.json").read_text())
+
+
+@pytest.mark.parametrize("jobs", [1, 2])
+def test_combine(tmp_path, jobs):
+    from slipcover import combine
+    import json
+
+    def write(name, files):
+        (tmp_path / name).write_text(json.dumps({'files': files}))
+        return tmp_path / name
+
+    a = write("a.json", {'x.py': {'executed_lines': [1, 2], 'missing_lines': [3, 200],
+                                  'execution_counts': {'1': 1, '2': 5},
+                                  'executed_branches': [[2, 3]], 'missing_branches': [[2, 200]]}})
+    b = write("b.json", {'x.py': {'executed_lines': [1, 200], 'missing_lines': [2, 3],
+                                  'execution_counts': {'1': 2, '200': 1},
+                                  'executed_branches': [[2, 200]], 'missing_branches': [[2, 3]]},
+                         'y.py': {'executed_lines': [], 'missing_lines': [1],
+                                  'execution_counts': {},
+                                  'executed_branches': [], 'missing_branches': []}})
+
+    sci = sc.Slipcover(count_lines=True, coverage_file=tmp_path / "c.bin")
+    def foo():
+        return 0
+    sci.instrument(foo)
+    foo()
+
+    cov = combine.to_json(combine.combine([a, b, tmp_path / "c.bin"], jobs=jobs))
+
+    assert {'executed_lines': [1, 2, 200], 'missing_lines': [3],
+            'execution_counts': {1: 3, 2: 5, 200: 1},
+            'executed_branches': [[2, 3], [2, 200]], 'missing_branches': []} == cov['files']['x.py']
+    assert [1] == cov['files']['y.py']['missing_lines']
+
+    # the same as merging them one by one
+    expected = {'files': {}}
+    for path in (a, b):
+        sc.Slipcover.merge_coverage(expected, json.loads(path.read_text()))
+    sc.Slipcover.merge_coverage(expected, sc.read_coverage_file(tmp_path / "c.bin"))
+    assert json.loads(json.dumps(expected)) == json.loads(json.dumps(cov))
+
+
+def test_merge_coverage_leaves_inputs():
+    import copy
+
+    results = [{'files': {'x.py': {'executed_lines': [1], 'missing_lines': [2, 3],
+                                   'execution_counts': {'1': 1},
+                                   'executed_branches': [[1, 2]], 'missing_branches': [[1, 3]]}}},
+               {'files': {'x.py': {'executed_lines': [2], 'missing_lines': [1, 3],
+                                   'execution_counts': {'2': 1},
+                                   'executed_branches': [], 'missing_branches': [[1, 2], [1, 3]]}}},
+               {'files': {'x.py': {'executed_lines': [3], 'missing_lines': [1, 2],
+                                   'execution_counts': {'3': 2},
+                                   'executed_branches': [[1, 3]], 'missing_branches': [[1, 2]]}}}]
+    originals = copy.deepcopy(results)
+
+    cov = {'files': {}}
+    for r in results:
+        sc.Slipcover.merge_coverage(cov, r)
+
+    assert {'executed_lines': [1, 2, 3], 'missing_lines': [],
+            'execution_counts': {1: 1, 2: 1, 3: 2},
+            'executed_branches': [[1, 2], [1, 3]], 'missing_branches': []} == cov['files']['x.py']
+    assert originals == results
+
+
+def test_diff(tmp_path):
+    from slipcover import combine
+    from pathlib import Path
+    import subprocess
+    import json
+    import os
+
+    (tmp_path / "a.json").write_text(json.dumps({'files': {
+        'x.py': {'executed_lines': [1, 2, 3, 6], 'missing_lines': [4, 8, 9]},
+        'old.py': {'executed_lines': [1], 'missing_lines': []}
+    }}))
+    (tmp_path / "b.json").write_text(json.dumps({'files': {
+        'x.py': {'executed_lines': [1, 4, 8, 9], 'missing_lines': [2, 3, 6]},
+        'new.py': {'executed_lines': [], 'missing_lines': [1]}
+    }}))
+
+    d = combine.diff(combine.read(tmp_path / "a.json"), combine.read(tmp_path / "b.json"))
+    assert {'percent_covered': [57, 57], 'newly_executed_lines': [4, 8, 9],
+            'newly_missing_lines': [2, 3, 6]} == d['files']['x.py']
+    assert ['old.py'] == d['only_in_a']
+    assert ['new.py'] == d['only_in_b']
+
+    env = dict(os.environ, PYTHONPATH=str(Path(sc.__file__).parent.parent))
+    p = subprocess.run([sys.executable, "-m", "slipcover", "diff", "a.json", "b.json"],
+                       check=True, cwd=tmp_path, env=env, capture_output=True, text=True)
+    x_line = next(line for line in p.stdout.splitlines() if line.startswith('x.py'))
+    # ranges span lines that aren't code, as in the missing lines column
+    assert x_line.split()[3:] == ['4,', '8-9', '2-3,', '6']
+
+
+@pytest.mark.skipif(sys.platform == 'win32', reason="needs POSIX signals and Unix domain sockets")
+def test_live_export(tmp_path):
+    from pathlib import Path
+    import subprocess
+    import signal
+    import socket
+    import json
+    import os
+    import time
+
+    (tmp_path / "svc.py").write_text("import os, time\n" +
+                                     "def handle(n):\n" +
+                                     "    if n:\n" +
+                                     "        return 1\n" +
+                                     "    return 0\n" +
+                                     "handle(1)\n" +
+                                     "while not os.path.exists('stop'):\n" +
+                                     "    time.sleep(.01)\n" +
+                                     "    if os.path.exists('go'):\n" +
+                                     "        handle(0)\n" +
+                                     "    open('ready', 'w').close()\n")
+
+    def wait_for(path):
+        for _ in range(1000):
+            if path.exists(): return
+            time.sleep(.01)
+        assert False, f"{path} never appeared"
+
+    def command(c):
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+            s.connect(str(tmp_path / "ctl.sock"))
+            s.sendall(c.encode('utf-8') + b"\n")
+            data = b""
+            while (chunk := s.recv(65536)):
+                data += chunk
+            return data.decode('utf-8')
+
+    env = dict(os.environ, PYTHONPATH=str(Path(sc.__file__).parent.parent))
+    p = subprocess.Popen([sys.executable, "-m", "slipcover", "--silent", "--dump-signal", "USR1",
+                          "--dump-file", "dump.json", "--control-socket", "ctl.sock", "svc.py"],
+                         cwd=tmp_path, env=env)
+    try:
+        wait_for(tmp_path / "ready")
+
+        p.send_signal(signal.SIGUSR1)
+        wait_for(tmp_path / "dump.json")
+        cov = json.loads((tmp_path / "dump.json").read_text())['files']['svc.py']
+        assert [5, 10] == cov['missing_lines']
+
+        assert [5, 10] == json.loads(command("delta"))['files']['svc.py']['missing_lines']
+
+        (tmp_path / "go").touch()
+        for _ in range(1000):
+            cov = json.loads(command("coverage"))['files']['svc.py']
+            if not cov['missing_lines']: break
+            time.sleep(.01)
+
+        # just what was covered since the last delta
+        assert [5, 10] == json.loads(command("delta"))['files']['svc.py']['executed_lines']
+        assert "ok\n" == command("dump again.json")
+        assert [] == json.loads((tmp_path / "again.json").read_text())['files']['svc.py']['missing_lines']
+        assert command("bogus").startswith("error")
+    finally:
+        (tmp_path / "stop").touch()
+        assert 0 == p.wait(timeout=30)
+
+    assert not (tmp_path / "ctl.sock").exists()
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: no probes with sys.monitoring")
+def test_precompile(tmp_path):
+    import subprocess
+    import json
+
+    src = tmp_path / "src"
+    (src / "pkg").mkdir(parents=True)
+    (src / "pkg" / "__init__.py").write_text("def f(x):\n" +
+                                             "    if x:\n" +
+                                             "        return 1\n" +
+                                             "    return 2\n")
+    (src / "pkg" / "unused.py").write_text("x = 1\n")
+    (src / "omitted.py").write_text("x = 1\n")
+    (src / "broken.py").write_text("def\n")
+    (src / "main.py").write_text("import pkg\n" +
+                                 "pkg.f(1)\n")
+
+    cache_dir = tmp_path / "cache"
+    p = subprocess.run([sys.executable, "-m", "slipcover", "precompile", "--branch", "-j", "2",
+                        "--source", str(src), "--omit", "*/omitted.py", "--cache-dir", str(cache_dir)],
+                       check=True, capture_output=True, text=True)
+    assert "3 of 4 files" in p.stdout
+
+    entries = {e.name: e.stat().st_mtime_ns for e in cache_dir.iterdir()}
+    assert 3 == len(entries)
+
+    out_file = tmp_path / "out.json"
+    subprocess.run([sys.executable, "-m", "slipcover", "--branch", "--source", str(src),
+                    "--cache-dir", str(cache_dir), "--json", "--out", str(out_file),
+                    str(src / "main.py")], check=True)
+    with open(out_file, "r") as f:
+        cov = json.load(f)['files']
+
+    pkg_cov = cov[str(src / "pkg" / "__init__.py")]
+    assert [1, 2, 3] == pkg_cov['executed_lines']
+    assert [4] == pkg_cov['missing_lines']
+    assert [[2, 4]] == pkg_cov['missing_branches']
+
+    # the run found everything already in the cache
+    assert entries == {e.name: e.stat().st_mtime_ns for e in cache_dir.iterdir()}
+
+
+@pytest.mark.skipif(PYTHON_VERSION >= (3,12), reason="N/A: no probes with sys.monitoring")
+def test_precompile_count(tmp_path):
+    import subprocess
+    import json
+
+    src = tmp_path / "src"
+    src.mkdir()
+    (src / "mod.py").write_text("def f(n):\n" +
+                                "    x = 0\n" +
+                                "    for i in range(n):\n" +
+                                "        x += i\n" +
+                                "    return x\n")
+    (src / "main.py").write_text("import mod\n" +
+                                 "mod.f(3)\n")
+
+    # counting lays out probes of its own, so it's part of the cache key
+    cache_dir = tmp_path / "cache"
+    subprocess.run([sys.executable, "-m", "slipcover", "precompile", "--count",
+                    "--source", str(src), "--cache-dir", str(cache_dir)],
+                   check=True, capture_output=True)
+    entries = {e.name: e.stat().st_mtime_ns for e in cache_dir.iterdir()}
+    assert 2 == len(entries)
+
+    out_file = tmp_path / "out.json"
+    subprocess.run([sys.executable, "-m", "slipcover", "--count", "--source", str(src),
+                    "--cache-dir", str(cache_dir), "--json", "--out", str(out_file),
+                    str(src / "main.py")], check=True)
+    with open(out_file, "r") as f:
+        cov = json.load(f)['files']
+
+    counts = cov[str(src / "mod.py")]['execution_counts']
+    assert {'3': 4, '4': 3} == {line: n for line, n in counts.items() if line in ('3', '4')}
+
+    # the run found everything already in the cache
+    assert entries == {e.name: e.stat().st_mtime_ns for e in cache_dir.iterdir()}
+
+
 def test_pytest_interpose(tmp_path):
     # TODO include in coverage info
     from pathlib import Path
@@ -1,177 +1,2029 @@
 #define PY_SSIZE_T_CLEAN    // programmers love obscure statements
 #include <Python.h>
 #include <algorithm>
+#include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <new>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "pyptr.h"
+#include "bytecode.h"
+#include "coverage_file.h"
 
 
 /**
- * Implements a smart pointer to a PyObject.
+ * Returns the index of the lowest bit set in a (non-zero) word.
  */
-template <class O = PyObject>
-class PyPtr {
+static inline int lowest_bit(uint64_t w) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, w);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(w);
+#endif
+}
+
+
+/**
+ * Returns the number of bits set in a word.
+ */
+static inline int popcount(uint64_t w) {
+#ifdef _MSC_VER
+    return static_cast<int>(__popcnt64(w));
+#else
+    return __builtin_popcountll(w);
+#endif
+}
+
+
+/**
+ * Protects state that isn't accessed on the hot path.  With the GIL, that's enough
+ * to serialize access; in free-threaded builds, we use a PyMutex, which detaches
+ * from the interpreter while waiting, so it can't deadlock with the GIL or GC.
+ */
+class ColdLock {
+#ifdef Py_GIL_DISABLED
+    PyMutex _mutex = {0};
+
+public:
+    void lock() { PyMutex_Lock(&_mutex); }
+    void unlock() { PyMutex_Unlock(&_mutex); }
+#else
+public:
+    void lock() {}
+    void unlock() {}
+#endif
+};
+
+
+/**
+ * Increments a counter, returning its new value.  With the GIL, a relaxed load and
+ * store suffice, avoiding a locked instruction on the hot path.
+ */
+template<typename T>
+static inline T increment(std::atomic<T>& counter) {
+#ifdef Py_GIL_DISABLED
+    return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+#else
+    T value = counter.load(std::memory_order_relaxed) + 1;
+    counter.store(value, std::memory_order_relaxed);
+    return value;
+#endif
+}
+
+
+/**
+ * Implements a growable bitmap of line numbers.
+ */
+class LineBitmap {
+    std::vector<uint64_t> _words;
+
+public:
+    void set(long line) {
+        size_t word = static_cast<size_t>(line) >> 6;
+        if (word >= _words.size()) {
+            _words.resize(word+1);
+        }
+        _words[word] |= uint64_t(1) << (line & 63);
+    }
+
+    bool test(long line) const {
+        size_t word = static_cast<size_t>(line) >> 6;
+        return word < _words.size() && (_words[word] & (uint64_t(1) << (line & 63)));
+    }
+
+    bool empty() const {
+        return std::none_of(_words.begin(), _words.end(), [](uint64_t w) { return w != 0; });
+    }
+
+    /**
+     * Returns a copy of the bitmap's words, as bytes.
+     */
+    PyObject* to_bytes() const {
+        return PyBytes_FromStringAndSize(reinterpret_cast<const char*>(_words.data()),
+                                         _words.size() * sizeof(uint64_t));
+    }
+
+    void clear() {
+        _words.clear();
+    }
+
+    /**
+     * Returns the number of lines set in (this & ~mask).
+     */
+    size_t count(const LineBitmap* mask = nullptr) const {
+        size_t n = 0;
+        for (size_t i = 0; i < _words.size(); ++i) {
+            uint64_t w = _words[i];
+            if (mask && i < mask->_words.size()) {
+                w &= ~mask->_words[i];
+            }
+            n += popcount(w);
+        }
+        return n;
+    }
+
+    /**
+     * Invokes f(line) for every line set in (this & ~mask), in ascending order.
+     */
+    template <class F>
+    bool for_each(F f, const LineBitmap* mask = nullptr) const {
+        for (size_t i = 0; i < _words.size(); ++i) {
+            uint64_t w = _words[i];
+            if (mask && i < mask->_words.size()) {
+                w &= ~mask->_words[i];
+            }
+
+            while (w) {
+                int bit = lowest_bit(w);
+                if (!f(static_cast<long>((i << 6) + bit))) return false;
+                w &= w - 1;
+            }
+        }
+        return true;
+    }
+};
+
+
+/**
+ * A bitmap of line numbers that may be tested and set from any thread without locking,
+ * so that a line is reported only once, however many threads reach it.  It only grows
+ * while holding the line map's lock; the words it outgrows are kept, as other threads
+ * may still be reading them.  A bit set in those while growing may be lost, in which
+ * case its line is just reported again.
+ */
+class AtomicLineBitmap {
+    struct Words {
+        const size_t count;
+        std::unique_ptr<std::atomic<uint64_t>[]> bits;
+        std::unique_ptr<Words> previous;
+
+        Words(size_t count, std::unique_ptr<Words> previous):
+            count(count), bits(new std::atomic<uint64_t>[count]), previous(std::move(previous)) {
+            for (size_t i = 0; i < count; ++i) {
+                bits[i].store(this->previous && i < this->previous->count ?
+                                this->previous->bits[i].load(std::memory_order_relaxed) : 0,
+                              std::memory_order_relaxed);
+            }
+        }
+    };
+
+    std::unique_ptr<Words> _owned;
+    std::atomic<Words*> _words;
+
+public:
+    AtomicLineBitmap(): _owned(new Words(1, nullptr)), _words(_owned.get()) {}
+
+    bool fits(long line) const {
+        return (static_cast<size_t>(line) >> 6) < _words.load(std::memory_order_acquire)->count;
+    }
+
+    /**
+     * Makes room for lines up to the given one; must hold the line map's lock.
+     */
+    void reserve(long line) {
+        size_t count = (static_cast<size_t>(line) >> 6) + 1;
+        if (count <= _owned->count) return;
+
+        count = std::max(count, 2*_owned->count);
+        std::unique_ptr<Words> previous = std::move(_owned);
+        _owned.reset(new Words(count, std::move(previous)));
+        _words.store(_owned.get(), std::memory_order_release);
+    }
+
+    bool test(long line) const {
+        Words* words = _words.load(std::memory_order_acquire);
+        size_t word = static_cast<size_t>(line) >> 6;
+        return word < words->count &&
+               (words->bits[word].load(std::memory_order_relaxed) & (uint64_t(1) << (line & 63)));
+    }
+
+    /**
+     * Sets a line (which must fit), returning whether it was newly set.  With the GIL,
+     * a relaxed load and store suffice, as for increment().
+     */
+    bool test_and_set(long line) {
+        std::atomic<uint64_t>& word = _words.load(std::memory_order_acquire)->bits[line >> 6];
+        uint64_t bit = uint64_t(1) << (line & 63);
+        uint64_t value = word.load(std::memory_order_relaxed);
+        if (value & bit) return false;
+#ifdef Py_GIL_DISABLED
+        return !(word.fetch_or(bit, std::memory_order_relaxed) & bit);
+#else
+        word.store(value | bit, std::memory_order_relaxed);
+        return true;
+#endif
+    }
+
+    /**
+     * Clears all lines; must hold the line map's lock.
+     */
+    void clear() {
+        for (size_t i = 0; i < _owned->count; ++i) {
+            _owned->bits[i].store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+
+/**
+ * Holds the lines seen and the code lines for a source file.
+ */
+struct FileLines {
+    PyPtr<> filename;
+    LineBitmap code;        // lines instrumented
+    LineBitmap seen;        // lines seen so far
+    LineBitmap new_seen;    // lines seen since the last get_new_lines()
+    AtomicLineBitmap marked;    // lines passed to mark_seen, so each is only noted once
+    std::vector<uint64_t> hits; // execution counts by line, if counted here
+
+    typedef std::pair<long, long> Arc;  // (from line, to line) taken by a branch
+    std::set<Arc> code_arcs;        // arcs instrumented
+    std::set<Arc> seen_arcs;        // arcs seen so far
+    std::set<Arc> new_seen_arcs;    // arcs seen since the last get_new_arcs()
+
+    // the latest record for this file in the coverage file, if any
+    std::atomic<CoverageFile::Lines*> mapped;
+
+    FileLines(PyObject* filename): filename(PyPtr<>::borrowed(filename)), mapped(nullptr) {}
+
+    void count_hit(long line, uint64_t count) {
+        size_t index = static_cast<size_t>(line);
+        if (index >= hits.size()) {
+            hits.resize(index+1);
+        }
+        hits[index] += count;
+    }
+};
+
+
+/**
+ * Decides when D misses call for a de-instrumentation pass.
+ *
+ * By default, a pass is requested once a line's D misses reach its threshold, which
+ * is the same for all lines.  If adaptive, lines start out with that threshold, but
+ *  - a pass is also requested once the D misses pending across all lines add up to
+ *    about the cost of a pass, as last measured, so that lines too cold to reach their
+ *    threshold don't stay instrumented indefinitely;
+ *  - passes are kept to a fraction of the run time; a line reaching its threshold too
+ *    soon after the last pass has it doubled instead, so that hot lines wait for the
+ *    next pass rather than each causing one.
+ */
+class DeinstrumentPolicy {
+    static constexpr double D_MISS_SECONDS = 50e-9;     // roughly, the cost of a probe
+    static constexpr double MAX_PASS_FRACTION = .05;
+    static constexpr long long MIN_BUDGET = 100;
+    static constexpr long long INITIAL_BUDGET = 10000;
+
+    const bool _adaptive;
+    std::atomic<long long> _pending;        // D misses since a pass was last requested
+    std::atomic<long long> _budget;         // pending D misses that call for a pass
+    std::atomic<int64_t> _next_pass_ns;     // until then, lines reaching their threshold wait
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    DeinstrumentPolicy(bool adaptive): _adaptive(adaptive), _pending(0),
+                                       _budget(INITIAL_BUDGET), _next_pass_ns(0) {}
+
+    /**
+     * Notes a line's n-th D miss, returning whether to request a pass.
+     * The line's threshold may be raised.
+     */
+    bool d_miss(long long n, std::atomic<long long>& threshold) {
+        long long line_threshold = threshold.load(std::memory_order_relaxed);
+        if (!_adaptive) return n == line_threshold;
+        if (line_threshold < 0) return false;
+
+        bool line_due = n >= line_threshold;
+        long long pending = n > 0 ? increment(_pending) : 0;    // the 0th is the line's first hit
+        bool budget_due = pending >= _budget.load(std::memory_order_relaxed);
+        if (!line_due && !budget_due) return false;
+
+        if (now_ns() < _next_pass_ns.load(std::memory_order_relaxed)) {
+            if (line_due) threshold.store(2*n + 1, std::memory_order_relaxed);
+            if (budget_due) _budget.store(2*pending, std::memory_order_relaxed);
+            return false;
+        }
+
+        // the pass requested takes care of the line; until it does (or if it can't, such
+        // as for code still running in a frame), its further D misses don't request more
+        if (line_due) threshold.store(2*n + 1, std::memory_order_relaxed);
+        _pending.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * Notes that a pass took the given time.
+     */
+    void pass_done(double seconds) {
+        if (!_adaptive) return;
+
+        _budget.store(std::max(MIN_BUDGET, static_cast<long long>(seconds / D_MISS_SECONDS)),
+                      std::memory_order_relaxed);
+        _next_pass_ns.store(now_ns() + static_cast<int64_t>(1e9 * seconds * (1/MAX_PASS_FRACTION - 1)),
+                            std::memory_order_relaxed);
+    }
+};
+
+
+/**
+ * Maps source files to the lines seen in them.
+ *
+ * Lines are first seen on the hot path, possibly by several threads at once.  With the
+ * GIL, they go straight into the bitmaps; otherwise, they're pushed onto a lock-free
+ * stack, which is moved into the bitmaps when reporting.
+ */
+class LineMap {
+    struct SeenLine {
+        FileLines* file;
+        long line;
+        long to_line;   // if an arc, the line it goes to; 0 otherwise
+        SeenLine* next;
+    };
+
+    ColdLock _lock;     // protects all but _seen
+    PyPtr<> _index;     // filename -> index into _files
+    std::vector<std::unique_ptr<FileLines>> _files;
+    std::atomic<SeenLine*> _seen;
+    const uint64_t _count_every;    // 0 if not counting executions
+    std::atomic<uint64_t> _count_tick;
+    DeinstrumentPolicy _policy;
+    std::unique_ptr<CoverageFile> _coverage_file;   // mirrors lines seen and counts, if any
+    const uint64_t _serial;     // tells line maps apart, unlike addresses, which get reused
+    std::atomic<uint32_t> _generation;  // advanced by forget_seen, so trackers signal anew
+
+    static std::atomic<uint64_t> _next_serial;
+
+    /**
+     * Moves lines pushed by mark_seen into the bitmaps; must hold _lock.
+     */
+    void drain_seen() {
+        SeenLine* node = _seen.exchange(nullptr, std::memory_order_acquire);
+        while (node) {
+            if (node->to_line) {
+                FileLines::Arc arc(node->line, node->to_line);
+                node->file->seen_arcs.insert(arc);
+                node->file->new_seen_arcs.insert(arc);
+            }
+            else {
+                node->file->seen.set(node->line);
+                node->file->new_seen.set(node->line);
+            }
+
+            SeenLine* next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+
+    static PyObject* to_list(const LineBitmap& bits, const LineBitmap* mask = nullptr) {
+        PyPtr<> list = PyList_New(0);
+        if (!list) return NULL;
+
+        if (!bits.for_each([&](long line) {
+                PyPtr<> n = PyLong_FromLong(line);
+                return n && PyList_Append(list, n) == 0;
+            }, mask)) {
+            return NULL;
+        }
+
+        Py_IncRef(list);
+        return list;
+    }
+
+    static PyObject* arc_tuple(const FileLines::Arc& arc) {
+        return Py_BuildValue("(ll)", arc.first, arc.second);
+    }
+
+    static PyObject* to_list(const std::set<FileLines::Arc>& arcs,
+                             const std::set<FileLines::Arc>* exclude = nullptr) {
+        PyPtr<> list = PyList_New(0);
+        if (!list) return NULL;
+
+        for (auto& arc : arcs) {
+            if (exclude && exclude->count(arc)) continue;
+
+            PyPtr<> t = arc_tuple(arc);
+            if (!t || PyList_Append(list, t) < 0) return NULL;
+        }
+
+        Py_IncRef(list);
+        return list;
+    }
+
+    static PyObject* to_dict(const std::vector<uint64_t>& hits) {
+        PyPtr<> counts = PyDict_New();
+        if (!counts) return NULL;
+
+        for (size_t line = 0; line < hits.size(); ++line) {
+            if (!hits[line]) continue;
+
+            PyPtr<> n = PyLong_FromSize_t(line);
+            PyPtr<> count = PyLong_FromUnsignedLongLong(hits[line]);
+            if (!n || !count || PyDict_SetItem(counts, n, count) < 0) {
+                return NULL;
+            }
+        }
+
+        Py_IncRef(counts);
+        return counts;
+    }
+
+public:
+    LineMap(uint64_t count_every, bool adaptive_threshold,
+            std::unique_ptr<CoverageFile> coverage_file = nullptr):
+        _index(PyDict_New()), _seen(nullptr), _count_every(count_every), _count_tick(0),
+        _policy(adaptive_threshold), _coverage_file(std::move(coverage_file)),
+        _serial(_next_serial.fetch_add(1, std::memory_order_relaxed)), _generation(1) {}
+
+    ~LineMap() {
+        drain_seen();
+    }
+
+    static constexpr const char* CAPSULE_NAME = "slipcover.LineMap";
+
+    static PyObject*
+    newCapsule(LineMap* m) {
+        return PyCapsule_New(m, CAPSULE_NAME,
+                             [](PyObject* cap) {
+                                 delete (LineMap*)PyCapsule_GetPointer(cap, CAPSULE_NAME);
+                             });
+    }
+
+    FileLines* get(PyObject* filename) {
+        std::lock_guard<ColdLock> guard(_lock);
+
+        PyObject* index = PyDict_GetItemWithError(_index, filename);   // borrowed
+        if (index) {
+            return _files[PyLong_AsSize_t(index)].get();
+        }
+        if (PyErr_Occurred()) return nullptr;
+
+        PyPtr<> new_index = PyLong_FromSize_t(_files.size());
+        if (!new_index || PyDict_SetItem(_index, filename, new_index) < 0) {
+            return nullptr;
+        }
+
+        _files.emplace_back(new FileLines(filename));
+        return _files.back().get();
+    }
+
+    /**
+     * Notes code lines in the coverage file, adding a record for the file if it has
+     * none, or if they don't fit in the one it has; must hold _lock.
+     */
+    bool map_code_lines(FileLines* file, const std::vector<long>& code_lines) {
+        long max_line = *std::max_element(code_lines.begin(), code_lines.end());
+        CoverageFile::Lines* mapped = file->mapped.load(std::memory_order_relaxed);
+
+        if (mapped && max_line < mapped->lines) {
+            for (long line : code_lines) {
+                mapped->mark_code(line);
+            }
+            return true;
+        }
+
+        Py_ssize_t size;
+        const char* name = PyUnicode_AsUTF8AndSize(file->filename, &size);
+        if (!name) return false;
+
+        // rounded up, leaving room for more code from the same file
+        mapped = _coverage_file->add_file(std::string(name, size), (max_line + 64) & ~63L,
+                                          code_lines);
+        if (!mapped) {
+            if (errno == EPERM) return true;    // a forked child; it's the parent's file
+            PyErr_SetFromErrno(PyExc_OSError);
+            return false;
+        }
+
+        file->mapped.store(mapped, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Notes a line (or, if to_line is given, a branch arc) as seen.  This is safe to call
+     * from any thread without holding any locks; it's taken into account in the next report.
+     * A line is only noted the first time; callers check arcs themselves.
+     */
+    void mark_seen(FileLines* file, long line, long to_line = 0) {
+        if (!to_line) {
+            if (!file->marked.fits(line)) {
+                std::lock_guard<ColdLock> guard(_lock);
+                file->marked.reserve(line);
+            }
+            if (!file->marked.test_and_set(line)) return;
+
+            if (auto mapped = file->mapped.load(std::memory_order_acquire)) {
+                mapped->mark_seen(line);
+            }
+        }
+
+#ifdef Py_GIL_DISABLED
+        SeenLine* node = new SeenLine{file, line, to_line, _seen.load(std::memory_order_relaxed)};
+        while (!_seen.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+        }
+#else
+        // the GIL keeps reports out, so it can go straight into the bitmaps
+        if (to_line) {
+            FileLines::Arc arc(line, to_line);
+            file->seen_arcs.insert(arc);
+            file->new_seen_arcs.insert(arc);
+        }
+        else {
+            file->seen.set(line);
+            file->new_seen.set(line);
+        }
+#endif
+    }
+
+    uint64_t serial() const {
+        return _serial;
+    }
+
+    /**
+     * The generation of lines seen, which forget_seen advances; trackers note the one
+     * they were signalled in, and signal again once it changes.
+     */
+    uint32_t generation() const {
+        return _generation.load(std::memory_order_relaxed);
+    }
+
+    DeinstrumentPolicy& policy() {
+        return _policy;
+    }
+
+    /**
+     * Whether line executions are counted, rather than just noted as seen.
+     */
+    bool counting() const {
+        return _count_every != 0;
+    }
+
+    /**
+     * Counts a line's execution.  If sampling, only every Nth execution (of any line)
+     * is counted, as N executions; that also amortizes taking the lock, if it's needed.
+     */
+    void count_hit(FileLines* file, long line) {
+        uint64_t count = 1;
+        if (_count_every > 1) {
+            if (increment(_count_tick) < _count_every) return;
+            _count_tick.store(0, std::memory_order_relaxed);
+            count = _count_every;
+        }
+
+        std::lock_guard<ColdLock> guard(_lock);
+        file->count_hit(line, count);
+
+        if (auto mapped = file->mapped.load(std::memory_order_relaxed)) {
+            mapped->count_hit(line, count);
+        }
+    }
+
+    PyObject* add_code_lines(PyObject* filename, PyObject* lines) {
+        FileLines* file = get(filename);
+        if (!file) return NULL;
+
+        std::vector<long> code_lines;
+        PyPtr<> it = PyObject_GetIter(lines);
+        if (!it) return NULL;
+
+        while (PyObject* item = PyIter_Next(it)) {
+            long line = PyLong_AsLong(item);
+            Py_DecRef(item);
+            if (line < 0) {
+                if (PyErr_Occurred()) return NULL;
+                continue;
+            }
+            code_lines.push_back(line);
+        }
+        if (PyErr_Occurred()) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+        for (long line : code_lines) {
+            file->code.set(line);
+        }
+        if (!code_lines.empty()) {
+            file->marked.reserve(*std::max_element(code_lines.begin(), code_lines.end()));
+        }
+
+        if (_coverage_file && !code_lines.empty() && !map_code_lines(file, code_lines)) {
+            return NULL;
+        }
+
+        if (counting() && !code_lines.empty()) {
+            // size the counts up front, so that they needn't grow while running
+            size_t size = *std::max_element(code_lines.begin(), code_lines.end()) + 1;
+            if (file->hits.size() < size) {
+                file->hits.resize(size);
+            }
+        }
+
+        Py_RETURN_NONE;
+    }
+
+    PyObject* add_code_arcs(PyObject* filename, PyObject* arcs) {
+        FileLines* file = get(filename);
+        if (!file) return NULL;
+
+        std::vector<FileLines::Arc> code_arcs;
+        PyPtr<> it = PyObject_GetIter(arcs);
+        if (!it) return NULL;
+
+        while (PyObject* item = PyIter_Next(it)) {
+            PyPtr<> arc = item;
+            long from, to;
+            if (!PyArg_ParseTuple(arc, "ll", &from, &to)) return NULL;
+            code_arcs.emplace_back(from, to);
+        }
+        if (PyErr_Occurred()) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+        file->code_arcs.insert(code_arcs.begin(), code_arcs.end());
+
+        Py_RETURN_NONE;
+    }
+
+    /**
+     * Returns a dictionary mapping file names to sets of lines seen since the last
+     * call, clearing them.
+     */
+    PyObject* get_new_lines() {
+        PyPtr<> result = PyDict_New();
+        if (!result) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+        drain_seen();
+
+        for (auto& file : _files) {
+            if (file->new_seen.empty()) continue;
+
+            PyPtr<> lines = PySet_New(NULL);
+            if (!lines) return NULL;
+
+            if (!file->new_seen.for_each([&](long line) {
+                    PyPtr<> n = PyLong_FromLong(line);
+                    return n && PySet_Add(lines, n) == 0;
+                })) {
+                return NULL;
+            }
+
+            if (PyDict_SetItem(result, file->filename, lines) < 0) {
+                return NULL;
+            }
+
+            file->new_seen.clear();
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+
+    /**
+     * Returns a dictionary mapping the names of files with code lines to a tuple with
+     * sorted lists of lines executed and missing.
+     */
+    PyObject* get_coverage() {
+        PyPtr<> result = PyDict_New();
+        if (!result) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+        drain_seen();
+
+        for (auto& file : _files) {
+            if (file->code.empty()) continue;
+
+            PyPtr<> executed = to_list(file->seen);
+            if (!executed) return NULL;
+
+            PyPtr<> missing = to_list(file->code, &file->seen);
+            if (!missing) return NULL;
+
+            PyPtr<> t = PyTuple_Pack(2, (PyObject*)executed, (PyObject*)missing);
+            if (!t || PyDict_SetItem(result, file->filename, t) < 0) {
+                return NULL;
+            }
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+
+    /**
+     * Returns a list of the names of files with code lines, so that their coverage
+     * can be retrieved one at a time, with get_file_coverage.
+     */
+    PyObject* get_files() {
+        PyPtr<> result = PyList_New(0);
+        if (!result) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+
+        for (auto& file : _files) {
+            if (file->code.empty()) continue;
+
+            if (PyList_Append(result, file->filename) < 0) {
+                return NULL;
+            }
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+
+    /**
+     * Returns a dictionary mapping the names of files with code lines to a tuple with the
+     * numbers of lines executed and missing and of arcs executed and missing, as in
+     * get_file_coverage, but without building the lists.
+     */
+    PyObject* get_coverage_sizes() {
+        PyPtr<> result = PyDict_New();
+        if (!result) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+        drain_seen();
+
+        for (auto& file : _files) {
+            if (file->code.empty()) continue;
+
+            size_t missing_arcs = 0;
+            for (auto& arc : file->code_arcs) {
+                if (!file->seen_arcs.count(arc)) ++missing_arcs;
+            }
+
+            PyPtr<> t = Py_BuildValue("(nnnn)", (Py_ssize_t)file->seen.count(),
+                                      (Py_ssize_t)file->code.count(&file->seen),
+                                      (Py_ssize_t)file->seen_arcs.size(), (Py_ssize_t)missing_arcs);
+            if (!t || PyDict_SetItem(result, file->filename, t) < 0) {
+                return NULL;
+            }
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+
+    /**
+     * Returns a file's coverage, as a tuple with sorted lists of lines executed and missing,
+     * sorted lists of arcs executed and missing, and a dictionary of line execution counts,
+     * or None if they're not counted here.  Returns None for files it doesn't know.
+     */
+    PyObject* get_file_coverage(PyObject* filename) {
+        std::lock_guard<ColdLock> guard(_lock);
+        drain_seen();
+
+        PyObject* index = PyDict_GetItemWithError(_index, filename);   // borrowed
+        if (!index) {
+            if (PyErr_Occurred()) return NULL;
+            Py_RETURN_NONE;
+        }
+
+        FileLines* file = _files[PyLong_AsSize_t(index)].get();
+
+        PyPtr<> executed = to_list(file->seen);
+        PyPtr<> missing = to_list(file->code, &file->seen);
+        PyPtr<> executed_arcs = to_list(file->seen_arcs);
+        PyPtr<> missing_arcs = to_list(file->code_arcs, &file->seen_arcs);
+        PyPtr<> counts = nullptr;
+        if (file->hits.empty()) counts = PyPtr<>::borrowed(Py_None);
+        else counts = to_dict(file->hits);
+        if (!executed || !missing || !executed_arcs || !missing_arcs || !counts) return NULL;
+
+        return PyTuple_Pack(5, (PyObject*)executed, (PyObject*)missing, (PyObject*)executed_arcs,
+                            (PyObject*)missing_arcs, (PyObject*)counts);
+    }
+
+    /**
+     * Returns a dictionary mapping the names of files with code lines to a tuple with
+     * copies of their code and seen line bitmaps and of their execution counts, as bytes
+     * of native u64 words (or None for counts, if not counted here), and with sorted lists
+     * of their code and seen arcs.  It's all taken at once, so that it's consistent across
+     * files, but it leaves the lines and arcs new since get_new_lines/get_new_arcs as they are.
+     */
+    PyObject* snapshot() {
+        PyPtr<> result = PyDict_New();
+        if (!result) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+        drain_seen();
+
+        for (auto& file : _files) {
+            if (file->code.empty()) continue;
+
+            PyPtr<> code = file->code.to_bytes();
+            PyPtr<> seen = file->seen.to_bytes();
+            PyPtr<> code_arcs = to_list(file->code_arcs);
+            PyPtr<> seen_arcs = to_list(file->seen_arcs);
+            PyPtr<> hits = nullptr;
+            if (file->hits.empty()) hits = PyPtr<>::borrowed(Py_None);
+            else hits = PyBytes_FromStringAndSize(reinterpret_cast<const char*>(file->hits.data()),
+                                                  file->hits.size() * sizeof(uint64_t));
+            if (!code || !seen || !code_arcs || !seen_arcs || !hits) return NULL;
+
+            PyPtr<> t = PyTuple_Pack(5, (PyObject*)code, (PyObject*)seen, (PyObject*)hits,
+                                     (PyObject*)code_arcs, (PyObject*)seen_arcs);
+            if (!t || PyDict_SetItem(result, file->filename, t) < 0) {
+                return NULL;
+            }
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+
+    /**
+     * Returns a dictionary mapping file names to sets of branch arcs, as (from, to) tuples,
+     * seen since the last call, clearing them.
+     */
+    PyObject* get_new_arcs() {
+        PyPtr<> result = PyDict_New();
+        if (!result) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+        drain_seen();
+
+        for (auto& file : _files) {
+            if (file->new_seen_arcs.empty()) continue;
+
+            PyPtr<> arcs = PySet_New(NULL);
+            if (!arcs) return NULL;
+
+            for (auto& arc : file->new_seen_arcs) {
+                PyPtr<> t = arc_tuple(arc);
+                if (!t || PySet_Add(arcs, t) < 0) return NULL;
+            }
+
+            if (PyDict_SetItem(result, file->filename, arcs) < 0) {
+                return NULL;
+            }
+
+            file->new_seen_arcs.clear();
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+
+    /**
+     * Returns a dictionary mapping the names of files with code arcs to a tuple with
+     * sorted lists of arcs executed and missing.
+     */
+    PyObject* get_arc_coverage() {
+        PyPtr<> result = PyDict_New();
+        if (!result) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+        drain_seen();
+
+        for (auto& file : _files) {
+            if (file->code_arcs.empty()) continue;
+
+            PyPtr<> executed = to_list(file->seen_arcs);
+            if (!executed) return NULL;
+
+            PyPtr<> missing = to_list(file->code_arcs, &file->seen_arcs);
+            if (!missing) return NULL;
+
+            PyPtr<> t = PyTuple_Pack(2, (PyObject*)executed, (PyObject*)missing);
+            if (!t || PyDict_SetItem(result, file->filename, t) < 0) {
+                return NULL;
+            }
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+
+    /**
+     * Forgets the lines and arcs seen, and any execution counts, keeping the code lines
+     * and arcs.  A forked child does this, as it reports just what it executes itself.
+     * Trackers the parent signalled, but didn't yet de-instrument, signal again, so that
+     * their lines get into the child's coverage and are de-instrumented there.
+     */
+    void forget_seen() {
+        std::lock_guard<ColdLock> guard(_lock);
+        drain_seen();
+        _generation.fetch_add(1, std::memory_order_relaxed);
+
+        for (auto& file : _files) {
+            file->seen.clear();
+            file->new_seen.clear();
+            file->marked.clear();
+            file->seen_arcs.clear();
+            file->new_seen_arcs.clear();
+            std::fill(file->hits.begin(), file->hits.end(), 0);
+        }
+    }
+
+    /**
+     * Returns a dictionary mapping file names to dictionaries of line execution counts,
+     * for the files whose executions are counted here.
+     */
+    PyObject* get_hit_counts() {
+        PyPtr<> result = PyDict_New();
+        if (!result) return NULL;
+
+        std::lock_guard<ColdLock> guard(_lock);
+
+        for (auto& file : _files) {
+            if (file->hits.empty()) continue;
+
+            PyPtr<> counts = to_dict(file->hits);
+            if (!counts || PyDict_SetItem(result, file->filename, counts) < 0) {
+                return NULL;
+            }
+        }
+
+        Py_IncRef(result);
+        return result;
+    }
+};
+
+
+std::atomic<uint64_t> LineMap::_next_serial(0);
+
+
+#if PY_VERSION_HEX >= 0x030c0000
+// index of the code object extra slot holding its owner; see code_owner()
+static Py_ssize_t code_owner_index = -1;
+
+/**
+ * sys.monitoring takes a single handler per event for the tool, so Slipcover instances
+ * share them.  Each code object has the instance that last instrumented it (its owner)
+ * in an extra slot, as a (line map, arcs) tuple, where arcs, if collecting branches,
+ * is a dictionary of {(branch offset, destination offset): (from line, to line)}, and
+ * None otherwise.  Looking it up there is much cheaper than hashing the code object.
+ *
+ * Returns the owner (borrowed), or nullptr, without an exception set, if none.
+ */
+static PyObject*
+code_owner(PyObject* code) {
+    void* owner = nullptr;
+    if (PyUnstable_Code_GetExtra(code, code_owner_index, &owner) < 0) return nullptr;
+    return static_cast<PyObject*>(owner);
+}
+
+
+/**
+ * Handles sys.monitoring LINE events, marking the lines seen in the line map of the
+ * code object's owner.  Unless that counts executions, it returns DISABLE, so that each
+ * location only reports once; code objects without an owner are disabled right away.
+ */
+struct LineHandlerObject {
+    PyObject_HEAD
+    vectorcallfunc vectorcall;
+    PyObject* disable;
+};
+
+
+static PyObject*
+LineHandler_vectorcall(PyObject* self, PyObject* const* args, size_t nargsf, PyObject* kwnames) {
+    LineHandlerObject* handler = reinterpret_cast<LineHandlerObject*>(self);
+
+    if (PyVectorcall_NARGS(nargsf) != 2 || !PyCode_Check(args[0])) {
+        PyErr_SetString(PyExc_TypeError, "expected (code, line_number)");
+        return NULL;
+    }
+
+    PyObject* owner = code_owner(args[0]);
+    if (!owner) {
+        if (PyErr_Occurred()) return NULL;
+        Py_IncRef(handler->disable);
+        return handler->disable;
+    }
+
+    LineMap* map = static_cast<LineMap*>(PyCapsule_GetPointer(PyTuple_GET_ITEM(owner, 0), LineMap::CAPSULE_NAME));
+    if (!map) return NULL;
+
+    FileLines* file = map->get(reinterpret_cast<PyCodeObject*>(args[0])->co_filename);
+    if (!file) return NULL;
+
+    long line = PyLong_AsLong(args[1]);
+    if (line == -1 && PyErr_Occurred()) return NULL;
+
+    if (!file->marked.test(line)) {
+        map->mark_seen(file, line);
+    }
+
+    if (map->counting()) {
+        map->count_hit(file, line);
+        Py_RETURN_NONE;
+    }
+
+    Py_IncRef(handler->disable);
+    return handler->disable;
+}
+
+
+static void
+LineHandler_dealloc(LineHandlerObject* self) {
+    Py_DecRef(self->disable);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+PyTypeObject LineHandlerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "slipcover.tracker.LineHandler",        // tp_name
+    sizeof(LineHandlerObject),              // tp_basicsize
+    0,                                      // tp_itemsize
+    (destructor)LineHandler_dealloc,        // tp_dealloc
+};
+
+
+/**
+ * Handles sys.monitoring BRANCH events, marking the arcs seen in the line map of the
+ * code object's owner, which also has its arcs (see code_owner()).  sys.monitoring can
+ * only disable a branch instruction as a whole, not each of its destinations, so it
+ * returns DISABLE only once both have been seen.
+ */
+struct BranchHandlerObject {
+    PyObject_HEAD
+    vectorcallfunc vectorcall;
+    PyObject* disable;
+
+    struct State {
+        ColdLock lock;
+        // (code, branch offset) -> the serial of the line map it was seen for and the
+        // destination seen first; holds a reference to the code
+        std::map<std::pair<PyObject*, long>, std::pair<uint64_t, long>> first_dest;
+
+        ~State() {
+            for (auto& entry : first_dest) {
+                Py_DecRef(entry.first.first);
+            }
+        }
+    }* state;
+};
+
+
+static PyObject*
+BranchHandler_vectorcall(PyObject* self, PyObject* const* args, size_t nargsf, PyObject* kwnames) {
+    BranchHandlerObject* handler = reinterpret_cast<BranchHandlerObject*>(self);
+
+    if (PyVectorcall_NARGS(nargsf) != 3 || !PyCode_Check(args[0])) {
+        PyErr_SetString(PyExc_TypeError, "expected (code, instruction_offset, destination_offset)");
+        return NULL;
+    }
+
+    long source = PyLong_AsLong(args[1]);
+    if (source == -1 && PyErr_Occurred()) return NULL;
+    long dest = PyLong_AsLong(args[2]);
+    if (dest == -1 && PyErr_Occurred()) return NULL;
+
+    PyObject* owner = code_owner(args[0]);
+    if (!owner) {
+        if (PyErr_Occurred()) return NULL;
+        Py_IncRef(handler->disable);
+        return handler->disable;
+    }
+
+    LineMap* map = static_cast<LineMap*>(PyCapsule_GetPointer(PyTuple_GET_ITEM(owner, 0), LineMap::CAPSULE_NAME));
+    if (!map) return NULL;
+
+    bool both_seen = false, seen_before = false;
+    {
+        std::lock_guard<ColdLock> guard(handler->state->lock);
+        auto key = std::make_pair(args[0], source);
+        auto it = handler->state->first_dest.find(key);
+        if (it == handler->state->first_dest.end()) {
+            Py_IncRef(args[0]);
+            handler->state->first_dest.emplace(key, std::make_pair(map->serial(), dest));
+        }
+        else if (it->second.first != map->serial()) {
+            it->second = std::make_pair(map->serial(), dest);   // seen for an earlier owner
+        }
+        else if (it->second.second != dest) {
+            Py_DecRef(args[0]);
+            handler->state->first_dest.erase(it);
+            both_seen = true;
+        }
+        else {
+            seen_before = true;     // the same destination again, such as a loop's back edge
+        }
+    }
+
+    if (seen_before) Py_RETURN_NONE;
+
+    PyObject* code_arcs = PyTuple_GET_ITEM(owner, 1);
+
+    if (code_arcs != Py_None) {
+        PyPtr<> key = PyTuple_Pack(2, args[1], args[2]);
+        if (!key) return NULL;
+
+        PyObject* arc = PyDict_GetItemWithError(code_arcs, key);    // borrowed
+        if (!arc && PyErr_Occurred()) return NULL;
+
+        if (arc) {  // outcomes staying in the same line have no arc
+            long from_line, to_line;
+            if (!PyArg_ParseTuple(arc, "ll", &from_line, &to_line)) return NULL;
+
+            FileLines* file = map->get(reinterpret_cast<PyCodeObject*>(args[0])->co_filename);
+            if (!file) return NULL;
+
+            map->mark_seen(file, from_line, to_line);
+        }
+    }
+
+    if (both_seen) {
+        Py_IncRef(handler->disable);
+        return handler->disable;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+static void
+BranchHandler_dealloc(BranchHandlerObject* self) {
+    Py_DecRef(self->disable);
+    delete self->state;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+PyTypeObject BranchHandlerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "slipcover.tracker.BranchHandler",      // tp_name
+    sizeof(BranchHandlerObject),            // tp_basicsize
+    0,                                      // tp_itemsize
+    (destructor)BranchHandler_dealloc,      // tp_dealloc
+};
+#endif
+
+
+/**
+ * Returns a new reference to a weak reference's object, or nullptr if it's gone.
+ */
+static PyObject*
+weakref_get(PyObject* ref) {
+#if PY_VERSION_HEX >= 0x030d0000
+    PyObject* obj;
+    if (PyWeakref_GetRef(ref, &obj) < 0) {
+        PyErr_Clear();
+        return nullptr;
+    }
+    return obj;
+#else
+    PyObject* obj = PyWeakref_GetObject(ref);    // borrowed
+    if (!obj || obj == Py_None) {
+        PyErr_Clear();
+        return nullptr;
+    }
+    Py_IncRef(obj);
+    return obj;
+#endif
+}
+
+
+/**
+ * Indexes live function objects by their code object, so that they can be pointed to
+ * de-instrumented code without searching for them.  Instrumented code calls it with
+ * each function object it creates; it keeps a weak reference to it.
+ */
+struct FunctionIndexObject {
+    PyObject_HEAD
+    vectorcallfunc vectorcall;
+
+    struct Functions {
+        std::vector<PyObject*> refs;    // weak references
+        size_t prune_at = 8;            // size at which to drop those to functions gone
+    };
+
+    struct State {
+        ColdLock lock;
+        // by code object's identity, as edited code objects may compare equal; holds a
+        // reference to the code
+        std::unordered_map<PyObject*, Functions> by_code;
+
+        ~State() {
+            for (auto& [code, functions] : by_code) {
+                for (PyObject* ref : functions.refs) {
+                    Py_DecRef(ref);
+                }
+                Py_DecRef(code);
+            }
+        }
+    }* state;
+
+    /**
+     * Returns the functions indexed for a code object, removing them from the index.
+     */
+    PyObject* take(PyObject* code) {
+        std::vector<PyObject*> refs;
+        {
+            std::lock_guard<ColdLock> guard(state->lock);
+            auto it = state->by_code.find(code);
+            if (it != state->by_code.end()) {
+                refs.swap(it->second.refs);
+                state->by_code.erase(it);
+                Py_DecRef(code);
+            }
+        }
+
+        PyPtr<> result = PyList_New(0);
+        bool ok = !!result;
+        for (PyObject* ref : refs) {
+            if (ok) {
+                if (PyPtr<> f = weakref_get(ref)) {
+                    ok = PyList_Append(result, f) == 0;
+                }
+            }
+            Py_DecRef(ref);
+        }
+        if (!ok) return NULL;
+
+        Py_IncRef(result);
+        return result;
+    }
+};
+
+
+static PyObject*
+FunctionIndex_vectorcall(PyObject* self, PyObject* const* args, size_t nargsf, PyObject* kwnames) {
+    FunctionIndexObject* index = reinterpret_cast<FunctionIndexObject*>(self);
+
+    if (PyVectorcall_NARGS(nargsf) != 1 || !PyFunction_Check(args[0])) {
+        PyErr_SetString(PyExc_TypeError, "expected a function");
+        return NULL;
+    }
+
+    PyObject* ref = PyWeakref_NewRef(args[0], NULL);
+    if (!ref) return NULL;
+
+    PyObject* code = PyFunction_GET_CODE(args[0]);
+
+    std::lock_guard<ColdLock> guard(index->state->lock);
+    auto [it, inserted] = index->state->by_code.try_emplace(code);
+    if (inserted) {
+        Py_IncRef(code);
+    }
+
+    auto& functions = it->second;
+    if (functions.refs.size() >= functions.prune_at) {
+        auto live_end = std::remove_if(functions.refs.begin(), functions.refs.end(), [](PyObject* r) {
+            PyPtr<> f = weakref_get(r);
+            if (f) return false;
+            Py_DecRef(r);
+            return true;
+        });
+        functions.refs.erase(live_end, functions.refs.end());
+        functions.prune_at = std::max(size_t(8), 2 * functions.refs.size());
+    }
+    functions.refs.push_back(ref);
+
+    Py_RETURN_NONE;
+}
+
+
+static void
+FunctionIndex_dealloc(FunctionIndexObject* self) {
+    delete self->state;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+PyTypeObject FunctionIndexType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "slipcover.tracker.FunctionIndex",      // tp_name
+    sizeof(FunctionIndexObject),            // tp_basicsize
+    0,                                      // tp_itemsize
+    (destructor)FunctionIndex_dealloc,      // tp_dealloc
+};
+
+
+class TrackerSlab;
+
+/**
+ * Tracks code coverage for a single line, or for a branch arc from one line
+ * to another; allocated within a TrackerSlab.
+ * It may be signalled from several threads at once.
+ */
+class Tracker {
+    TrackerSlab* _slab;
+    long _line;
+    long _to_line;  // if tracking an arc, the line it goes to; 0 otherwise
+    std::atomic<uint32_t> _signalled;   // line map generation signalled in; 0 if none
+    std::atomic<bool> _instrumented;
+    std::atomic<long long> _d_miss_count;
+    std::atomic<long long> _u_miss_count;
+    std::atomic<long long> _hit_count;
+    std::atomic<long long> _d_threshold;    // D misses after which to request a pass
+
 public:
-    // assumes a new reference
-    PyPtr(O* o) : _obj(o) {}
+    Tracker(TrackerSlab* slab, long line, long to_line, int d_threshold):
+        _slab(slab), _line(line), _to_line(to_line),
+        _signalled(0), _instrumented(true),
+        _d_miss_count(-1), _u_miss_count(0), _hit_count(0), _d_threshold(d_threshold) {}
+
+    inline PyObject* signal();
+
+
+    PyObject* hit() {
+        increment(_hit_count);
+        Py_RETURN_NONE;
+    }
+
+
+    PyObject* deinstrument() {
+        _instrumented.store(false, std::memory_order_relaxed);
+        Py_RETURN_NONE;
+    }
+
+
+    inline PyObject* get_stats();
+
+
+    PyObject* get_arc() {
+        if (!_to_line) Py_RETURN_NONE;
+        return Py_BuildValue("(ll)", _line, _to_line);
+    }
+
+
+    TrackerSlab* slab() const {
+        return _slab;
+    }
+};
+
+
+extern PyTypeObject TrackerType;
+
+static PyObject*
+Tracker_vectorcall(PyObject* self, PyObject* const* args, size_t nargsf, PyObject* kwnames);
+
+#ifdef Py_GIL_DISABLED
+// Lines next to each other may well run in different threads; keep their trackers
+// on separate cache lines.
+#define TRACKER_ALIGNMENT alignas(64)
+#else
+#define TRACKER_ALIGNMENT
+#endif
+
+/**
+ * Python object for a Tracker.  Probes call it directly (with no arguments)
+ * to signal that its line was reached.
+ */
+struct TRACKER_ALIGNMENT TrackerObject {
+    PyObject_HEAD
+    vectorcallfunc vectorcall;
+    Tracker tracker;
+
+    TrackerObject(TrackerSlab* slab, long line, long to_line, int d_threshold) :
+        tracker(slab, line, to_line, d_threshold) {
+        PyObject_Init(reinterpret_cast<PyObject*>(this), &TrackerType);
+        vectorcall = Tracker_vectorcall;
+    }
+};
+
+
+/**
+ * Holds the tracker objects for a code object's lines in a single allocation,
+ * along with the state they share.  The tracker objects handed out each hold
+ * a reference to the slab's capsule, so that they are all freed together once
+ * the last is gone.
+ */
+class TrackerSlab {
+    friend class Tracker;
+
+    PyPtr<> _sci;
+    PyPtr<> _line_map;
+    LineMap* _map;
+    FileLines* _file;
+    TrackerObject* _trackers;   // constructed in place, as they can't be moved
+    size_t _count;
+    PyObject* _capsule; // borrowed: it owns us
+
+    TrackerSlab(PyObject* sci, PyObject* line_map, LineMap* map, FileLines* file, int d_threshold,
+                const std::vector<FileLines::Arc>& lines):
+        _sci(PyPtr<>::borrowed(sci)), _line_map(PyPtr<>::borrowed(line_map)),
+        _map(map), _file(file),
+        _trackers(static_cast<TrackerObject*>(::operator new(sizeof(TrackerObject) * lines.size(),
+                                                             std::align_val_t(alignof(TrackerObject))))),
+        _count(lines.size()), _capsule(nullptr) {
+        for (size_t i = 0; i < _count; ++i) {
+            new (&_trackers[i]) TrackerObject(this, lines[i].first, lines[i].second, d_threshold);
+        }
+    }
+
+public:
+    ~TrackerSlab() {
+        for (size_t i = 0; i < _count; ++i) {
+            _trackers[i].~TrackerObject();
+        }
+        ::operator delete(_trackers, std::align_val_t(alignof(TrackerObject)));
+    }
+
+
+    PyObject* capsule() const {
+        return _capsule;
+    }
+
+
+    static constexpr const char* CAPSULE_NAME = "slipcover.TrackerSlab";
+
+
+    /**
+     * Creates a slab with trackers for the given sequence of line numbers (or, if
+     * arcs is set, of (from, to) line pairs), returning the capsule that owns it.
+     */
+    static PyObject*
+    newCapsule(PyObject* sci, PyObject* filename, PyObject* linenos, PyObject* d_threshold_obj,
+               bool arcs = false) {
+        PyPtr<> line_map = PyObject_GetAttrString(sci, "line_map");
+        if (!line_map) {
+            return NULL;
+        }
+
+        LineMap* map = static_cast<LineMap*>(PyCapsule_GetPointer(line_map, LineMap::CAPSULE_NAME));
+        if (!map) {
+            return NULL;
+        }
+
+        FileLines* file = map->get(filename);
+        if (!file) {
+            return NULL;
+        }
+
+        long d_threshold = PyLong_AsLong(d_threshold_obj);
+        if (d_threshold == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+
+        PyPtr<> seq = PySequence_Fast(linenos, "line numbers must be a sequence");
+        if (!seq) {
+            return NULL;
+        }
+
+        std::vector<FileLines::Arc> lines(PySequence_Fast_GET_SIZE((PyObject*)seq));
+        for (size_t i = 0; i < lines.size(); ++i) {
+            PyObject* item = PySequence_Fast_GET_ITEM((PyObject*)seq, i);
+            if (arcs) {
+                if (!PyArg_ParseTuple(item, "ll", &lines[i].first, &lines[i].second)) {
+                    return NULL;
+                }
+            }
+            else {
+                lines[i].first = PyLong_AsLong(item);
+                if (lines[i].first == -1 && PyErr_Occurred()) {
+                    return NULL;
+                }
+            }
+        }
+
+        std::unique_ptr<TrackerSlab> slab(new TrackerSlab(sci, line_map, map, file, d_threshold, lines));
+
+        PyObject* capsule = PyCapsule_New(slab.get(), CAPSULE_NAME,
+                                          [](PyObject* cap) {
+                                              delete (TrackerSlab*)PyCapsule_GetPointer(cap, CAPSULE_NAME);
+                                          });
+        if (capsule) {
+            slab->_capsule = capsule;
+            slab.release();    // now owned by the capsule
+        }
+        return capsule;
+    }
+
+
+    /**
+     * Registers trackers for the given sequence of line numbers (or arcs), returning
+     * a list with a tracker object for each.
+     */
+    static PyObject*
+    register_lines(PyObject* sci, PyObject* filename, PyObject* linenos, PyObject* d_threshold,
+                   bool arcs = false) {
+        PyPtr<> slab_capsule = newCapsule(sci, filename, linenos, d_threshold, arcs);
+        if (!slab_capsule) {
+            return NULL;
+        }
+        TrackerSlab* slab = static_cast<TrackerSlab*>(PyCapsule_GetPointer(slab_capsule, CAPSULE_NAME));
+
+        PyPtr<> result = PyList_New(slab->_count);
+        if (!result) {
+            return NULL;
+        }
 
-    static PyPtr borrowed(O* o) {
-        Py_IncRef((PyObject*)o);
-        return PyPtr(o);
+        for (size_t i = 0; i < slab->_count; ++i) {
+            // the list takes the object's initial reference; the object, one to the slab
+            Py_IncRef(slab_capsule);
+            PyList_SET_ITEM((PyObject*)result, i, reinterpret_cast<PyObject*>(&slab->_trackers[i]));
+        }
+
+        Py_IncRef(result);
+        return result;
     }
 
-    O* operator->() { return _obj; }
 
-    operator O*() { return _obj; }
+    /**
+     * Returns the tracker for a slab capsule and line index.
+     */
+    static Tracker*
+    get(PyObject* capsule, PyObject* index_obj) {
+        TrackerSlab* slab = static_cast<TrackerSlab*>(PyCapsule_GetPointer(capsule, CAPSULE_NAME));
+        if (!slab) {
+            return nullptr;
+        }
+
+        Py_ssize_t index = PyLong_AsSsize_t(index_obj);
+        if (index < 0 || static_cast<size_t>(index) >= slab->_count) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_IndexError, "tracker index out of range");
+            }
+            return nullptr;
+        }
 
-    PyPtr& operator=(O* o) {
-        Py_DecRef((PyObject*)_obj);
-        _obj = o;
-        return *this;
+        return &slab->_trackers[index].tracker;
     }
+};
 
-    // XXX is rvalue operator= worthwhile?
 
-    PyPtr& operator=(PyPtr& ptr) {
-        Py_IncRef((PyObject*)ptr._obj);
-        *this = ptr._obj;
-        return *this;
+PyObject* Tracker::signal() {
+    // Only the thread that sets the generation reports the line
+    const uint32_t generation = _slab->_map->generation();
+    if (_signalled.load(std::memory_order_relaxed) != generation &&
+        _signalled.exchange(generation, std::memory_order_relaxed) != generation) {
+        _slab->_map->mark_seen(_slab->_file, _line, _to_line);
     }
 
-    ~PyPtr() {
-        Py_DecRef((PyObject*)_obj);
-        _obj = 0;
+    if (_slab->_map->counting() && !_to_line) {
+        _slab->_map->count_hit(_slab->_file, _line);
     }
 
-private:
-    O* _obj;
-};
+    if (_instrumented.load(std::memory_order_relaxed)) {
+        // Limit D misses by deinstrumenting once we see several for a line
+        // Any other lines getting D misses get deinstrumented at the same time,
+        // so this needn't be a large threshold.  Slipcover either de-instruments right
+        // away or hands it off to a background thread.
+        if (_slab->_map->policy().d_miss(increment(_d_miss_count), _d_threshold)) {
+            PyPtr<> threshold_reached = PyUnicode_FromString("threshold_reached");
+            PyPtr<> result = PyObject_CallMethodObjArgs(_slab->_sci, threshold_reached, NULL);
+        }
+    }
+    else {
+        increment(_u_miss_count);
+    }
+
+    Py_RETURN_NONE;
+}
 
 
-/**
- * Tracks code coverage.
- */
-class Tracker {
-    PyPtr<> _sci;
-    PyPtr<> _filename;
-    PyPtr<> _lineno;
-    bool _signalled;
-    bool _instrumented;
-    int _d_miss_count;
-    int _u_miss_count;
-    int _hit_count;
-    int _d_threshold;
+PyObject* Tracker::get_stats() {
+    long long d_misses = _d_miss_count.load(std::memory_order_relaxed);
+    long long u_misses = _u_miss_count.load(std::memory_order_relaxed);
+    long long hits = _hit_count.load(std::memory_order_relaxed);
 
-public:
-    Tracker(PyObject* sci, PyObject* filename, PyObject* lineno, PyObject* d_threshold):
-        _sci(PyPtr<>::borrowed(sci)), _filename(PyPtr<>::borrowed(filename)),
-        _lineno(PyPtr<>::borrowed(lineno)),
-        _signalled(false), _instrumented(true),
-        _d_miss_count(-1), _u_miss_count(0), _hit_count(0),
-        _d_threshold(PyLong_AsLong(d_threshold)) {}
+    PyPtr<> lineno = PyLong_FromLong(_line);
+    PyPtr<> d_miss_count = PyLong_FromLongLong(std::max(d_misses, 0LL));
+    PyPtr<> u_miss_count = PyLong_FromLongLong(u_misses);
+    PyPtr<> total_count = PyLong_FromLongLong(1 + d_misses + u_misses + hits);
+    return PyTuple_Pack(5, (PyObject*)_slab->_file->filename, (PyObject*)lineno,
+                        (PyObject*)d_miss_count, (PyObject*)u_miss_count,
+                        (PyObject*)total_count);
+}
 
 
-    static PyObject*
-    newCapsule(Tracker* t) {
-        return PyCapsule_New(t, NULL,
-                             [](PyObject* cap) {
-                                 delete (Tracker*)PyCapsule_GetPointer(cap, NULL);
-                             });
+static PyObject*
+Tracker_vectorcall(PyObject* self, PyObject* const* args, size_t nargsf, PyObject* kwnames) {
+    if (PyVectorcall_NARGS(nargsf) != 0 || kwnames) {
+        PyErr_SetString(PyExc_TypeError, "Tracker takes no arguments");
+        return NULL;
     }
 
+    return reinterpret_cast<TrackerObject*>(self)->tracker.signal();
+}
 
-    PyObject* signal() {
-        if (!_signalled) {
-            _signalled = true;
 
-            PyPtr<> new_lines_seen = PyObject_GetAttrString(_sci, "new_lines_seen");
-            if (!new_lines_seen) {
-                PyErr_SetString(PyExc_Exception, "new_lines_seen missing");
-                return NULL;
-            }
+static void
+Tracker_dealloc(TrackerObject* self) {
+    // The object's memory belongs to its slab, which is freed with its capsule.
+    Py_DecRef(self->tracker.slab()->capsule());
+}
 
-            PyPtr<> line_set = PyObject_GetItem(new_lines_seen, _filename);
-            if (!line_set) {
-                PyErr_SetString(PyExc_Exception, "line_set missing");
-                return NULL;
-            }
 
-            if (PySet_Add(line_set, _lineno) < 0) {
-                PyErr_SetString(PyExc_Exception, "Unable to add to set");
-                return NULL;
-            }
-        }
+PyTypeObject TrackerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "slipcover.tracker.Tracker",            // tp_name
+    sizeof(TrackerObject),                  // tp_basicsize
+    0,                                      // tp_itemsize
+    (destructor)Tracker_dealloc,            // tp_dealloc
+};
 
-        if (_instrumented) {
-            // Limit D misses by deinstrumenting once we see several for a line
-            // Any other lines getting D misses get deinstrumented at the same time,
-            // so this needn't be a large threshold.
-            if (++_d_miss_count == _d_threshold) {
-                PyPtr<> deinstrument_seen = PyUnicode_FromString("deinstrument_seen");
-                PyPtr<> result = PyObject_CallMethodObjArgs(_sci, deinstrument_seen, NULL);
-            }
-        }
-        else {
-            ++_u_miss_count;
-        }
 
-        Py_RETURN_NONE;
+PyObject*
+tracker_register(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    if (nargs < 4) {
+        PyErr_SetString(PyExc_Exception, "Missing argument(s)");
+        return NULL;
     }
 
+    PyPtr<> linenos = PyTuple_Pack(1, args[2]);
+    if (!linenos) {
+        return NULL;
+    }
 
-    PyObject* hit() {
-        ++_hit_count;
-        Py_RETURN_NONE;
+    PyPtr<> trackers = TrackerSlab::register_lines(args[0], args[1], linenos, args[3]);
+    if (!trackers) {
+        return NULL;
     }
 
+    PyObject* t = PyList_GET_ITEM((PyObject*)trackers, 0);
+    Py_IncRef(t);
+    return t;
+}
 
-    PyObject* deinstrument() {
-        _instrumented = false;
-        Py_RETURN_NONE;
+
+PyObject*
+tracker_register_many(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    if (nargs < 4) {
+        PyErr_SetString(PyExc_Exception, "Missing argument(s)");
+        return NULL;
     }
 
+    return TrackerSlab::register_lines(args[0], args[1], args[2], args[3]);
+}
+
 
-    PyObject* get_stats() {
-        PyPtr<> d_miss_count = PyLong_FromLong(std::max(_d_miss_count, 0));
-        PyPtr<> u_miss_count = PyLong_FromLong(_u_miss_count);
-        PyPtr<> total_count = PyLong_FromLong(1 + _d_miss_count + _u_miss_count + _hit_count);
-        return PyTuple_Pack(5, (PyObject*)_filename, (PyObject*)_lineno,
-                            (PyObject*)d_miss_count, (PyObject*)u_miss_count,
-                            (PyObject*)total_count);
+PyObject*
+tracker_register_arcs(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    if (nargs < 4) {
+        PyErr_SetString(PyExc_Exception, "Missing argument(s)");
+        return NULL;
     }
-};
+
+    return TrackerSlab::register_lines(args[0], args[1], args[2], args[3], true);
+}
 
 
 PyObject*
-tracker_register(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+tracker_register_code(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
     if (nargs < 4) {
         PyErr_SetString(PyExc_Exception, "Missing argument(s)");
         return NULL;
     }
 
-    return Tracker::newCapsule(new Tracker(args[0], args[1], args[2], args[3]));
+    return TrackerSlab::newCapsule(args[0], args[1], args[2], args[3]);
+}
+
+
+#if PY_VERSION_HEX >= 0x030c0000
+PyObject*
+tracker_new_line_handler(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    PyObject* monitoring = PySys_GetObject("monitoring");    // borrowed
+    if (!monitoring) {
+        PyErr_SetString(PyExc_Exception, "sys.monitoring not available");
+        return NULL;
+    }
+
+    PyPtr<> disable = PyObject_GetAttrString(monitoring, "DISABLE");
+    if (!disable) {
+        return NULL;
+    }
+
+    LineHandlerObject* handler = PyObject_New(LineHandlerObject, &LineHandlerType);
+    if (!handler) {
+        return NULL;
+    }
+
+    handler->vectorcall = LineHandler_vectorcall;
+    handler->disable = disable;
+    Py_IncRef(handler->disable);
+
+    return reinterpret_cast<PyObject*>(handler);
+}
+
+
+PyObject*
+tracker_new_branch_handler(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    PyObject* monitoring = PySys_GetObject("monitoring");    // borrowed
+    if (!monitoring) {
+        PyErr_SetString(PyExc_Exception, "sys.monitoring not available");
+        return NULL;
+    }
+
+    PyPtr<> disable = PyObject_GetAttrString(monitoring, "DISABLE");
+    if (!disable) {
+        return NULL;
+    }
+
+    BranchHandlerObject* handler = PyObject_New(BranchHandlerObject, &BranchHandlerType);
+    if (!handler) {
+        return NULL;
+    }
+
+    handler->vectorcall = BranchHandler_vectorcall;
+    handler->disable = disable;
+    Py_IncRef(handler->disable);
+    handler->state = new BranchHandlerObject::State;
+
+    return reinterpret_cast<PyObject*>(handler);
+}
+
+
+/**
+ * Makes a Slipcover instance the owner of a code object's sys.monitoring events, given
+ * its line map and, if collecting branches, the code's arcs (see code_owner()).
+ * Returns the line map of the previous owner, if any, and None otherwise.
+ */
+PyObject*
+tracker_set_code_owner(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    if (nargs < 3) {
+        PyErr_SetString(PyExc_Exception, "Missing argument(s)");
+        return NULL;
+    }
+
+    if (!PyCode_Check(args[0])) {
+        PyErr_SetString(PyExc_TypeError, "expected a code object");
+        return NULL;
+    }
+
+    if (!PyCapsule_GetPointer(args[1], LineMap::CAPSULE_NAME)) {
+        return NULL;
+    }
+
+    if (args[2] != Py_None && !PyDict_Check(args[2])) {
+        PyErr_SetString(PyExc_TypeError, "arcs must be a dict or None");
+        return NULL;
+    }
+
+    PyPtr<> previous = nullptr;
+    if (PyObject* owner = code_owner(args[0])) {
+        previous = PyPtr<>::borrowed(PyTuple_GET_ITEM(owner, 0));
+    }
+    else if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    PyObject* owner = PyTuple_Pack(2, args[1], args[2]);
+    if (!owner) return NULL;
+
+    // the slot's free function releases the previous owner
+    if (PyUnstable_Code_SetExtra(args[0], code_owner_index, owner) < 0) {
+        Py_DecRef(owner);
+        return NULL;
+    }
+
+    if (!previous) Py_RETURN_NONE;
+    Py_IncRef(previous);
+    return previous;
+}
+#endif
+
+
+PyObject*
+tracker_new_function_index(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    FunctionIndexObject* index = PyObject_New(FunctionIndexObject, &FunctionIndexType);
+    if (!index) {
+        return NULL;
+    }
+
+    index->vectorcall = FunctionIndex_vectorcall;
+    index->state = new FunctionIndexObject::State;
+
+    return reinterpret_cast<PyObject*>(index);
+}
+
+
+PyObject*
+tracker_take_functions(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    if (nargs < 2) {
+        PyErr_SetString(PyExc_Exception, "Missing argument(s)");
+        return NULL;
+    }
+
+    if (!PyObject_TypeCheck(args[0], &FunctionIndexType)) {
+        PyErr_SetString(PyExc_TypeError, "expected a function index");
+        return NULL;
+    }
+
+    return reinterpret_cast<FunctionIndexObject*>(args[0])->take(args[1]);
+}
+
+
+PyObject*
+tracker_new_line_map(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    uint64_t count_every = 0;
+    if (nargs > 0) {
+        count_every = PyLong_AsUnsignedLongLong(args[0]);
+        if (count_every == (uint64_t)-1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+
+    int adaptive_threshold = 0;
+    if (nargs > 1 && (adaptive_threshold = PyObject_IsTrue(args[1])) < 0) {
+        return NULL;
+    }
+
+    std::unique_ptr<CoverageFile> coverage_file;
+    if (nargs > 2 && args[2] != Py_None) {
+        PyObject* path_bytes;
+        if (!PyUnicode_FSConverter(args[2], &path_bytes)) {
+            return NULL;
+        }
+        PyPtr<> path = path_bytes;
+
+        coverage_file = CoverageFile::create(PyBytes_AsString(path), count_every != 0);
+        if (!coverage_file) {
+            return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, args[2]);
+        }
+    }
+
+    return LineMap::newCapsule(new LineMap(count_every, adaptive_threshold,
+                                           std::move(coverage_file)));
+}
+
+
+static LineMap*
+get_line_map(PyObject* const* args, Py_ssize_t nargs, Py_ssize_t required) {
+    if (nargs < required) {
+        PyErr_SetString(PyExc_Exception, "Missing argument(s)");
+        return nullptr;
+    }
+
+    return static_cast<LineMap*>(PyCapsule_GetPointer(args[0], LineMap::CAPSULE_NAME));
+}
+
+
+PyObject*
+tracker_deinstrument_pass_done(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 2);
+    if (!map) return NULL;
+
+    double seconds = PyFloat_AsDouble(args[1]);
+    if (seconds == -1.0 && PyErr_Occurred()) return NULL;
+
+    map->policy().pass_done(seconds);
+    Py_RETURN_NONE;
+}
+
+
+PyObject*
+tracker_add_code_lines(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 3);
+    return map ? map->add_code_lines(args[1], args[2]) : NULL;
+}
+
+
+PyObject*
+tracker_add_code_arcs(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 3);
+    return map ? map->add_code_arcs(args[1], args[2]) : NULL;
+}
+
+
+PyObject*
+tracker_get_new_lines(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 1);
+    return map ? map->get_new_lines() : NULL;
+}
+
+
+PyObject*
+tracker_get_coverage(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 1);
+    return map ? map->get_coverage() : NULL;
+}
+
+
+PyObject*
+tracker_get_files(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 1);
+    return map ? map->get_files() : NULL;
+}
+
+
+PyObject*
+tracker_get_coverage_sizes(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 1);
+    return map ? map->get_coverage_sizes() : NULL;
+}
+
+
+PyObject*
+tracker_get_file_coverage(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 2);
+    return map ? map->get_file_coverage(args[1]) : NULL;
+}
+
+
+PyObject*
+tracker_snapshot(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 1);
+    return map ? map->snapshot() : NULL;
+}
+
+
+PyObject*
+tracker_get_new_arcs(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 1);
+    return map ? map->get_new_arcs() : NULL;
+}
+
+
+PyObject*
+tracker_get_arc_coverage(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 1);
+    return map ? map->get_arc_coverage() : NULL;
+}
+
+
+PyObject*
+tracker_get_hit_counts(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 1);
+    return map ? map->get_hit_counts() : NULL;
+}
+
+
+PyObject*
+tracker_forget_seen(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {
+    LineMap* map = get_line_map(args, nargs, 1);
+    if (!map) return NULL;
+
+    map->forget_seen();
+    Py_RETURN_NONE;
+}
+
+/**
+ * Returns the tracker passed to a module function: either a tracker object,
+ * or a slab capsule and the index of a tracker within it.
+ */
+static inline Tracker*
+get_tracker(PyObject* const* args, Py_ssize_t nargs) {
+    if (nargs == 1) {
+        if (Py_TYPE(args[0]) != &TrackerType) {
+            PyErr_SetString(PyExc_TypeError, "expected a Tracker");
+            return nullptr;
+        }
+        return &reinterpret_cast<TrackerObject*>(args[0])->tracker;
+    }
+    if (nargs == 2) {
+        return TrackerSlab::get(args[0], args[1]);
+    }
+
+    PyErr_SetString(PyExc_Exception, nargs < 1 ? "Missing argument" : "Too many arguments");
+    return nullptr;
 }
 
+
 #define METHOD_WRAPPER(method) \
     static PyObject*\
     tracker_##method(PyObject* self, PyObject* const* args, Py_ssize_t nargs) {\
-        if (nargs < 1) {\
-            PyErr_SetString(PyExc_Exception, "Missing argument");\
-            return NULL;\
-        }\
-    \
-        return static_cast<Tracker*>(PyCapsule_GetPointer(args[0], NULL))->method();\
+        Tracker* t = get_tracker(args, nargs);\
+        return t ? t->method() : NULL;\
     }
 
 METHOD_WRAPPER(signal);
 METHOD_WRAPPER(hit);
 METHOD_WRAPPER(deinstrument);
 METHOD_WRAPPER(get_stats);
+METHOD_WRAPPER(get_arc);
 
 
 static PyMethodDef methods[] = {
     {"register",     (PyCFunction)tracker_register, METH_FASTCALL, "registers a new tracker"},
+    {"register_many", (PyCFunction)tracker_register_many, METH_FASTCALL, "registers trackers for a sequence of lines, returning a list"},
+    {"register_arcs", (PyCFunction)tracker_register_arcs, METH_FASTCALL, "registers trackers for a sequence of (from, to) branch arcs, returning a list"},
+    {"register_code", (PyCFunction)tracker_register_code, METH_FASTCALL, "registers a single tracker for a code object's lines, which are then passed by index"},
     {"signal",       (PyCFunction)tracker_signal, METH_FASTCALL, "signals the line was reached"},
     {"hit",          (PyCFunction)tracker_hit, METH_FASTCALL, "signals the line was reached after full deinstrumentation"},
     {"deinstrument", (PyCFunction)tracker_deinstrument, METH_FASTCALL, "marks a tracker deinstrumented"},
     {"get_stats",    (PyCFunction)tracker_get_stats, METH_FASTCALL, "returns tracker stats"},
+    {"get_arc",      (PyCFunction)tracker_get_arc, METH_FASTCALL, "returns the (from, to) arc a tracker tracks, or None if it tracks a line"},
+    {"new_line_map", (PyCFunction)tracker_new_line_map, METH_FASTCALL, "creates a new map of lines seen, optionally counting every Nth execution, adapting thresholds and mirroring into a coverage file"},
+    {"deinstrument_pass_done", (PyCFunction)tracker_deinstrument_pass_done, METH_FASTCALL, "notes how long a de-instrumentation pass took"},
+    {"add_code_lines", (PyCFunction)tracker_add_code_lines, METH_FASTCALL, "notes lines of code in a file"},
+    {"add_code_arcs", (PyCFunction)tracker_add_code_arcs, METH_FASTCALL, "notes branch arcs in a file"},
+    {"get_new_lines", (PyCFunction)tracker_get_new_lines, METH_FASTCALL, "returns and clears lines seen since the last call"},
+    {"get_new_arcs", (PyCFunction)tracker_get_new_arcs, METH_FASTCALL, "returns and clears branch arcs seen since the last call"},
+    {"get_coverage", (PyCFunction)tracker_get_coverage, METH_FASTCALL, "returns lines executed and missing, by file"},
+    {"get_files",    (PyCFunction)tracker_get_files, METH_FASTCALL, "returns the names of files with code lines"},
+    {"get_coverage_sizes", (PyCFunction)tracker_get_coverage_sizes, METH_FASTCALL, "returns the numbers of lines and arcs executed and missing, by file"},
+    {"get_file_coverage", (PyCFunction)tracker_get_file_coverage, METH_FASTCALL, "returns a file's lines and arcs executed and missing, and its execution counts"},
+    {"get_arc_coverage", (PyCFunction)tracker_get_arc_coverage, METH_FASTCALL, "returns branch arcs executed and missing, by file"},
+    {"get_hit_counts", (PyCFunction)tracker_get_hit_counts, METH_FASTCALL, "returns line execution counts, by file, where counted by the tracker module"},
+    {"snapshot",     (PyCFunction)tracker_snapshot, METH_FASTCALL, "returns copies of code and seen lines and arcs and execution counts, by file, leaving new lines and arcs as they are"},
+    {"forget_seen",  (PyCFunction)tracker_forget_seen, METH_FASTCALL, "forgets lines and arcs seen and execution counts, keeping code lines and arcs"},
+    {"new_function_index", (PyCFunction)tracker_new_function_index, METH_FASTCALL, "creates an index of function objects by code object; call it with each function created"},
+    {"take_functions", (PyCFunction)tracker_take_functions, METH_FASTCALL, "returns, and removes from an index, the live functions for a code object"},
+#if PY_VERSION_HEX >= 0x030c0000
+    {"new_line_handler", (PyCFunction)tracker_new_line_handler, METH_FASTCALL, "creates a sys.monitoring LINE event handler"},
+    {"new_branch_handler", (PyCFunction)tracker_new_branch_handler, METH_FASTCALL, "creates a sys.monitoring BRANCH event handler"},
+    {"set_code_owner", (PyCFunction)tracker_set_code_owner, METH_FASTCALL, "sends a code object's sys.monitoring events to a line map, returning the previous one"},
+#endif
     {NULL, NULL, 0, NULL}
 };
 
@@ -196,6 +2048,80 @@ PyInit_tracker() {
         return nullptr;
     }
 
+#ifdef Py_GIL_DISABLED
+    PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
+
+#if PY_VERSION_HEX < 0x03090000
+    TrackerType.tp_flags = Py_TPFLAGS_DEFAULT | _Py_TPFLAGS_HAVE_VECTORCALL;
+#else
+    TrackerType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL;
+#endif
+    TrackerType.tp_doc = "Tracks a line's execution; call it to signal it was reached.";
+    TrackerType.tp_vectorcall_offset = offsetof(TrackerObject, vectorcall);
+    TrackerType.tp_call = PyVectorcall_Call;
+
+    if (PyType_Ready(&TrackerType) < 0) {
+        Py_DecRef(m);
+        return nullptr;
+    }
+
+    Py_IncRef((PyObject*)&TrackerType);
+    if (PyModule_AddObject(m, "Tracker", (PyObject*)&TrackerType) < 0) {
+        Py_DecRef((PyObject*)&TrackerType);
+        Py_DecRef(m);
+        return nullptr;
+    }
+
+#if PY_VERSION_HEX < 0x03090000
+    FunctionIndexType.tp_flags = Py_TPFLAGS_DEFAULT | _Py_TPFLAGS_HAVE_VECTORCALL;
+#else
+    FunctionIndexType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL;
+#endif
+    FunctionIndexType.tp_doc = "Indexes function objects by code object; call it with each function created.";
+    FunctionIndexType.tp_vectorcall_offset = offsetof(FunctionIndexObject, vectorcall);
+    FunctionIndexType.tp_call = PyVectorcall_Call;
+
+    if (PyType_Ready(&FunctionIndexType) < 0) {
+        Py_DecRef(m);
+        return nullptr;
+    }
+
+#if PY_VERSION_HEX >= 0x030c0000
+    code_owner_index = PyUnstable_Eval_RequestCodeExtraIndex([](void* owner) {
+        Py_DecRef(static_cast<PyObject*>(owner));
+    });
+    if (code_owner_index < 0) {
+        Py_DecRef(m);
+        return nullptr;
+    }
+
+    LineHandlerType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL;
+    LineHandlerType.tp_doc = "Handles sys.monitoring LINE events.";
+    LineHandlerType.tp_vectorcall_offset = offsetof(LineHandlerObject, vectorcall);
+    LineHandlerType.tp_call = PyVectorcall_Call;
+
+    if (PyType_Ready(&LineHandlerType) < 0) {
+        Py_DecRef(m);
+        return nullptr;
+    }
+
+    BranchHandlerType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL;
+    BranchHandlerType.tp_doc = "Handles sys.monitoring BRANCH events.";
+    BranchHandlerType.tp_vectorcall_offset = offsetof(BranchHandlerObject, vectorcall);
+    BranchHandlerType.tp_call = PyVectorcall_Call;
+
+    if (PyType_Ready(&BranchHandlerType) < 0) {
+        Py_DecRef(m);
+        return nullptr;
+    }
+#endif
+
+    if (bytecode_add_types(m) < 0) {
+        Py_DecRef(m);
+        return nullptr;
+    }
+
     return m;
 }
 